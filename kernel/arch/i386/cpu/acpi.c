@@ -0,0 +1,297 @@
+#include <stdint.h>
+#include "arch/i386/cpu/acpi.h"
+#include "arch/i386/mm/paging.h"
+#include "console.h"
+
+#define IDENTITY_END  0x80000000u   /* physical == virtual below this */
+
+/* ---------------- firmware memory ---------------- */
+
+static int sig_eq(const void *p, const char *sig, int n)
+{
+    const char *s = p;
+    for (int i = 0; i < n; i++)
+        if (s[i] != sig[i])
+            return 0;
+    return 1;
+}
+
+static uint8_t checksum(const void *p, uint32_t len)
+{
+    const uint8_t *b = p;
+    uint8_t sum = 0;
+    while (len--)
+        sum += *b++;
+    return sum;
+}
+
+/* tables normally sit in low RAM; anything above the identity map is
+ * mapped into the MMIO window */
+static const void *phys_ptr(uint32_t phys, uint32_t len)
+{
+    if (phys < IDENTITY_END && len <= IDENTITY_END - phys)
+        return (const void*)phys;
+    return paging_map_mmio(phys, len);
+}
+
+/* 16-byte aligned scan for a signature with a valid checksum */
+static const void *scan(uint32_t start, uint32_t len, const char *sig,
+                        int siglen, uint32_t csum_len)
+{
+    for (uint32_t p = start; p + csum_len <= start + len; p += 16) {
+        if (sig_eq((const void*)p, sig, siglen) &&
+            checksum((const void*)p, csum_len) == 0)
+            return (const void*)p;
+    }
+    return 0;
+}
+
+/* BIOS data area word; the address goes through a register so the
+ * compiler does not take it for a NULL dereference */
+static uint16_t bda_read16(uint32_t addr)
+{
+    __asm__("" : "+r"(addr));
+    return *(const volatile uint16_t*)addr;
+}
+
+/* EBDA first 1KB, then the BIOS area below 1MB */
+static const void *find_in_bios(const char *sig, int siglen,
+                                uint32_t csum_len, uint32_t bios_start)
+{
+    uint32_t ebda = (uint32_t)bda_read16(0x40E) << 4;    /* EBDA segment */
+    const void *p = 0;
+
+    if (ebda >= 0x80000 && ebda < 0xA0000)
+        p = scan(ebda, 1024, sig, siglen, csum_len);
+    if (!p)
+        p = scan(0x9FC00, 1024, sig, siglen, csum_len);
+    if (!p)
+        p = scan(bios_start, 0x100000 - bios_start, sig, siglen, csum_len);
+    return p;
+}
+
+static void config_defaults(smp_config_t *cfg)
+{
+    cfg->lapic_phys      = 0xFEE00000u;
+    cfg->ioapic_phys     = 0;
+    cfg->ioapic_gsi_base = 0;
+    cfg->ncpus           = 0;
+    cfg->imcr            = 0;
+
+    /* ISA IRQs are identity mapped, edge/high, unless overridden */
+    for (int i = 0; i < 16; i++) {
+        cfg->irq_gsi[i]   = i;
+        cfg->irq_flags[i] = 0;
+    }
+}
+
+static void add_cpu(smp_config_t *cfg, uint8_t apic_id)
+{
+    if (cfg->ncpus < SMP_MAX_CPUS)
+        cfg->apic_ids[cfg->ncpus++] = apic_id;
+}
+
+/* ---------------- ACPI ---------------- */
+
+typedef struct rsdp {
+    char     sig[8];                /* "RSD PTR " */
+    uint8_t  checksum;
+    char     oem[6];
+    uint8_t  revision;
+    uint32_t rsdt;
+} __attribute__((packed)) rsdp_t;
+
+typedef struct sdt_header {
+    char     sig[4];
+    uint32_t length;
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem[6];
+    char     oem_table[8];
+    uint32_t oem_revision;
+    uint32_t creator;
+    uint32_t creator_revision;
+} __attribute__((packed)) sdt_header_t;
+
+typedef struct madt {
+    sdt_header_t hdr;
+    uint32_t     lapic_addr;
+    uint32_t     flags;
+    uint8_t      entries[];
+} __attribute__((packed)) madt_t;
+
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_OVERRIDE       2
+
+#define MADT_CPU_ENABLED    1
+
+static const sdt_header_t *map_table(uint32_t phys)
+{
+    const sdt_header_t *h = phys_ptr(phys, sizeof(*h));
+    if (!h)
+        return 0;
+    /* remap with the full length now that it is known */
+    h = phys_ptr(phys, h->length);
+    if (!h || checksum(h, h->length) != 0)
+        return 0;
+    return h;
+}
+
+int acpi_probe_smp(smp_config_t *cfg)
+{
+    const rsdp_t *rsdp = find_in_bios("RSD PTR ", 8, sizeof(rsdp_t), 0xE0000);
+    if (!rsdp)
+        return -1;
+
+    const sdt_header_t *rsdt = map_table(rsdp->rsdt);
+    if (!rsdt || !sig_eq(rsdt->sig, "RSDT", 4))
+        return -1;
+
+    const madt_t *madt = 0;
+    uint32_t n = (rsdt->length - sizeof(*rsdt)) / 4;
+    const uint32_t *ptrs = (const uint32_t*)(rsdt + 1);
+
+    for (uint32_t i = 0; i < n && !madt; i++) {
+        const sdt_header_t *h = map_table(ptrs[i]);
+        if (h && sig_eq(h->sig, "APIC", 4))
+            madt = (const madt_t*)h;
+    }
+    if (!madt)
+        return -1;
+
+    config_defaults(cfg);
+    cfg->lapic_phys = madt->lapic_addr;
+
+    const uint8_t *p   = madt->entries;
+    const uint8_t *end = (const uint8_t*)madt + madt->hdr.length;
+
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        switch (p[0]) {
+        case MADT_LAPIC:
+            /* p[2] = ACPI processor id, p[3] = APIC id, then flags */
+            if (*(const uint32_t*)(p + 4) & MADT_CPU_ENABLED)
+                add_cpu(cfg, p[3]);
+            break;
+
+        case MADT_IOAPIC:
+            if (!cfg->ioapic_phys) {
+                cfg->ioapic_phys     = *(const uint32_t*)(p + 4);
+                cfg->ioapic_gsi_base = *(const uint32_t*)(p + 8);
+            }
+            break;
+
+        case MADT_OVERRIDE:
+            /* bus 0 (ISA), source IRQ, GSI, INTI flags */
+            if (p[2] == 0 && p[3] < 16) {
+                cfg->irq_gsi[p[3]]   = (uint8_t)*(const uint32_t*)(p + 4);
+                cfg->irq_flags[p[3]] = *(const uint16_t*)(p + 8);
+            }
+            break;
+        }
+        p += p[1];
+    }
+
+    return cfg->ncpus ? 0 : -1;
+}
+
+/* ---------------- MP table ---------------- */
+
+typedef struct mp_float {
+    char     sig[4];                /* "_MP_" */
+    uint32_t config;
+    uint8_t  length;                /* in 16-byte units */
+    uint8_t  spec_rev;
+    uint8_t  checksum;
+    uint8_t  features[5];           /* [0] default config, [1] bit 7 IMCR */
+} __attribute__((packed)) mp_float_t;
+
+typedef struct mp_config {
+    char     sig[4];                /* "PCMP" */
+    uint16_t length;
+    uint8_t  spec_rev;
+    uint8_t  checksum;
+    char     oem[8];
+    char     product[12];
+    uint32_t oem_table;
+    uint16_t oem_size;
+    uint16_t entries;
+    uint32_t lapic_addr;
+    uint16_t ext_length;
+    uint8_t  ext_checksum;
+    uint8_t  reserved;
+} __attribute__((packed)) mp_config_t;
+
+#define MP_PROCESSOR    0       /* 20 bytes, the rest are 8 */
+#define MP_BUS          1
+#define MP_IOAPIC       2
+#define MP_IOINT        3
+
+#define MP_CPU_ENABLED  1
+#define MP_IOAPIC_ENABLED 1
+
+int mptable_probe_smp(smp_config_t *cfg)
+{
+    const mp_float_t *mpf = find_in_bios("_MP_", 4, sizeof(mp_float_t), 0xF0000);
+    if (!mpf)
+        return -1;
+
+    if (mpf->features[0] || !mpf->config) {
+        console_write("smp: MP default configurations are not supported\n");
+        return -1;
+    }
+
+    const mp_config_t *mpc = phys_ptr(mpf->config, sizeof(*mpc));
+    if (!mpc || !sig_eq(mpc->sig, "PCMP", 4))
+        return -1;
+    mpc = phys_ptr(mpf->config, mpc->length);
+    if (!mpc || checksum(mpc, mpc->length) != 0)
+        return -1;
+
+    config_defaults(cfg);
+    cfg->lapic_phys = mpc->lapic_addr;
+    cfg->imcr       = (mpf->features[1] & 0x80) != 0;
+
+    uint8_t ioapic_id = 0xFF;
+    uint32_t isa_buses = 0;         /* bitmap of bus ids 0-31 */
+
+    const uint8_t *p   = (const uint8_t*)(mpc + 1);
+    const uint8_t *end = (const uint8_t*)mpc + mpc->length;
+
+    for (uint32_t i = 0; i < mpc->entries && p < end; i++) {
+        switch (p[0]) {
+        case MP_PROCESSOR:
+            if (p[3] & MP_CPU_ENABLED)
+                add_cpu(cfg, p[1]);
+            p += 20;
+            continue;
+
+        case MP_BUS:
+            if (p[1] < 32 && sig_eq(p + 2, "ISA", 3))
+                isa_buses |= 1u << p[1];
+            break;
+
+        case MP_IOAPIC:
+            if ((p[3] & MP_IOAPIC_ENABLED) && !cfg->ioapic_phys) {
+                ioapic_id        = p[1];
+                cfg->ioapic_phys = *(const uint32_t*)(p + 4);
+            }
+            break;
+
+        case MP_IOINT:
+            /* type 0 (INT) from an ISA bus into our I/O APIC */
+            if (p[1] == 0 && p[4] < 32 && (isa_buses & (1u << p[4])) &&
+                p[5] < 16 && (p[6] == ioapic_id || p[6] == 0xFF)) {
+                cfg->irq_gsi[p[5]]   = p[7];
+                cfg->irq_flags[p[5]] = *(const uint16_t*)(p + 2);
+            }
+            break;
+
+        default:
+            break;
+        }
+        p += 8;
+    }
+
+    return cfg->ncpus ? 0 : -1;
+}
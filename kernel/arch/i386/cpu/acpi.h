@@ -0,0 +1,10 @@
+#pragma once
+#include "arch/i386/cpu/smp.h"
+
+/* Fill cfg from the ACPI MADT; 0 if one was found */
+int acpi_probe_smp(smp_config_t *cfg);
+
+/* Same from an Intel MP 1.4 configuration table, for firmware without
+ * ACPI
+ */
+int mptable_probe_smp(smp_config_t *cfg);
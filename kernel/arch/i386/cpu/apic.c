@@ -0,0 +1,243 @@
+#include "arch/i386/cpu/apic.h"
+#include "arch/i386/mm/paging.h"
+#include "arch/i386/drivers/timer.h"
+#include "console.h"
+
+#define IA32_APIC_BASE_MSR  0x1B
+#define APIC_BASE_ENABLE    (1u << 11)
+
+/* local APIC registers (offsets from the base) */
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ESR           0x280
+#define LAPIC_ICR_LO        0x300
+#define LAPIC_ICR_HI        0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CUR     0x390
+#define LAPIC_TIMER_DIV     0x3E0
+
+#define SVR_ENABLE          0x100
+#define LVT_MASKED          (1u << 16)
+#define LVT_PERIODIC        (1u << 17)
+#define LVT_NMI             (4u << 8)
+#define TIMER_DIV_16        0x3
+
+#define ICR_FIXED           (0u << 8)
+#define ICR_INIT            (5u << 8)
+#define ICR_STARTUP         (6u << 8)
+#define ICR_PENDING         (1u << 12)
+#define ICR_ASSERT          (1u << 14)
+#define ICR_LEVEL           (1u << 15)
+
+/* I/O APIC: an index register and a data window */
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WIN          0x10
+#define IOAPIC_VER          0x01
+#define IOAPIC_REDTBL(n)    (0x10 + 2 * (n))
+
+#define RED_ACTIVE_LOW      (1u << 13)
+#define RED_LEVEL           (1u << 15)
+#define RED_MASKED          (1u << 16)
+
+/* MPS INTI flags (MADT overrides use the same encoding) */
+#define INTI_POLARITY(f)    ((f) & 0x3)
+#define INTI_TRIGGER(f)     (((f) >> 2) & 0x3)
+#define INTI_ACTIVE_LOW     3
+#define INTI_LEVEL          3
+
+static volatile uint32_t *lapic = 0;
+static volatile uint32_t *ioapic = 0;
+static uint32_t ioapic_base_gsi = 0;
+static uint32_t ioapic_inputs   = 0;
+static uint32_t timer_count     = 0;    /* LAPIC timer counts per tick */
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t v)
+{
+    lapic[reg / 4] = v;
+    (void)lapic[LAPIC_ID / 4];      /* read back: posted writes land now */
+}
+
+static inline uint32_t ioapic_read(uint32_t reg)
+{
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    return ioapic[IOAPIC_WIN / 4];
+}
+
+static inline void ioapic_write(uint32_t reg, uint32_t v)
+{
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    ioapic[IOAPIC_WIN / 4] = v;
+}
+
+/* ---------------- local APIC ---------------- */
+
+int lapic_init(uint32_t phys)
+{
+    lapic = paging_map_mmio(phys, 4096);
+    if (!lapic) {
+        console_write("lapic: cannot map registers\n");
+        return -1;
+    }
+
+    lapic_init_cpu();
+    return 0;
+}
+
+void lapic_init_cpu(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(IA32_APIC_BASE_MSR));
+    if (!(lo & APIC_BASE_ENABLE)) {
+        lo |= APIC_BASE_ENABLE;
+        __asm__ volatile("wrmsr" :: "a"(lo), "d"(hi), "c"(IA32_APIC_BASE_MSR));
+    }
+
+    /* legacy interrupts come through the I/O APIC, not LINT0 */
+    lapic_write(LAPIC_LVT_LINT0, LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LVT_NMI);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+
+    /* ESR is cleared by two back-to-back writes */
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_ESR, 0);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_EOI, 0);
+}
+
+uint8_t lapic_id(void)
+{
+    return lapic ? (uint8_t)(lapic_read(LAPIC_ID) >> 24) : 0;
+}
+
+void lapic_eoi(void)
+{
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+static int lapic_send(uint8_t apic_id, uint32_t icr)
+{
+    lapic_write(LAPIC_ICR_HI, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+
+    for (uint32_t spin = 0; spin < 1000000; spin++) {
+        if (!(lapic_read(LAPIC_ICR_LO) & ICR_PENDING))
+            return 0;
+        __asm__ volatile("pause");
+    }
+    return -1;
+}
+
+int lapic_send_init(uint8_t apic_id)
+{
+    if (lapic_send(apic_id, ICR_INIT | ICR_LEVEL | ICR_ASSERT) != 0)
+        return -1;
+    /* deassert; ignored by newer CPUs, required by the 82489DX */
+    return lapic_send(apic_id, ICR_INIT | ICR_LEVEL);
+}
+
+int lapic_send_sipi(uint8_t apic_id, uint32_t page)
+{
+    return lapic_send(apic_id, ICR_STARTUP | (page & 0xFF));
+}
+
+int lapic_send_ipi(uint8_t apic_id, uint8_t vector)
+{
+    return lapic_send(apic_id, ICR_FIXED | vector);
+}
+
+void lapic_timer_calibrate(void)
+{
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+
+    /* line up with a PIT tick, then count down across the next one */
+    uint32_t t = timer_get_ticks();
+    while (timer_get_ticks() == t)
+        __asm__ volatile("pause");
+
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFFu);
+    t = timer_get_ticks();
+    while (timer_get_ticks() == t)
+        __asm__ volatile("pause");
+    timer_count = 0xFFFFFFFFu - lapic_read(LAPIC_TIMER_CUR);
+
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    if (!timer_count)
+        timer_count = 1;
+}
+
+void lapic_timer_start(uint8_t vector)
+{
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_PERIODIC | vector);
+    lapic_write(LAPIC_TIMER_INIT, timer_count);
+}
+
+/* ---------------- I/O APIC ---------------- */
+
+int ioapic_init(uint32_t phys, uint32_t gsi_base)
+{
+    ioapic = paging_map_mmio(phys, 4096);
+    if (!ioapic) {
+        console_write("ioapic: cannot map registers\n");
+        return -1;
+    }
+
+    ioapic_base_gsi = gsi_base;
+    ioapic_inputs   = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+
+    /* nothing is delivered until a driver asks for it */
+    for (uint32_t i = 0; i < ioapic_inputs; i++) {
+        ioapic_write(IOAPIC_REDTBL(i) + 1, 0);
+        ioapic_write(IOAPIC_REDTBL(i), RED_MASKED);
+    }
+    return 0;
+}
+
+void ioapic_route(uint32_t gsi, uint8_t vector, uint16_t flags,
+                  uint8_t dest_apic, int masked)
+{
+    uint32_t pin = gsi - ioapic_base_gsi;
+    if (!ioapic || gsi < ioapic_base_gsi || pin >= ioapic_inputs)
+        return;
+
+    uint32_t lo = vector;               /* fixed delivery, physical dest */
+    if (INTI_POLARITY(flags) == INTI_ACTIVE_LOW)
+        lo |= RED_ACTIVE_LOW;
+    if (INTI_TRIGGER(flags) == INTI_LEVEL)
+        lo |= RED_LEVEL;
+    if (masked)
+        lo |= RED_MASKED;
+
+    ioapic_write(IOAPIC_REDTBL(pin), RED_MASKED);
+    ioapic_write(IOAPIC_REDTBL(pin) + 1, (uint32_t)dest_apic << 24);
+    ioapic_write(IOAPIC_REDTBL(pin), lo);
+}
+
+void ioapic_set_mask(uint32_t gsi, int masked)
+{
+    uint32_t pin = gsi - ioapic_base_gsi;
+    if (!ioapic || gsi < ioapic_base_gsi || pin >= ioapic_inputs)
+        return;
+
+    uint32_t lo = ioapic_read(IOAPIC_REDTBL(pin));
+    if (masked)
+        lo |= RED_MASKED;
+    else
+        lo &= ~RED_MASKED;
+    ioapic_write(IOAPIC_REDTBL(pin), lo);
+}
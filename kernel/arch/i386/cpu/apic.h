@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+/* Spurious-interrupt vector; the handler is a bare iret, no EOI */
+#define APIC_SPURIOUS_VECTOR  0xFF
+
+/* ---- local APIC (one per CPU, same physical address on all of them) ---- */
+
+/* Map the registers and enable the APIC of the calling CPU */
+int      lapic_init(uint32_t phys);
+void     lapic_init_cpu(void);
+uint8_t  lapic_id(void);
+void     lapic_eoi(void);
+
+/* INIT / STARTUP / fixed IPIs; 0 once the APIC has sent the message */
+int lapic_send_init(uint8_t apic_id);
+int lapic_send_sipi(uint8_t apic_id, uint32_t page);
+int lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+
+/* Periodic timer on vector at TIMER_HZ. lapic_timer_calibrate() counts
+ * the timer against one PIT tick and must run with interrupts on.
+ */
+void lapic_timer_calibrate(void);
+void lapic_timer_start(uint8_t vector);
+
+/* ---- I/O APIC ---- */
+
+int  ioapic_init(uint32_t phys, uint32_t gsi_base);
+/* Send input gsi as vector to one CPU. flags are MPS INTI bits (0 = bus
+ * default: ISA edge/high).
+ */
+void ioapic_route(uint32_t gsi, uint8_t vector, uint16_t flags,
+                  uint8_t dest_apic, int masked);
+void ioapic_set_mask(uint32_t gsi, int masked);
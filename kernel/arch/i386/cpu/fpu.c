@@ -0,0 +1,198 @@
+#include "arch/i386/cpu/fpu.h"
+#include "arch/i386/mm/kmalloc.h"
+#include "arch/i386/cpu/smp.h"
+#include "sched/task.h"
+#include "console.h"
+
+#define CR0_MP  (1u << 1)
+#define CR0_EM  (1u << 2)
+#define CR0_TS  (1u << 3)
+#define CR0_NE  (1u << 5)
+
+#define CR4_OSFXSR      (1u << 9)
+#define CR4_OSXMMEXCPT  (1u << 10)
+
+#define FXSAVE_SIZE  512    /* kmalloc's 512-byte class is 512-aligned */
+#define FSAVE_SIZE   108
+
+static int         fpu_present = 0;
+static int         use_fxsr    = 0;
+static int         ts_set[SMP_MAX_CPUS];
+static task_t     *fpu_owner[SMP_MAX_CPUS];    /* registers' task, per CPU */
+static fpu_stats_t stats;
+
+static inline uint32_t read_cr0(void)
+{
+    uint32_t v;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint32_t v)
+{
+    __asm__ volatile("mov %0, %%cr0" :: "r"(v) : "memory");
+}
+
+static inline void set_ts(int cpu)
+{
+    if (!ts_set[cpu]) {
+        write_cr0(read_cr0() | CR0_TS);
+        ts_set[cpu] = 1;
+    }
+}
+
+static inline void clear_ts(int cpu)
+{
+    if (ts_set[cpu]) {
+        __asm__ volatile("clts");
+        ts_set[cpu] = 0;
+    }
+}
+
+static void fpu_save(void *area)
+{
+    if (use_fxsr)
+        __asm__ volatile("fxsave (%0)" :: "r"(area) : "memory");
+    else
+        __asm__ volatile("fnsave (%0); fwait" :: "r"(area) : "memory");
+}
+
+static void fpu_restore(void *area)
+{
+    if (use_fxsr)
+        __asm__ volatile("fxrstor (%0)" :: "r"(area) : "memory");
+    else
+        __asm__ volatile("frstor (%0)" :: "r"(area) : "memory");
+}
+
+static void fpu_reset(void)
+{
+    __asm__ volatile("fninit");
+    if (use_fxsr) {
+        uint32_t mxcsr = 0x1F80;    /* all SIMD exceptions masked */
+        __asm__ volatile("ldmxcsr %0" :: "m"(mxcsr));
+    }
+}
+
+void fpu_init_cpu(void)
+{
+    uint32_t a = 1, b, c, d;
+    __asm__ volatile("cpuid" : "+a"(a), "=b"(b), "=c"(c), "=d"(d));
+
+    if (!fpu_present)
+        return;
+
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+
+    if (use_fxsr) {
+        uint32_t cr4;
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= CR4_OSFXSR;
+        if ((d >> 25) & 1)
+            cr4 |= CR4_OSXMMEXCPT;
+        __asm__ volatile("mov %0, %%cr4" :: "r"(cr4));
+    }
+
+    int cpu = smp_cpu_id();
+    ts_set[cpu] = 0;
+    fpu_reset();
+    set_ts(cpu);
+
+    fpu_owner[cpu] = 0;
+}
+
+void fpu_init(void)
+{
+    uint32_t a = 1, b, c, d;
+    __asm__ volatile("cpuid" : "+a"(a), "=b"(b), "=c"(c), "=d"(d));
+
+    fpu_present = d & 1;
+    if (!fpu_present) {
+        console_write("fpu: no x87, FPU instructions will fault\n");
+        return;
+    }
+
+    use_fxsr = (d >> 24) & 1;
+    fpu_init_cpu();
+
+    stats = (fpu_stats_t){0};
+}
+
+void fpu_switch(task_t *prev, task_t *next)
+{
+    if (!fpu_present)
+        return;
+
+    int cpu = smp_cpu_id();
+
+    /* With other CPUs around, prev may be picked up by one of them before
+     * it runs here again, and its registers would be stuck in this FPU.
+     * Save them on the way out; restoring stays lazy.
+     */
+    if (smp_active() && prev && prev == fpu_owner[cpu] &&
+        prev->state != TASK_ZOMBIE && prev->fpu_state) {
+        clear_ts(cpu);
+        fpu_save(prev->fpu_state);
+        fpu_owner[cpu] = 0;
+        stats.saves++;
+    }
+
+    /* the owner may keep using the registers without a trap */
+    if (next == fpu_owner[cpu])
+        clear_ts(cpu);
+    else
+        set_ts(cpu);
+}
+
+int fpu_handle_nm(void)
+{
+    if (!fpu_present)
+        return -1;
+
+    task_t *cur = task_current();
+    int cpu = smp_cpu_id();
+
+    stats.traps++;
+    clear_ts(cpu);
+    if (!cur || cur == fpu_owner[cpu])
+        return 0;
+
+    if (fpu_owner[cpu] && fpu_owner[cpu]->fpu_state) {
+        fpu_save(fpu_owner[cpu]->fpu_state);
+        stats.saves++;
+    }
+
+    if (cur->fpu_state) {
+        fpu_restore(cur->fpu_state);
+        stats.restores++;
+    } else {
+        cur->fpu_state = kmalloc(use_fxsr ? FXSAVE_SIZE : FSAVE_SIZE);
+        if (!cur->fpu_state) {
+            fpu_owner[cpu] = 0;
+            return -1;
+        }
+        fpu_reset();
+        stats.inits++;
+    }
+
+    fpu_owner[cpu] = cur;
+    return 0;
+}
+
+void fpu_release(task_t *t)
+{
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (fpu_owner[cpu] == t)
+            fpu_owner[cpu] = 0;
+    }
+    if (t->fpu_state) {
+        kfree(t->fpu_state);
+        t->fpu_state = 0;
+    }
+}
+
+void fpu_get_stats(fpu_stats_t *out)
+{
+    if (out)
+        *out = stats;
+}
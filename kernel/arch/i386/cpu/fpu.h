@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+
+struct task;
+
+typedef struct fpu_stats {
+    uint32_t traps;     /* #NM taken                                   */
+    uint32_t saves;     /* owner's state written back on a hand-over   */
+    uint32_t restores;  /* state loaded for a returning task           */
+    uint32_t inits;     /* first use by a task (fresh state)           */
+} fpu_stats_t;
+
+/* Enable the x87 (and SSE with FXSAVE when present) with CR0.TS set, so
+ * the first FPU/SSE instruction of every task traps.
+ */
+void fpu_init(void);
+/* Same CR0/CR4 setup on an AP */
+void fpu_init_cpu(void);
+
+/* Lazy switching: the register file stays with its last user (the owner)
+ * and is only saved and reloaded when another task touches it. The
+ * scheduler calls fpu_switch() before switching from prev to next; #NM
+ * ends up in fpu_handle_nm(), which returns 0 when it handled the trap.
+ * Each CPU has its own owner; on SMP the owner is saved when it is
+ * switched out, since it may resume on another CPU.
+ */
+void fpu_switch(struct task *prev, struct task *next);
+int  fpu_handle_nm(void);
+
+/* Forget t's FPU state (task teardown) */
+void fpu_release(struct task *t);
+
+void fpu_get_stats(fpu_stats_t *out);
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include "gdt.h"
+#include "smp.h"
 
 extern void gdt_flush(uint32_t);
 extern void tss_flush(uint32_t);
@@ -11,11 +12,17 @@ extern void tss_flush(uint32_t);
  * 3: user code
  * 4: user data
  * 5: TSS
+ * 6: double fault TSS
+ * 7...: TSS of CPU 1, 2, ...
  */
-static struct gdt_entry gdt[6];
+#define GDT_ENTRIES  (GDT_ENTRY_AP_TSS + SMP_MAX_CPUS - 1)
+
+static struct gdt_entry gdt[GDT_ENTRIES];
 static struct gdt_ptr   gp;
 
 static struct tss_entry tss;
+static struct tss_entry ap_tss[SMP_MAX_CPUS - 1];
+static struct tss_entry df_tss;
 
 static uint8_t kernel_tss_stack[4096];
 
@@ -32,45 +39,103 @@ static void gdt_set_entry(int num, uint32_t base, uint32_t limit, uint8_t access
     gdt[num].access      = access;
 }
 
-static void write_tss(int num, uint16_t ss0, uint32_t esp0)
+/* bytewise: the struct is packed, so no word pointers into it */
+static void tss_clear(struct tss_entry *t)
 {
-    uint32_t base  = (uint32_t)&tss;
-    uint32_t limit = base + sizeof(struct tss_entry);
+    uint8_t *p = (uint8_t*)t;
+
+    for (uint32_t i = 0; i < sizeof(*t); i++)
+        p[i] = 0;
+}
+
+static void write_tss(int num, struct tss_entry *t, uint16_t ss0, uint32_t esp0)
+{
+    uint32_t base  = (uint32_t)t;
+    uint32_t limit = sizeof(struct tss_entry) - 1;
 
     gdt_set_entry(num, base, limit,
                   0x89,        /* access */
                   0x40);       /* granularity: 32-bit, byte granularity */
 
-    for (uint32_t *p = (uint32_t*)&tss;
-         p < (uint32_t*)(&tss + 1);
-         ++p)
-    {
-        *p = 0;
-    }
+    tss_clear(t);
 
-    tss.ss0  = ss0;   /* Ring 0 stack segment */
-    tss.esp0 = esp0;  /* Ring 0 stack pointer */
+    t->ss0  = ss0;   /* Ring 0 stack segment */
+    t->esp0 = esp0;  /* Ring 0 stack pointer */
 
     /* Set TSS segments – when CPU uses TSS to jump to ring0 it will
        load these segment selectors. Use kernel segments. */
-    tss.cs = KERNEL_CODE_SEG | 0;  /* RPL 0 */
-    tss.ss = KERNEL_DATA_SEG | 0;
-    tss.ds = KERNEL_DATA_SEG | 0;
-    tss.es = KERNEL_DATA_SEG | 0;
-    tss.fs = KERNEL_DATA_SEG | 0;
-    tss.gs = KERNEL_DATA_SEG | 0;
-
-    tss.iomap_base = sizeof(struct tss_entry);
+    t->cs = KERNEL_CODE_SEG | 0;  /* RPL 0 */
+    t->ss = KERNEL_DATA_SEG | 0;
+    t->ds = KERNEL_DATA_SEG | 0;
+    t->es = KERNEL_DATA_SEG | 0;
+    t->fs = KERNEL_DATA_SEG | 0;
+    t->gs = KERNEL_DATA_SEG | 0;
+
+    t->iomap_base = sizeof(struct tss_entry);
+}
+
+static struct tss_entry* cpu_tss(int cpu)
+{
+    return cpu ? &ap_tss[cpu - 1] : &tss;
 }
 
 void tss_set_kernel_stack(uint32_t stack_top)
 {
-    tss.esp0 = stack_top;
+    cpu_tss(smp_cpu_id())->esp0 = stack_top;
+}
+
+void gdt_setup_cpu(int cpu)
+{
+    if (cpu < 1 || cpu >= SMP_MAX_CPUS)
+        return;
+
+    /* esp0 is set when the CPU first switches to a task */
+    write_tss(GDT_ENTRY_AP_TSS + cpu - 1, cpu_tss(cpu), KERNEL_DATA_SEG, 0);
+}
+
+void gdt_load_cpu(int cpu)
+{
+    gdt_flush((uint32_t)&gp);
+    tss_flush(AP_TSS_SEG(cpu));
+}
+
+void gdt_set_double_fault_task(void (*entry)(void), uint32_t stack_top, uint32_t cr3)
+{
+    tss_clear(&df_tss);
+
+    df_tss.cr3    = cr3;
+    df_tss.eip    = (uint32_t)entry;
+    df_tss.eflags = 0x2;             /* interrupts off */
+    df_tss.esp    = stack_top;
+    df_tss.ss0    = KERNEL_DATA_SEG;
+    df_tss.esp0   = stack_top;
+
+    df_tss.cs = KERNEL_CODE_SEG;
+    df_tss.ss = KERNEL_DATA_SEG;
+    df_tss.ds = KERNEL_DATA_SEG;
+    df_tss.es = KERNEL_DATA_SEG;
+    df_tss.fs = KERNEL_DATA_SEG;
+    df_tss.gs = KERNEL_DATA_SEG;
+
+    df_tss.iomap_base = sizeof(struct tss_entry);
+
+    gdt_set_entry(GDT_ENTRY_DF_TSS, (uint32_t)&df_tss,
+                  sizeof(struct tss_entry) - 1, 0x89, 0x40);
+}
+
+const struct tss_entry* gdt_main_tss(void)
+{
+    /* the back link names the TSS that was current when #DF hit */
+    uint32_t sel = df_tss.prev_tss & 0xFFF8;
+
+    if (sel >= (GDT_ENTRY_AP_TSS << 3) && sel < (GDT_ENTRIES << 3))
+        return cpu_tss((sel >> 3) - GDT_ENTRY_AP_TSS + 1);
+    return &tss;
 }
 
 void gdt_init(void)
 {
-    gp.limit = (sizeof(struct gdt_entry) * 6) - 1;
+    gp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
     gp.base  = (uint32_t)&gdt;
 
     /* 0: null descriptor */
@@ -106,7 +171,14 @@ void gdt_init(void)
 
     /* 5: TSS descriptor (ring 0) */
     uint32_t stack_top = (uint32_t)kernel_tss_stack + sizeof(kernel_tss_stack);
-    write_tss(5, KERNEL_DATA_SEG, stack_top);
+    write_tss(5, &tss, KERNEL_DATA_SEG, stack_top);
+
+    /* 6: filled in by gdt_set_double_fault_task() */
+    gdt_set_entry(6, 0, 0, 0, 0);
+
+    /* 7...: filled in by gdt_setup_cpu() as the APs come up */
+    for (int i = GDT_ENTRY_AP_TSS; i < GDT_ENTRIES; i++)
+        gdt_set_entry(i, 0, 0, 0, 0);
 
     /* Load the new GDT */
     gdt_flush((uint32_t)&gp);
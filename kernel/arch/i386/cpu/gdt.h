@@ -49,15 +49,33 @@ struct tss_entry {
 
 void gdt_init(void);
 
-/* Allow kernel to update esp0 if we later have per-task stacks */
+/* Ring-0 stack for interrupts from ring 3, in the calling CPU's TSS */
 void tss_set_kernel_stack(uint32_t stack_top);
 
+/* Every AP gets its own TSS descriptor after the fixed entries.
+ * gdt_setup_cpu() writes it (on the BSP, before the AP starts);
+ * gdt_load_cpu() runs on the AP itself.
+ */
+void gdt_setup_cpu(int cpu);
+void gdt_load_cpu(int cpu);
+
+/* Second TSS that #DF switches to through a task gate: a fault that can't
+ * push its frame (kernel stack overflow) still gets a working stack.
+ * entry runs on stack_top with the given page directory.
+ */
+void gdt_set_double_fault_task(void (*entry)(void), uint32_t stack_top, uint32_t cr3);
+/* Registers of the interrupted context, saved by the task switch into
+ * the TSS of the CPU that faulted */
+const struct tss_entry* gdt_main_tss(void);
+
 #define GDT_ENTRY_NULL      0
 #define GDT_ENTRY_KCODE     1
 #define GDT_ENTRY_KDATA     2
 #define GDT_ENTRY_UCODE     3
 #define GDT_ENTRY_UDATA     4
 #define GDT_ENTRY_TSS       5
+#define GDT_ENTRY_DF_TSS    6
+#define GDT_ENTRY_AP_TSS    7   /* CPU n (n >= 1) uses entry 6 + n */
 
 /* Ring 0 selectors */
 #define KERNEL_CODE_SEG  (GDT_ENTRY_KCODE << 3)
@@ -69,3 +87,5 @@ void tss_set_kernel_stack(uint32_t stack_top);
 
 /* TSS selector (ring 0) */
 #define TSS_SEG          (GDT_ENTRY_TSS << 3)
+#define DF_TSS_SEG       (GDT_ENTRY_DF_TSS << 3)
+#define AP_TSS_SEG(cpu)  ((GDT_ENTRY_AP_TSS + (cpu) - 1) << 3)
@@ -34,6 +34,11 @@ void idt_init(void)
     idt_load((uint32_t)&idtp);
 }
 
+void idt_load_cpu(void)
+{
+    idt_load((uint32_t)&idtp);
+}
+
 // void idt_init(void)
 // {
 //     idtp.limit = sizeof(idt) - 1;
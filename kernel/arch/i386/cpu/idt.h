@@ -15,6 +15,8 @@ struct idt_ptr {
 } __attribute__((packed));
 
 void idt_init(void);
+/* Load the (shared) IDT on an AP */
+void idt_load_cpu(void);
 void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
 
 /* NEW */
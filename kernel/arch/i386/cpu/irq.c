@@ -1,6 +1,9 @@
 #include "irq.h"
 #include "idt.h"
 #include "console.h"
+#include "sched/task.h"
+#include "arch/i386/cpu/apic.h"
+#include "arch/i386/cpu/smp.h"
 
 #define PIC1        0x20
 #define PIC2        0xA0
@@ -11,7 +14,12 @@
 
 #define PIC_EOI     0x20
 
-static irq_handler_t irq_handlers[16] = {0};
+static irq_handler_t irq_handlers[IRQ_COUNT] = {0};
+static volatile int  irq_depth[SMP_MAX_CPUS];
+
+/* ISA lines go through the I/O APIC instead of the PIC */
+static int      apic_mode = 0;
+static uint8_t  isa_gsi[16];
 
 static inline void outb(uint16_t port, uint8_t value) {
     __asm__ volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
@@ -25,23 +33,87 @@ static inline uint8_t inb(uint16_t port) {
 
 void irq_handler_c(int irq_no)
 {
-    if (irq_no < 16 && irq_handlers[irq_no]) {
+    int cpu    = smp_cpu_id();
+    int device = irq_no < 16;
+
+    irq_depth[cpu]++;
+    /* driver code predates SMP; the per-CPU tick and the IPI are not */
+    if (device)
+        bkl_lock();
+    if (irq_no < IRQ_COUNT && irq_handlers[irq_no]) {
         irq_handlers[irq_no]();
     }
+    if (device)
+        bkl_unlock();
+    irq_depth[cpu]--;
 
-    /* send EOI to PICs */
-    if (irq_no >= 8) {
-        outb(PIC2_COMMAND, PIC_EOI);
+    if (!device || apic_mode) {
+        lapic_eoi();
+    } else {
+        /* send EOI to PICs */
+        if (irq_no >= 8) {
+            outb(PIC2_COMMAND, PIC_EOI);
+        }
+        outb(PIC1_COMMAND, PIC_EOI);
     }
-    outb(PIC1_COMMAND, PIC_EOI);
+
+    /* The PIC is acknowledged, so this task may be switched out here; its
+     * interrupt frame stays on its own stack until it runs again.
+     */
+    task_preempt();
 }
 
 void irq_register_handler(int irq, irq_handler_t handler)
 {
-    if (irq >= 0 && irq < 16)
+    if (irq >= 0 && irq < IRQ_COUNT)
         irq_handlers[irq] = handler;
 }
 
+void irq_unmask(int irq)
+{
+    if (irq < 0 || irq >= 16)
+        return;
+
+    if (apic_mode) {
+        ioapic_set_mask(isa_gsi[irq], 0);
+        return;
+    }
+
+    if (irq >= 8) {
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        irq = 2;
+    }
+    outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
+
+int irq_in_handler(void)
+{
+    return irq_depth[smp_cpu_id()];
+}
+
+void irq_enable_apic(const uint8_t *gsi, const uint16_t *flags, uint8_t apic_id)
+{
+    uint32_t irqf = irq_save();
+
+    uint16_t open = ~((inb(PIC2_DATA) << 8) | inb(PIC1_DATA));
+    /* the cascade only matters to the PIC */
+    open &= ~(1u << 2);
+
+    for (int irq = 0; irq < 16; irq++) {
+        if (irq == 2)
+            continue;
+        isa_gsi[irq] = gsi[irq];
+        ioapic_route(gsi[irq], IRQ_VECTOR(irq), flags[irq], apic_id,
+                     !(open & (1u << irq)));
+    }
+
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+    apic_mode = 1;
+
+    irq_restore(irqf);
+}
+
 void irq_install(void)
 {
     uint8_t a1 = inb(PIC1_DATA);
@@ -80,6 +152,10 @@ void irq_install(void)
     extern void irq13();
     extern void irq14();
     extern void irq15();
+    extern void irq16();
+    extern void irq17();
+    extern void irq18();
+    extern void irq_spurious();
 
     idt_set_gate(32, (uint32_t)irq0,  0x08, 0x8E);
     idt_set_gate(33, (uint32_t)irq1,  0x08, 0x8E);
@@ -97,4 +173,10 @@ void irq_install(void)
     idt_set_gate(45, (uint32_t)irq13, 0x08, 0x8E);
     idt_set_gate(46, (uint32_t)irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint32_t)irq15, 0x08, 0x8E);
+
+    /* local APIC sources, only raised once smp_init() turns them on */
+    idt_set_gate(IRQ_VECTOR(IRQ_LAPIC_TIMER), (uint32_t)irq16, 0x08, 0x8E);
+    idt_set_gate(IRQ_VECTOR(IRQ_RESCHED),     (uint32_t)irq17, 0x08, 0x8E);
+    idt_set_gate(IRQ_VECTOR(IRQ_TLB),         (uint32_t)irq18, 0x08, 0x8E);
+    idt_set_gate(APIC_SPURIOUS_VECTOR, (uint32_t)irq_spurious, 0x08, 0x8E);
 }
@@ -3,5 +3,43 @@
 
 typedef void (*irq_handler_t)(void);
 
+/* 0-15 are the ISA lines (PIC or I/O APIC); the rest are local APIC
+ * sources. IRQ n is always IDT vector 32 + n.
+ */
+#define IRQ_LAPIC_TIMER  16     /* per-CPU tick on the APs */
+#define IRQ_RESCHED      17     /* IPI: run the scheduler */
+#define IRQ_TLB          18     /* IPI: TLB shootdown */
+#define IRQ_COUNT        19
+#define IRQ_VECTOR(irq)  (32 + (irq))
+
+/* Disable interrupts and return the old EFLAGS; irq_restore() turns them
+ * back on only if they were on, so the pair nests and is safe to use from
+ * handlers and syscalls.
+ */
+static inline uint32_t irq_save(void)
+{
+    uint32_t flags;
+    __asm__ volatile("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags)
+{
+    if (flags & 0x200)
+        __asm__ volatile("sti" ::: "memory");
+}
+
 void irq_install(void);
 void irq_register_handler(int irq, irq_handler_t handler);
+/* Let an IRQ line through the PIC (and the cascade for 8-15), or through
+ * the I/O APIC once irq_enable_apic() has switched over
+ */
+void irq_unmask(int irq);
+
+/* Route the ISA lines through the I/O APIC to the CPU with apic_id, keep
+ * the lines that are open on the PIC open, and mask the PIC for good.
+ * gsi/flags give each line's I/O APIC input and MPS polarity/trigger.
+ */
+void irq_enable_apic(const uint8_t *gsi, const uint16_t *flags, uint8_t apic_id);
+/* Nonzero while an IRQ handler is running */
+int  irq_in_handler(void);
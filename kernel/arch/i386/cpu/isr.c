@@ -2,6 +2,12 @@
 #include "isr.h"
 #include "idt.h"
 #include "console.h"
+#include "arch/i386/mm/paging.h"
+#include "arch/i386/cpu/fpu.h"
+#include "arch/i386/cpu/gdt.h"
+#include "arch/i386/mm/kstack.h"
+#include "sched/task.h"
+#include "arch/i386/cpu/smp.h"
 
 static void kprint_u32(uint32_t v)
 {
@@ -24,25 +30,6 @@ static void kprint_u32(uint32_t v)
 }
 
 
-static void isr_print_uint(int v)
-{
-    char buf[16];
-    int i = 0;
-
-    if (v == 0) {
-        console_write("0");
-        return;
-    }
-
-    while (v > 0 && i < (int)sizeof(buf)) {
-        buf[i++] = '0' + (v % 10);
-        v /= 10;
-    }
-    while (i > 0) {
-        console_putc(buf[--i]);
-    }
-}
-
 /* Assembly ISR entry points */
 extern void isr0();
 extern void isr1();
@@ -125,64 +112,110 @@ static const char* exception_messages[32] = {
     "Reserved", "Reserved", "Reserved"
 };
 
-static void exception_handler_common(int n)
+static void print_hex(uint32_t v)
+{
+    const char* digits = "0123456789ABCDEF";
+    console_write("0x");
+    for (int shift = 28; shift >= 0; shift -= 4)
+        console_putc(digits[(v >> shift) & 0xF]);
+}
+
+static void isr_handle(isr_frame_t* f)
 {
-    console_write("CPU Exception: ");
-    console_write(exception_messages[n]);
+    /* lazy FPU hand-over */
+    if (f->vector == 7 && fpu_handle_nm() == 0)
+        return;
+
+    if (f->vector == 14) {
+        uint32_t addr;
+        __asm__ volatile("mov %%cr2, %0" : "=r"(addr));
+
+        /* copy-on-write, demand-zero and image pages are resolved here */
+        if (paging_handle_fault(addr, f->error) == 0)
+            return;
+
+        if (kstack_is_guard(addr))
+            console_write("Kernel stack overflow: guard page hit at ");
+        else
+            console_write("CPU Exception: Page Fault at ");
+        print_hex(addr);
+    } else {
+        console_write("CPU Exception: ");
+        console_write(exception_messages[f->vector & 31]);
+    }
+
     console_write(" (vector ");
-    isr_print_uint(n);
-    console_write(")\nSystem halted.\n");
+    kprint_u32(f->vector);
+    console_write(")\nError code: ");
+    kprint_u32(f->error);
+    console_write(", EIP: ");
+    print_hex(f->eip);
+    console_write((f->cs & 3) ? " (user)" : " (kernel)");
+
+    /* a faulting user program only takes itself down */
+    if ((f->cs & 3) && task_current()) {
+        console_write("\nTask ");
+        console_write(task_current()->name);
+        console_write(" killed.\n");
+        task_exit(-1);
+    }
+
+    console_write("\nSystem halted.\n");
 
     for (;;) {
         __asm__ volatile ("hlt");
     }
 }
 
-void isr_dispatch(uint32_t vector, uint32_t error)
+void isr_dispatch(isr_frame_t* f)
+{
+    /* fault handling allocates and edits page tables: one CPU at a time */
+    bkl_lock();
+    isr_handle(f);
+    bkl_unlock();
+}
+
+/* ---------------- double fault ---------------- */
+
+static uint8_t df_stack[4096] __attribute__((aligned(16)));
+
+/*
+ * Entered by a hardware task switch, so it runs even when the faulting
+ * stack is unusable (the usual cause: a kernel stack overflowing into
+ * its guard page, where the #PF frame itself can't be pushed). The
+ * interrupted registers are in the main TSS.
+ */
+static void double_fault_task(void)
 {
-    console_write("CPU Exception: ");
-    console_write(exception_messages[vector]);
-    console_write("\nError code: ");
-    kprint_u32(error);
-    console_write("\nHalting.\n");
+    const struct tss_entry* t = gdt_main_tss();
+    task_t* cur = task_current();
+
+    if (kstack_is_guard(t->esp - 4))
+        console_write("Double Fault: kernel stack overflow");
+    else
+        console_write("CPU Exception: Double Fault");
+
+    if (cur) {
+        console_write(" in task ");
+        console_write(cur->name);
+    }
+    console_write("\nEIP: ");
+    print_hex(t->eip);
+    console_write(", ESP: ");
+    print_hex(t->esp);
+    console_write("\nSystem halted.\n");
 
-    for(;;) __asm__("hlt");
+    for (;;) {
+        __asm__ volatile ("cli; hlt");
+    }
 }
 
+void isr_install_double_fault(void)
+{
+    uint32_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
 
-/* Generate 32 small handlers */
-#define DEFINE_ISR_HANDLER(n) \
-    void isr_handler##n(void) { exception_handler_common(n); }
-
-DEFINE_ISR_HANDLER(0)
-DEFINE_ISR_HANDLER(1)
-DEFINE_ISR_HANDLER(2)
-DEFINE_ISR_HANDLER(3)
-DEFINE_ISR_HANDLER(4)
-DEFINE_ISR_HANDLER(5)
-DEFINE_ISR_HANDLER(6)
-DEFINE_ISR_HANDLER(7)
-DEFINE_ISR_HANDLER(8)
-DEFINE_ISR_HANDLER(9)
-DEFINE_ISR_HANDLER(10)
-DEFINE_ISR_HANDLER(11)
-DEFINE_ISR_HANDLER(12)
-DEFINE_ISR_HANDLER(13)
-DEFINE_ISR_HANDLER(14)
-DEFINE_ISR_HANDLER(15)
-DEFINE_ISR_HANDLER(16)
-DEFINE_ISR_HANDLER(17)
-DEFINE_ISR_HANDLER(18)
-DEFINE_ISR_HANDLER(19)
-DEFINE_ISR_HANDLER(20)
-DEFINE_ISR_HANDLER(21)
-DEFINE_ISR_HANDLER(22)
-DEFINE_ISR_HANDLER(23)
-DEFINE_ISR_HANDLER(24)
-DEFINE_ISR_HANDLER(25)
-DEFINE_ISR_HANDLER(26)
-DEFINE_ISR_HANDLER(27)
-DEFINE_ISR_HANDLER(28)
-DEFINE_ISR_HANDLER(29)
-DEFINE_ISR_HANDLER(30)
-DEFINE_ISR_HANDLER(31)
+    gdt_set_double_fault_task(double_fault_task,
+                              (uint32_t)df_stack + sizeof(df_stack), cr3);
+    idt_set_gate(8, 0, DF_TSS_SEG, 0x85);     /* present, DPL 0, task gate */
+}
@@ -1,3 +1,16 @@
 #pragma once
+#include <stdint.h>
+
+/* Stack frame built by isr_common in isr.S */
+typedef struct isr_frame {
+    uint32_t es, ds;
+    uint32_t edi, esi, ebp, kernel_esp, ebx, edx, ecx, eax;   /* pusha */
+    uint32_t vector, error;
+    uint32_t eip, cs, eflags;
+    uint32_t user_esp, user_ss;     /* only pushed when coming from ring 3 */
+} isr_frame_t;
 
 void isr_install(void);
+/* Route #DF through a task gate onto its own stack; needs paging on */
+void isr_install_double_fault(void);
+void isr_dispatch(isr_frame_t* frame);
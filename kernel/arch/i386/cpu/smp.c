@@ -0,0 +1,334 @@
+#include "arch/i386/cpu/smp.h"
+#include "arch/i386/cpu/acpi.h"
+#include "arch/i386/cpu/apic.h"
+#include "arch/i386/cpu/irq.h"
+#include "arch/i386/cpu/idt.h"
+#include "arch/i386/cpu/fpu.h"
+#include "arch/i386/mm/kstack.h"
+#include "arch/i386/mm/paging.h"
+#include "arch/i386/drivers/timer.h"
+#include "sched/lock.h"
+#include "sched/task.h"
+#include "console.h"
+#include "log.h"
+
+#define AP_STACK_SIZE     4096      /* only until the AP's idle task runs */
+#define AP_START_TIMEOUT  (TIMER_HZ / 10)
+
+extern char ap_trampoline_start[], ap_trampoline_end[];
+extern char ap_tr_gdtr[], ap_tr_cr3[], ap_tr_stack[], ap_tr_entry[], ap_tr_cpu[];
+
+/* where a trampoline symbol ends up in the low-memory copy */
+#define TRAMP(sym)  ((void*)(AP_TRAMPOLINE_BASE + ((sym) - ap_trampoline_start)))
+
+typedef struct smp_cpu {
+    uint8_t      apic_id;
+    volatile int online;
+} smp_cpu_t;
+
+static smp_cpu_t         cpus[SMP_MAX_CPUS] = { { 0, 1 } };
+static int               ncpus_present = 1;
+static volatile uint32_t online_mask   = 1;
+static int               active        = 0;
+
+/* TLB shootdown: the sender fills in the request under tlb_lock, sets a
+ * bit per target and waits for each target to clear its own */
+static spinlock_t        tlb_lock    = SPINLOCK_INIT("tlb");
+static volatile uint32_t tlb_vaddr;
+static volatile uint32_t tlb_npages;
+static volatile uint32_t tlb_pending = 0;
+
+/* a ticket lock, so a CPU looping through syscalls cannot starve the rest */
+static ticketlock_t bkl       = TICKETLOCK_INIT("bkl");
+static volatile int bkl_owner = -1;
+static int          bkl_depth = 0;
+
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static void kprint_u32(uint32_t v)
+{
+    char buf[16];
+    int i = 0;
+
+    if (v == 0) {
+        console_write("0");
+        return;
+    }
+    while (v > 0 && i < (int)sizeof(buf)) {
+        buf[i++] = '0' + (v % 10);
+        v /= 10;
+    }
+    while (i > 0)
+        console_putc(buf[--i]);
+}
+
+static void udelay(uint32_t us)
+{
+    uint64_t end = ktime_ns() + (uint64_t)us * 1000;
+
+    while (ktime_ns() < end)
+        __asm__ volatile("pause");
+}
+
+/* ---------------- AP side ---------------- */
+
+/* First C code on an AP, on the boot stack from boot_ap() */
+static void ap_entry(int cpu)
+{
+    /* our own TSS makes smp_cpu_id() work from here on */
+    gdt_load_cpu(cpu);
+    idt_load_cpu();
+
+    lapic_init_cpu();
+    fpu_init_cpu();
+    lapic_timer_start(IRQ_VECTOR(IRQ_LAPIC_TIMER));
+
+    cpus[cpu].online = 1;
+    __atomic_or_fetch(&online_mask, 1u << cpu, __ATOMIC_SEQ_CST);
+
+    scheduler_start_ap();
+}
+
+/* ---------------- BSP side ---------------- */
+
+static int boot_ap(int cpu)
+{
+    uint8_t *stack = kstack_alloc(AP_STACK_SIZE);
+    if (!stack)
+        return -1;
+
+    gdt_setup_cpu(cpu);
+
+    __asm__ volatile("sgdt (%0)" :: "r"(TRAMP(ap_tr_gdtr)) : "memory");
+    *(uint32_t*)TRAMP(ap_tr_cr3)   = (uint32_t)paging_kernel_space()->dir;
+    *(uint32_t*)TRAMP(ap_tr_stack) = (uint32_t)stack + AP_STACK_SIZE;
+    *(uint32_t*)TRAMP(ap_tr_entry) = (uint32_t)ap_entry;
+    *(uint32_t*)TRAMP(ap_tr_cpu)   = (uint32_t)cpu;
+
+    /* INIT, 10ms, then STARTUP (twice, as the MP spec asks) */
+    uint8_t id = cpus[cpu].apic_id;
+    if (lapic_send_init(id) != 0)
+        return -1;
+    udelay(10000);
+
+    for (int i = 0; i < 2 && !cpus[cpu].online; i++) {
+        if (lapic_send_sipi(id, AP_TRAMPOLINE_BASE >> 12) != 0)
+            return -1;
+        udelay(200);
+    }
+
+    uint32_t start = timer_get_ticks();
+    while (!cpus[cpu].online && timer_get_ticks() - start < AP_START_TIMEOUT)
+        __asm__ volatile("pause");
+
+    /* a late AP may still use the stack, so it is not given back */
+    return cpus[cpu].online ? 0 : -1;
+}
+
+void smp_init(void)
+{
+    smp_config_t cfg;
+    const char *source = "ACPI";
+
+    if (acpi_probe_smp(&cfg) != 0) {
+        source = "MP table";
+        if (mptable_probe_smp(&cfg) != 0) {
+            console_write("smp: no ACPI MADT or MP table, using one CPU\n");
+            log_event("[SMP] no CPU tables, single CPU.");
+            return;
+        }
+    }
+
+    if (cfg.ncpus < 2 || !cfg.ioapic_phys) {
+        console_write("smp: one CPU, keeping the PIC\n");
+        log_event("[SMP] single CPU.");
+        return;
+    }
+
+    if (lapic_init(cfg.lapic_phys) != 0 ||
+        ioapic_init(cfg.ioapic_phys, cfg.ioapic_gsi_base) != 0)
+        return;
+
+    /* the BSP is CPU 0 whatever its APIC id; the rest in table order */
+    uint8_t bsp = lapic_id();
+    cpus[0].apic_id = bsp;
+    for (int i = 0; i < cfg.ncpus && ncpus_present < SMP_MAX_CPUS; i++) {
+        if (cfg.apic_ids[i] != bsp)
+            cpus[ncpus_present++].apic_id = cfg.apic_ids[i];
+    }
+
+    /* MP "PIC mode" boards: send INTR through the APIC instead */
+    if (cfg.imcr) {
+        outb(0x22, 0x70);
+        outb(0x23, 0x01);
+    }
+
+    irq_enable_apic(cfg.irq_gsi, cfg.irq_flags, bsp);
+    irq_register_handler(IRQ_LAPIC_TIMER, task_tick);
+    irq_register_handler(IRQ_TLB, smp_tlb_poll);
+    lapic_timer_calibrate();
+
+    uint8_t *dst = (uint8_t*)AP_TRAMPOLINE_BASE;
+    for (char *p = ap_trampoline_start; p < ap_trampoline_end; p++)
+        *dst++ = (uint8_t)*p;
+
+    /* one at a time: they share the trampoline's parameter block */
+    for (int cpu = 1; cpu < ncpus_present; cpu++) {
+        if (boot_ap(cpu) != 0) {
+            console_write("smp: CPU ");
+            kprint_u32(cpu);
+            console_write(" did not start\n");
+            log_event("[SMP] AP failed to start.");
+        }
+    }
+
+    active = smp_num_cpus() > 1;
+
+    console_write("SMP: ");
+    kprint_u32(smp_num_cpus());
+    console_write(" of ");
+    kprint_u32(ncpus_present);
+    console_write(" CPUs online (");
+    console_write(source);
+    console_write(", I/O APIC)\n");
+    log_event("[SMP] APs started.");
+}
+
+int smp_active(void)
+{
+    return active;
+}
+
+int smp_num_cpus(void)
+{
+    int n = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        n += cpus[cpu].online;
+    return n;
+}
+
+int smp_cpu_online(int cpu)
+{
+    return cpu >= 0 && cpu < SMP_MAX_CPUS && cpus[cpu].online;
+}
+
+uint32_t smp_online_mask(void)
+{
+    return online_mask;
+}
+
+uint8_t smp_cpu_apic_id(int cpu)
+{
+    return (cpu >= 0 && cpu < SMP_MAX_CPUS) ? cpus[cpu].apic_id : 0;
+}
+
+void smp_send_resched(int cpu)
+{
+    if (active && cpu != smp_cpu_id() && smp_cpu_online(cpu))
+        lapic_send_ipi(cpus[cpu].apic_id, IRQ_VECTOR(IRQ_RESCHED));
+}
+
+/* ---------------- TLB shootdown ---------------- */
+
+void smp_tlb_shootdown(uint32_t vaddr, uint32_t npages)
+{
+    if (!active)
+        return;
+
+    /* a CPU spinning here still serves the shootdown ahead of it */
+    uint32_t flags   = spin_lock_irqsave(&tlb_lock);
+    uint32_t targets = online_mask & ~(1u << smp_cpu_id());
+
+    tlb_vaddr  = vaddr;
+    tlb_npages = npages;
+    __atomic_store_n(&tlb_pending, targets, __ATOMIC_SEQ_CST);
+
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (targets & (1u << cpu))
+            lapic_send_ipi(cpus[cpu].apic_id, IRQ_VECTOR(IRQ_TLB));
+    }
+
+    while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE))
+        __asm__ volatile("pause");
+
+    spin_unlock_irqrestore(&tlb_lock, flags);
+}
+
+void smp_tlb_poll(void)
+{
+    uint32_t me = 1u << smp_cpu_id();
+
+    if (!(__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE) & me))
+        return;
+
+    /* the request stays put until every target has answered */
+    paging_flush_local(tlb_vaddr, tlb_npages);
+    __atomic_and_fetch(&tlb_pending, ~me, __ATOMIC_RELEASE);
+}
+
+/* ---------------- big kernel lock ---------------- */
+
+void bkl_lock(void)
+{
+    uint32_t flags = irq_save();
+    int cpu = smp_cpu_id();
+
+    if (bkl_owner == cpu) {
+        bkl_depth++;
+    } else {
+        ticket_lock(&bkl);
+        bkl_owner = cpu;
+        bkl_depth = 1;
+    }
+
+    irq_restore(flags);
+}
+
+void bkl_unlock(void)
+{
+    uint32_t flags = irq_save();
+
+    if (bkl_owner == smp_cpu_id() && --bkl_depth == 0) {
+        bkl_owner = -1;
+        ticket_unlock(&bkl);
+    }
+
+    irq_restore(flags);
+}
+
+int bkl_release_all(void)
+{
+    uint32_t flags = irq_save();
+    int depth = 0;
+
+    if (bkl_owner == smp_cpu_id()) {
+        depth = bkl_depth;
+        bkl_depth = 0;
+        bkl_owner = -1;
+        ticket_unlock(&bkl);
+    }
+
+    irq_restore(flags);
+    return depth;
+}
+
+void bkl_reacquire(int depth)
+{
+    if (depth <= 0)
+        return;
+
+    uint32_t flags = irq_save();
+    int cpu = smp_cpu_id();
+
+    if (bkl_owner == cpu) {
+        bkl_depth += depth;
+    } else {
+        ticket_lock(&bkl);
+        bkl_owner = cpu;
+        bkl_depth = depth;
+    }
+
+    irq_restore(flags);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include "arch/i386/cpu/gdt.h"
+
+#define SMP_MAX_CPUS  8
+#define SMP_ALL_CPUS  ((1u << SMP_MAX_CPUS) - 1)
+
+/* Where the APs start in real mode: a page below 1MB, which physmem
+ * never hands out. The SIPI vector is its page number.
+ */
+#define AP_TRAMPOLINE_BASE  0x8000
+
+/* What the firmware tables (ACPI MADT, or the older MP table) describe */
+typedef struct smp_config {
+    uint32_t lapic_phys;
+    uint32_t ioapic_phys;           /* first I/O APIC, 0 if none          */
+    uint32_t ioapic_gsi_base;
+    int      ncpus;
+    uint8_t  apic_ids[SMP_MAX_CPUS];
+    uint8_t  irq_gsi[16];           /* ISA IRQ -> I/O APIC input          */
+    uint16_t irq_flags[16];         /* MPS INTI polarity/trigger bits     */
+    int      imcr;                  /* PIC mode: IMCR must be switched    */
+} smp_config_t;
+
+/* Find the CPUs and bring up the APs. With a single CPU, or no APIC
+ * description, this leaves the legacy PIC setup alone and returns.
+ */
+void smp_init(void);
+
+int      smp_active(void);          /* more than one CPU is running      */
+int      smp_num_cpus(void);        /* CPUs online                        */
+int      smp_cpu_online(int cpu);
+uint32_t smp_online_mask(void);
+uint8_t  smp_cpu_apic_id(int cpu);
+
+/* Make cpu run the scheduler (IRQ_RESCHED) */
+void smp_send_resched(int cpu);
+
+/* Kernel mappings are shared by every CPU: after changing one, make the
+ * other online CPUs invalidate npages pages at vaddr (0 = their whole
+ * TLB) and wait until all of them have. One request is in flight at a
+ * time.
+ */
+void smp_tlb_shootdown(uint32_t vaddr, uint32_t npages);
+/* Serve a shootdown this CPU still owes (IRQ_TLB, or a spin-wait) */
+void smp_tlb_poll(void);
+
+/* Body of every spin-wait loop. The waiting CPU may have interrupts off
+ * while the holder of what it waits for is waiting for its shootdown.
+ */
+static inline void cpu_relax(void)
+{
+    smp_tlb_poll();
+    __asm__ volatile("pause");
+}
+
+/* Index of the running CPU, 0 = BSP. Each CPU loads its own TSS, so the
+ * task register says which one we are on without touching the LAPIC.
+ */
+static inline int smp_cpu_id(void)
+{
+    uint16_t tr;
+    __asm__ volatile("str %0" : "=r"(tr));
+
+    if (tr < (GDT_ENTRY_AP_TSS << 3))
+        return 0;
+    return (tr >> 3) - GDT_ENTRY_AP_TSS + 1;
+}
+
+/*
+ * Big kernel lock. Everything outside the scheduler was written for one
+ * CPU, so kernel entries (syscalls, exceptions, device IRQs) and kernel
+ * threads hold this while they run. It nests on the owning CPU and is
+ * dropped across a context switch: the scheduler saves the depth in the
+ * task and takes it back when the task runs again.
+ */
+void bkl_lock(void);
+void bkl_unlock(void);
+int  bkl_release_all(void);         /* depth this CPU held, 0 if none     */
+void bkl_reacquire(int depth);
@@ -1,4 +1,6 @@
 #include "arch/i386/drivers/ata_pio.h"
+#include "arch/i386/cpu/irq.h"
+#include "sched/task.h"
 #include "console.h"
 
 #define ATA_PRIMARY_IO     0x1F0
@@ -22,6 +24,9 @@
 
 #define SECTOR_SIZE 512
 
+#define ATA_IRQ            14
+#define ATA_IRQ_TIMEOUT    2     /* ticks to wait for IRQ14 before polling */
+
 /* I/O helpers */
 static inline void outb(uint16_t port, uint8_t val) {
     __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
@@ -43,11 +48,39 @@ static inline uint16_t inw(uint16_t port) {
     return ret;
 }
 
-/* Busy wait until BSY=0, then DRQ=1 or error */
-static int ata_wait(void)
+/* tasks waiting for the drive to raise IRQ14 */
+static wait_queue_t ata_waiters = WAIT_QUEUE_INIT;
+
+static void ata_irq(void)
+{
+    /* reading STATUS acknowledges the interrupt on the drive */
+    (void)inb(ATA_PRIMARY_IO + ATA_REG_STATUS);
+    task_wake_all(&ata_waiters);
+}
+
+/* Wait until BSY=0, then DRQ=1 or error. If the drive will interrupt when
+ * it gets there and we are allowed to sleep, block on IRQ14 first; the
+ * alternate status register is read so the pending IRQ is not consumed.
+ * Boot-time and interrupt-context callers, or a lost IRQ, fall back to
+ * polling.
+ */
+static int ata_wait(int expect_irq)
 {
     uint8_t status;
 
+    if (expect_irq && task_can_block()) {
+        uint32_t flags = irq_save();
+
+        status = inb(ATA_PRIMARY_CTRL);
+        while ((status & ATA_SR_BSY) || !(status & (ATA_SR_DRQ | ATA_SR_ERR))) {
+            if (!task_wait(&ata_waiters, ATA_IRQ_TIMEOUT))
+                break;
+            status = inb(ATA_PRIMARY_CTRL);
+        }
+
+        irq_restore(flags);
+    }
+
     do {
         status = inb(ATA_PRIMARY_IO + ATA_REG_STATUS);
     } while (status & ATA_SR_BSY);
@@ -83,7 +116,7 @@ static int ata_read_sectors(uint32_t lba, uint8_t count, void *buffer)
     uint16_t *buf = (uint16_t *)buffer;
 
     for (uint8_t s = 0; s < count; ++s) {
-        if (ata_wait() != 0) return -1;
+        if (ata_wait(1) != 0) return -1;
 
         for (int i = 0; i < SECTOR_SIZE / 2; ++i) {
             buf[s * (SECTOR_SIZE / 2) + i] = inw(ATA_PRIMARY_IO + ATA_REG_DATA);
@@ -109,7 +142,8 @@ static int ata_write_sectors(uint32_t lba, uint8_t count, const void *buffer)
     const uint16_t *buf = (const uint16_t *)buffer;
 
     for (uint8_t s = 0; s < count; ++s) {
-        if (ata_wait() != 0) return -1;
+        /* the first DRQ of a write comes without an interrupt */
+        if (ata_wait(s > 0) != 0) return -1;
 
         for (int i = 0; i < SECTOR_SIZE / 2; ++i) {
             outw(ATA_PRIMARY_IO + ATA_REG_DATA,
@@ -156,6 +190,9 @@ block_device_t *ata_pio_init(void)
     dev.dev.read        = ata_block_read;
     dev.dev.write       = ata_block_write;
 
+    irq_register_handler(ATA_IRQ, ata_irq);
+    irq_unmask(ATA_IRQ);
+
     console_write("ata_pio: primary disk attached as /dev/ata0\n");
     return &dev.dev;
 }
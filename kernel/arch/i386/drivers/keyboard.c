@@ -1,7 +1,7 @@
-extern void shell_keypress(char c);
-
 #include <stdint.h>
 #include "arch/i386/cpu/irq.h"
+#include "arch/i386/drivers/keyboard.h"
+#include "sched/task.h"
 #include "console.h"
 
 static inline uint8_t inb(uint16_t port) {
@@ -46,6 +46,24 @@ static int caps_lock     = 0;
 #define SC_ALT      0x38
 #define SC_CAPS     0x3A
 
+/*
+ * IRQ1 only reads the scancode and appends it to a single-producer,
+ * single-consumer ring; decoding and everything the key triggers run in
+ * the task calling keyboard_getc(). The IRQ owns kbd_head, the reader owns
+ * kbd_tail, and each publishes its index with a release store after
+ * touching the slot, so neither side needs a lock. There is one reader
+ * (the shell); a full ring drops new scancodes.
+ */
+#define KBD_RING_SIZE  256      /* power of two */
+
+static uint8_t           kbd_ring[KBD_RING_SIZE];
+static volatile uint32_t kbd_head = 0;     /* next slot the IRQ fills  */
+static volatile uint32_t kbd_tail = 0;     /* next slot the reader takes */
+static keyboard_stats_t  kbd_stats;
+
+/* the reader sleeps here while the ring is empty */
+static wait_queue_t key_waiters = WAIT_QUEUE_INIT;
+
 static int is_letter(char c)
 {
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
@@ -53,8 +71,29 @@ static int is_letter(char c)
 
 static void keyboard_callback(void)
 {
-    uint8_t scancode = inb(0x60);
+    uint8_t  scancode = inb(0x60);
+    uint32_t head = kbd_head;
+    uint32_t tail = __atomic_load_n(&kbd_tail, __ATOMIC_ACQUIRE);
+
+    kbd_stats.scancodes++;
+    if (head - tail >= KBD_RING_SIZE) {
+        kbd_stats.dropped++;
+        return;
+    }
 
+    kbd_ring[head & (KBD_RING_SIZE - 1)] = scancode;
+    __atomic_store_n(&kbd_head, head + 1, __ATOMIC_RELEASE);
+
+    if (head - tail + 1 > kbd_stats.max_queued)
+        kbd_stats.max_queued = head - tail + 1;
+
+    if (key_waiters.head)
+        task_wake_all(&key_waiters);
+}
+
+/* scancode -> character, tracking modifiers; 0 if it produces none */
+static char keyboard_decode(uint8_t scancode)
+{
     /* key release? (high bit set) */
     if (scancode & 0x80) {
         uint8_t code = scancode & 0x7F;
@@ -66,24 +105,24 @@ static void keyboard_callback(void)
         else if (code == SC_ALT)
             alt_pressed = 0;
 
-        return;
+        return 0;
     }
 
     if (scancode == SC_LSHIFT || scancode == SC_RSHIFT) {
         shift_pressed = 1;
-        return;
+        return 0;
     }
     if (scancode == SC_CTRL) {
         ctrl_pressed = 1;
-        return;
+        return 0;
     }
     if (scancode == SC_ALT) {
         alt_pressed = 1;
-        return;
+        return 0;
     }
     if (scancode == SC_CAPS) {
         caps_lock = !caps_lock;
-        return;
+        return 0;
     }
 
     char c = 0;
@@ -91,7 +130,7 @@ static void keyboard_callback(void)
         char base = keymap[scancode];
 
         if (!base)
-            return;
+            return 0;
 
         int use_shift = shift_pressed;
 
@@ -115,11 +154,43 @@ static void keyboard_callback(void)
         }
     }
 
-    if (c) {
-        shell_keypress(c);
+    return c;
+}
+
+/* pop one scancode, blocking while the ring is empty */
+static uint8_t keyboard_read_scancode(void)
+{
+    uint32_t tail = kbd_tail;
+
+    if (__atomic_load_n(&kbd_head, __ATOMIC_ACQUIRE) == tail) {
+        /* IRQ1 is delivered to the CPU the reader runs on (the BSP), so
+         * with interrupts off no push can slip in before we are queued */
+        uint32_t flags = irq_save();
+        while (__atomic_load_n(&kbd_head, __ATOMIC_ACQUIRE) == tail)
+            task_wait(&key_waiters, 0);
+        irq_restore(flags);
+    }
+
+    uint8_t sc = kbd_ring[tail & (KBD_RING_SIZE - 1)];
+    __atomic_store_n(&kbd_tail, tail + 1, __ATOMIC_RELEASE);
+    return sc;
+}
+
+char keyboard_getc(void)
+{
+    for (;;) {
+        char c = keyboard_decode(keyboard_read_scancode());
+        if (c)
+            return c;
     }
 }
 
+void keyboard_get_stats(keyboard_stats_t *out)
+{
+    if (out)
+        *out = kbd_stats;
+}
+
 void keyboard_install(void) {
     /* IRQ1 is keyboard */
     irq_register_handler(1, keyboard_callback);
@@ -1,3 +1,15 @@
 #pragma once
+#include <stdint.h>
+
+typedef struct keyboard_stats {
+    uint32_t scancodes;     /* IRQ1 reads                         */
+    uint32_t dropped;       /* lost because the ring was full     */
+    uint32_t max_queued;    /* deepest the ring has been          */
+} keyboard_stats_t;
 
 void keyboard_install(void);
+/* Next character typed, blocking the calling task until there is one.
+ * Scancodes are buffered by IRQ1 and decoded here; single reader only.
+ */
+char keyboard_getc(void);
+void keyboard_get_stats(keyboard_stats_t *out);
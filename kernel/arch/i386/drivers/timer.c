@@ -1,15 +1,61 @@
 #include <stdint.h>
 #include "timer.h"
 #include "sched/task.h"
+#include "sched/timer_wheel.h"
 #include "arch/i386/cpu/irq.h"
+#include "arch/i386/cpu/smp.h"
 
 static inline void outb(uint16_t port, uint8_t value) {
     __asm__ volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
 }
 
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ volatile ("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#define PIT_HZ          1193180
+#define PIT_DIVISOR     (PIT_HZ / TIMER_HZ)
+
+#define PIT_CH0         0x40
+#define PIT_CH2         0x42
+#define PIT_CMD         0x43
+#define PIT_GATE        0x61        /* bit 0: ch2 gate, bit 5: ch2 output */
+
+/* longest one-shot the 16-bit counter can do, in whole ticks */
+#define MAX_IDLE_TICKS  (0xFFFF / PIT_DIVISOR)
+
+/* ns = (cycles * tsc_mult) >> TSC_SHIFT */
+#define TSC_SHIFT       22
+
 volatile uint32_t timer_ticks = 0;
 
-void shell_tick(void);
+static uint32_t tsc_khz  = 0;
+static uint32_t tsc_mult = 0;
+static uint64_t tsc_base = 0;
+
+static uint32_t oneshot_ticks = 0;  /* ticks the running one-shot covers */
+static timer_stats_t stats;
+
+/* 64/32 division with two divl steps (no libgcc) */
+uint64_t div_u64_rem(uint64_t n, uint32_t d, uint32_t *rem)
+{
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n;
+    uint32_t q_hi = hi / d, r = hi % d, q_lo;
+
+    __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    if (rem)
+        *rem = r;
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
 
 uint32_t timer_get_ticks(void)
 {
@@ -18,26 +64,191 @@ uint32_t timer_get_ticks(void)
 
 uint32_t timer_get_seconds(void)
 {
-    return timer_ticks / 100;
+    return timer_ticks / TIMER_HZ;
+}
+
+/* ---------------- PIT ---------------- */
+
+static void pit_periodic(void)
+{
+    outb(PIT_CMD, 0x36);            /* ch0, lo/hi, mode 3 */
+    outb(PIT_CH0, PIT_DIVISOR & 0xFF);
+    outb(PIT_CH0, (PIT_DIVISOR >> 8) & 0xFF);
+}
+
+static void pit_oneshot(uint32_t count)
+{
+    outb(PIT_CMD, 0x30);            /* ch0, lo/hi, mode 0 */
+    outb(PIT_CH0, count & 0xFF);
+    outb(PIT_CH0, (count >> 8) & 0xFF);
+}
+
+static uint32_t pit_read_count(void)
+{
+    outb(PIT_CMD, 0x00);            /* latch ch0 */
+    uint32_t lo = inb(PIT_CH0);
+    uint32_t hi = inb(PIT_CH0);
+    return (hi << 8) | lo;
+}
+
+/* ---------------- TSC ---------------- */
+
+static int cpu_has_tsc(void)
+{
+    uint32_t a = 1, b, c, d;
+    __asm__ volatile("cpuid" : "+a"(a), "=b"(b), "=c"(c), "=d"(d));
+    return (d >> 4) & 1;
+}
+
+/* count TSC cycles across 10ms of PIT channel 2 (the speaker channel,
+ * gated on with the speaker itself off); best of three */
+static uint32_t tsc_calibrate_khz(void)
+{
+    const uint32_t count = PIT_HZ / 100;
+    uint32_t best = 0xFFFFFFFFu;
+
+    for (int i = 0; i < 3; i++) {
+        outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+        outb(PIT_CMD, 0xB0);        /* ch2, lo/hi, mode 0 */
+        outb(PIT_CH2, count & 0xFF);
+        outb(PIT_CH2, (count >> 8) & 0xFF);
+
+        uint64_t t0 = rdtsc();
+        while (!(inb(PIT_GATE) & 0x20))
+            ;
+        uint64_t t1 = rdtsc();
+
+        if (t1 - t0 < best)
+            best = (uint32_t)(t1 - t0);
+    }
+
+    return best / 10;
+}
+
+uint64_t ktime_ns(void)
+{
+    if (!tsc_mult)
+        return (uint64_t)timer_ticks * (1000000000u / TIMER_HZ);
+
+    uint64_t c = rdtsc() - tsc_base;
+    uint32_t lo = (uint32_t)c, hi = (uint32_t)(c >> 32);
+
+    return (((uint64_t)lo * tsc_mult) >> TSC_SHIFT) +
+           (((uint64_t)hi * tsc_mult) << (32 - TSC_SHIFT));
+}
+
+void ktime_split(uint64_t ns, uint32_t *sec, uint32_t *nsec)
+{
+    uint32_t rem;
+    uint64_t s = div_u64_rem(ns, 1000000000u, &rem);
+
+    if (sec)  *sec  = (uint32_t)s;
+    if (nsec) *nsec = rem;
+}
+
+uint32_t timer_tsc_khz(void)
+{
+    return tsc_khz;
+}
+
+/* ---------------- tick / tickless idle ---------------- */
+
+static void timer_advance(uint32_t n)
+{
+    timer_ticks += n;
+
+    /* expire kernel timers (sleeps, timeouts, periodic UI refresh) */
+    timer_wheel_run(timer_ticks);
 }
 
 static void timer_callback(void)
 {
-    timer_ticks++;
+    uint32_t n = 1;
 
-    /* Notify shell once per tick; shell_tick() will throttle itself */
-    shell_tick();
-    // task_yield();
+    stats.irqs++;
+    if (oneshot_ticks) {
+        /* the idle one-shot ran out: all of it has passed */
+        n = oneshot_ticks;
+        oneshot_ticks = 0;
+        stats.idle_ticks += n;
+        pit_periodic();
+    }
+
+    timer_advance(n);
+
+    /* charge the tick to the running task; preemption happens after EOI */
+    task_tick();
+}
+
+/* Both run in the BSP's idle task, which does not otherwise hold the big
+ * kernel lock; the wheel and the PIT need it.
+ */
+void timer_idle_enter(void)
+{
+    uint32_t flags = irq_save();
+    bkl_lock();
+
+    if (!oneshot_ticks) {
+        uint32_t n = timer_wheel_next_due(MAX_IDLE_TICKS);
+        if (n > 1) {
+            pit_oneshot(n * PIT_DIVISOR);
+            oneshot_ticks = n;
+            stats.oneshots++;
+        }
+    }
+
+    bkl_unlock();
+    irq_restore(flags);
+}
+
+void timer_idle_exit(void)
+{
+    uint32_t flags = irq_save();
+    bkl_lock();
+
+    if (oneshot_ticks) {
+        /* woken early by another interrupt: count the whole ticks that
+         * went by and go back to periodic mode (the partial tick is lost) */
+        uint32_t total = oneshot_ticks * PIT_DIVISOR;
+        uint32_t left  = pit_read_count();
+        uint32_t n     = (left <= total ? total - left : total) / PIT_DIVISOR;
+
+        oneshot_ticks = 0;
+        pit_periodic();
+
+        stats.idle_ticks += n;
+        if (n)
+            timer_advance(n);
+    }
+
+    bkl_unlock();
+    irq_restore(flags);
+}
+
+void timer_get_stats(timer_stats_t *out)
+{
+    if (out) {
+        *out = stats;
+        out->ticks = timer_ticks;
+    }
 }
 
 void timer_install(void)
 {
-    uint32_t freq    = 100;
-    uint32_t divisor = 1193180 / freq;
+    if (cpu_has_tsc()) {
+        tsc_khz = tsc_calibrate_khz();
+        /* below 1MHz the multiplier would not fit; keep the tick clock */
+        if (tsc_khz >= 1000) {
+            tsc_mult = (uint32_t)div_u64_rem((uint64_t)1000000 << TSC_SHIFT,
+                                             tsc_khz, 0);
+            tsc_base = rdtsc();
+        } else {
+            tsc_khz = 0;
+        }
+    }
 
-    outb(0x43, 0x36);
-    outb(0x40, divisor & 0xFF);
-    outb(0x40, (divisor >> 8) & 0xFF);
+    pit_periodic();
 
+    timer_wheel_init();
     irq_register_handler(0, timer_callback);
 }
@@ -1,6 +1,34 @@
 #pragma once
 #include <stdint.h>
 
+#define TIMER_HZ  100
+
+typedef struct timer_stats {
+    uint32_t ticks;         /* timer_ticks now                          */
+    uint32_t irqs;          /* IRQ0s taken                              */
+    uint32_t oneshots;      /* idle periods programmed as one-shot      */
+    uint32_t idle_ticks;    /* ticks that passed inside those periods   */
+} timer_stats_t;
+
 void     timer_install(void);
 uint32_t timer_get_ticks(void);
 uint32_t timer_get_seconds(void);
+
+/* Monotonic nanoseconds since timer_install(), from the TSC calibrated
+ * against the PIT (tick resolution if there is no usable TSC).
+ */
+uint64_t ktime_ns(void);
+void     ktime_split(uint64_t ns, uint32_t *sec, uint32_t *nsec);
+uint32_t timer_tsc_khz(void);
+
+/* n / d for 64-bit n; the kernel has no libgcc for the '/' operator */
+uint64_t div_u64_rem(uint64_t n, uint32_t d, uint32_t *rem);
+
+/* Tickless idle: before halting, the idle task reprograms the PIT as a
+ * one-shot up to the next pending kernel timer; timer_idle_exit() accounts
+ * the elapsed ticks when another interrupt ends the idle period early.
+ */
+void timer_idle_enter(void);
+void timer_idle_exit(void);
+
+void timer_get_stats(timer_stats_t *out);
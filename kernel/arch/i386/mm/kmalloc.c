@@ -1,27 +1,441 @@
 #include "kmalloc.h"
+#include "paging.h"
+#include "physmem.h"
 #include "console.h"
+#include "sched/task.h"
+#include "sched/spinlock.h"
 
-#define KHEAP_START 0x1000000   // 16MB mark (safe unused RAM)
-#define KHEAP_SIZE  0x100000    // 1MB heap
+#define PAGE_SIZE   4096
+#define KHEAP_START 0xC0000000u   // virtual window above the 2GB identity map
+#define KHEAP_MAX   0x10000000u   // window size; frames are committed on demand
+#define KHEAP_PAGES (KHEAP_MAX / PAGE_SIZE)
 
-static uint8_t* heap = (uint8_t*)KHEAP_START;
-static uint32_t heap_offset = 0;
+/* The descriptor array lives at the bottom of the window itself and is
+ * committed along with the pages it describes (one page per 4MB of heap).
+ */
+#define KHEAP_DESC_PAGES  (KHEAP_PAGES * sizeof(uint32_t) / PAGE_SIZE)
+#define DESCS_PER_PAGE    (PAGE_SIZE / sizeof(uint32_t))
+
+/*
+ * The heap window is handed out in whole pages by a small page-run
+ * allocator. Each page has a descriptor word: the low 8 bits say what the
+ * page is used for, the upper 24 bits carry an argument (size class or
+ * run length).
+ *
+ * Pages below the break are backed by frames from phys_alloc_frame() and
+ * mapped with paging_map(); when the topmost run is freed the break drops
+ * and its frames go back to physmem.
+ *
+ * Small requests (<= 2048 bytes) come from per-class free lists. A class
+ * grabs one page at a time and carves it into equal objects, so both
+ * kmalloc() and kfree() are a single list push/pop. Larger requests get
+ * a run of pages; freed runs are coalesced with their neighbours.
+ *
+ * Free runs sit in power-of-two bins (bin b: 2^b .. 2^(b+1)-1 pages) with
+ * a bitmap of the non-empty ones. An allocation takes the head of the
+ * first non-empty bin that is sure to fit, so it does not walk the runs;
+ * the price is that a run in the request's own bin is only used if it is
+ * the head of that bin, otherwise the heap grows.
+ *
+ * heap_lock covers all of the above. It is a spinlock taken with
+ * interrupts off, so kmalloc()/kfree() work from any CPU and context.
+ */
+#define PD_NONE   0   /* past the break, or inside a run               */
+#define PD_SLAB   1   /* carved into objects, arg = class index        */
+#define PD_LARGE  2   /* first page of a large object, arg = pages     */
+#define PD_FREE   3   /* first and last page of a free run, arg = pages */
+
+#define PD_KIND(d)      ((d) & 0xFF)
+#define PD_ARG(d)       ((d) >> 8)
+#define PD_MAKE(k, a)   ((uint32_t)(k) | ((uint32_t)(a) << 8))
+
+#define NO_PAGE 0xFFFFFFFFu
+
+#define RUN_BINS  20            /* 2^20 pages > the whole window */
+
+typedef struct free_run {
+    struct free_run* next;
+    struct free_run* prev;
+} free_run_t;
+
+static uint8_t*    heap = (uint8_t*)KHEAP_START;
+static uint32_t*   page_desc = (uint32_t*)KHEAP_START;
+static uint32_t    desc_pages = 0;        /* descriptor pages committed */
+static uint32_t    heap_brk = KHEAP_DESC_PAGES;
+static free_run_t* run_bins[RUN_BINS];
+static uint32_t    run_bin_map = 0;       /* bit b: run_bins[b] non-empty */
+
+static void*                 class_free[KMALLOC_NUM_CLASSES];
+static kmalloc_class_stats_t class_stats[KMALLOC_NUM_CLASSES];
+static kmalloc_stats_t       heap_stats;
+
+static spinlock_t heap_lock = SPINLOCK_INIT("kheap");
+
+static inline void* page_addr(uint32_t idx)
+{
+    return heap + idx * PAGE_SIZE;
+}
+
+static inline uint32_t page_index(const void* p)
+{
+    return ((uint32_t)p - KHEAP_START) / PAGE_SIZE;
+}
+
+/* ---------------- backing frames ---------------- */
+
+static int commit_page(uint32_t idx)
+{
+    uint32_t frame = phys_alloc_frame();
+    if (!frame)
+        return -1;
+
+    if (paging_map((uint32_t)page_addr(idx), frame, PAGE_PRESENT | PAGE_RW) != 0) {
+        phys_free_frame(frame);
+        return -1;
+    }
+    return 0;
+}
+
+/* unmap pages [first, end) and give their frames back, one TLB flush */
+static void release_pages(uint32_t first, uint32_t end)
+{
+    if (end > first)
+        paging_unmap_range((uint32_t)page_addr(first), end - first, 1);
+}
+
+/* make sure the descriptors for pages [0, end) are backed */
+static int commit_descs(uint32_t end)
+{
+    uint32_t need = (end + DESCS_PER_PAGE - 1) / DESCS_PER_PAGE;
+
+    while (desc_pages < need) {
+        if (commit_page(desc_pages) != 0)
+            return -1;
+
+        uint32_t* d = (uint32_t*)page_addr(desc_pages);
+        for (uint32_t i = 0; i < DESCS_PER_PAGE; i++)
+            d[i] = PD_NONE;
+        desc_pages++;
+    }
+    return 0;
+}
+
+static int heap_grow(uint32_t npages)
+{
+    uint32_t new_brk = heap_brk + npages;
+
+    if (new_brk > KHEAP_PAGES)
+        return -1;
+    if (commit_descs(new_brk) != 0)
+        return -1;
+
+    for (uint32_t idx = heap_brk; idx < new_brk; idx++) {
+        if (commit_page(idx) != 0) {
+            release_pages(heap_brk, idx);
+            return -1;
+        }
+    }
+
+    heap_brk = new_brk;
+    heap_stats.heap_pages = heap_brk - KHEAP_DESC_PAGES;
+    return 0;
+}
+
+static void heap_shrink(uint32_t new_brk)
+{
+    if (heap_brk > new_brk) {
+        release_pages(new_brk, heap_brk);
+        heap_brk = new_brk;
+    }
+
+    heap_stats.heap_pages = heap_brk - KHEAP_DESC_PAGES;
+}
+
+/* ---------------- page runs ---------------- */
+
+/* bin holding runs of npages (floor log2) */
+static inline int run_bin(uint32_t npages)
+{
+    return 31 - __builtin_clz(npages);
+}
+
+static void run_insert(uint32_t idx, uint32_t npages)
+{
+    free_run_t* r = (free_run_t*)page_addr(idx);
+    int b = run_bin(npages);
+
+    page_desc[idx]              = PD_MAKE(PD_FREE, npages);
+    page_desc[idx + npages - 1] = PD_MAKE(PD_FREE, npages);
+
+    r->prev = 0;
+    r->next = run_bins[b];
+    if (run_bins[b])
+        run_bins[b]->prev = r;
+    run_bins[b] = r;
+    run_bin_map |= 1u << b;
+
+    heap_stats.free_pages += npages;
+}
+
+static void run_remove(uint32_t idx)
+{
+    free_run_t* r = (free_run_t*)page_addr(idx);
+    uint32_t npages = PD_ARG(page_desc[idx]);
+    int b = run_bin(npages);
+
+    if (r->prev) r->prev->next = r->next;
+    else         run_bins[b]   = r->next;
+    if (r->next) r->next->prev = r->prev;
+    if (!run_bins[b])
+        run_bin_map &= ~(1u << b);
+
+    page_desc[idx]              = PD_NONE;
+    page_desc[idx + npages - 1] = PD_NONE;
+
+    heap_stats.free_pages -= npages;
+}
+
+/* a free run of at least npages, without searching; NO_PAGE if none */
+static uint32_t run_find(uint32_t npages)
+{
+    int b = run_bin(npages);
+
+    /* every run in a higher bin is big enough (as is all of bin b when
+     * npages is a power of two) */
+    int from = (npages & (npages - 1)) ? b + 1 : b;
+    uint32_t map = from < RUN_BINS ? run_bin_map & ~((1u << from) - 1) : 0;
+    if (map)
+        return page_index(run_bins[__builtin_ctz(map)]);
+
+    /* the request's own bin: its head only */
+    if (run_bins[b] && PD_ARG(page_desc[page_index(run_bins[b])]) >= npages)
+        return page_index(run_bins[b]);
+    return NO_PAGE;
+}
+
+static uint32_t pages_alloc(uint32_t npages)
+{
+    uint32_t idx = run_find(npages);
+    if (idx != NO_PAGE) {
+        uint32_t have = PD_ARG(page_desc[idx]);
+
+        run_remove(idx);
+        if (have > npages)
+            run_insert(idx + npages, have - npages);
+        return idx;
+    }
+
+    /* otherwise grow the heap at the break */
+    idx = heap_brk;
+    if (heap_grow(npages) != 0)
+        return NO_PAGE;
+    return idx;
+}
+
+static void pages_free(uint32_t idx, uint32_t npages)
+{
+    page_desc[idx] = PD_NONE;
+
+    /* merge with the following run */
+    uint32_t next = idx + npages;
+    if (next < heap_brk && PD_KIND(page_desc[next]) == PD_FREE) {
+        uint32_t n = PD_ARG(page_desc[next]);
+        run_remove(next);
+        npages += n;
+    }
+
+    /* merge with the preceding run (its tail descriptor sits at idx-1) */
+    if (idx > KHEAP_DESC_PAGES && PD_KIND(page_desc[idx - 1]) == PD_FREE) {
+        uint32_t n = PD_ARG(page_desc[idx - 1]);
+        run_remove(idx - n);
+        idx    -= n;
+        npages += n;
+    }
+
+    /* a run that touches the break hands its frames back to physmem */
+    if (idx + npages == heap_brk) {
+        heap_shrink(idx);
+        return;
+    }
+
+    run_insert(idx, npages);
+}
+
+/* ---------------- size classes ---------------- */
+
+static inline int size_to_class(uint32_t size)
+{
+    if (size <= (1u << KMALLOC_MIN_SHIFT))
+        return 0;
+    return (32 - __builtin_clz(size - 1)) - KMALLOC_MIN_SHIFT;
+}
+
+static int class_refill(int cls)
+{
+    uint32_t idx = pages_alloc(1);
+    if (idx == NO_PAGE)
+        return -1;
+
+    page_desc[idx] = PD_MAKE(PD_SLAB, cls);
+
+    uint32_t obj  = class_stats[cls].obj_size;
+    uint8_t* base = (uint8_t*)page_addr(idx);
+
+    /* push back-to-front so objects come out in address order */
+    for (uint32_t off = PAGE_SIZE; off >= obj; off -= obj) {
+        void** o = (void**)(base + off - obj);
+        *o = class_free[cls];
+        class_free[cls] = o;
+    }
+
+    class_stats[cls].slab_pages++;
+    return 0;
+}
 
 void kmalloc_init(void)
 {
+    heap_shrink(KHEAP_DESC_PAGES);
+    for (int b = 0; b < RUN_BINS; b++)
+        run_bins[b] = 0;
+    run_bin_map = 0;
+
+    for (uint32_t i = 0; i < desc_pages * DESCS_PER_PAGE; i++)
+        page_desc[i] = PD_NONE;
+
+    for (int c = 0; c < KMALLOC_NUM_CLASSES; c++) {
+        class_free[c] = 0;
+        class_stats[c].obj_size   = 1u << (KMALLOC_MIN_SHIFT + c);
+        class_stats[c].slab_pages = 0;
+        class_stats[c].in_use     = 0;
+        class_stats[c].allocs     = 0;
+        class_stats[c].frees      = 0;
+    }
+
+    heap_stats = (kmalloc_stats_t){0};
+
+    if (commit_descs(heap_brk + 1) != 0)
+        console_write("kmalloc_init: cannot commit heap descriptors!\n");
+
     console_write("Kernel heap initialized.\n");
-    heap_offset = 0;
+}
+
+static void* heap_alloc(uint32_t size)
+{
+    if (size <= KMALLOC_MAX_SMALL) {
+        int cls = size_to_class(size);
+
+        if (!class_free[cls] && class_refill(cls) != 0)
+            goto oom;
+
+        void** o = (void**)class_free[cls];
+        class_free[cls] = *o;
+
+        class_stats[cls].in_use++;
+        class_stats[cls].allocs++;
+        task_charge_heap((int32_t)class_stats[cls].obj_size);
+        return o;
+    }
+
+    if (size > KHEAP_MAX - KHEAP_DESC_PAGES * PAGE_SIZE)
+        goto oom;
+
+    uint32_t npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t idx = pages_alloc(npages);
+    if (idx == NO_PAGE)
+        goto oom;
+
+    page_desc[idx] = PD_MAKE(PD_LARGE, npages);
+
+    heap_stats.large_in_use++;
+    heap_stats.large_pages += npages;
+    heap_stats.large_allocs++;
+    task_charge_heap((int32_t)(npages * PAGE_SIZE));
+    return page_addr(idx);
+
+oom:
+    heap_stats.failures++;
+    console_write("kmalloc: OUT OF MEMORY!\n");
+    return 0;
+}
+
+static void heap_free(void* ptr)
+{
+    uint32_t addr = (uint32_t)ptr;
+    if (addr <  KHEAP_START + KHEAP_DESC_PAGES * PAGE_SIZE ||
+        addr >= KHEAP_START + heap_brk * PAGE_SIZE) {
+        console_write("kfree: pointer outside kernel heap\n");
+        return;
+    }
+
+    uint32_t idx = page_index(ptr);
+    uint32_t d   = page_desc[idx];
+
+    switch (PD_KIND(d)) {
+    case PD_SLAB: {
+        int cls = (int)PD_ARG(d);
+        void** o = (void**)ptr;
+        *o = class_free[cls];
+        class_free[cls] = o;
+
+        class_stats[cls].in_use--;
+        class_stats[cls].frees++;
+        task_charge_heap(-(int32_t)class_stats[cls].obj_size);
+        return;
+    }
+
+    case PD_LARGE:
+        if (addr & (PAGE_SIZE - 1))
+            break;
+
+        heap_stats.large_in_use--;
+        heap_stats.large_pages -= PD_ARG(d);
+        heap_stats.large_frees++;
+        task_charge_heap(-(int32_t)(PD_ARG(d) * PAGE_SIZE));
+        pages_free(idx, PD_ARG(d));
+        return;
+
+    default:
+        break;
+    }
+
+    console_write("kfree: invalid pointer\n");
 }
 
 void* kmalloc(uint32_t size)
 {
-    if (heap_offset + size >= KHEAP_SIZE) {
-        console_write("kmalloc: OUT OF MEMORY!\n");
+    if (size == 0)
         return 0;
-    }
 
-    void* ptr = heap + heap_offset;
-    heap_offset += size;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    void* p = heap_alloc(size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return p;
+}
+
+void kfree(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    heap_free(ptr);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void kmalloc_get_stats(kmalloc_stats_t* out)
+{
+    if (!out)
+        return;
+
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    *out = heap_stats;
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
 
-    return ptr;
+int kmalloc_get_class_stats(int cls, kmalloc_class_stats_t* out)
+{
+    if (cls < 0 || cls >= KMALLOC_NUM_CLASSES || !out)
+        return -1;
+    *out = class_stats[cls];
+    return 0;
 }
@@ -1,5 +1,34 @@
 #pragma once
 #include <stdint.h>
 
+/* Size classes: 16, 32, ..., 2048 bytes. Anything larger is a page-run
+ * ("large") allocation rounded up to whole 4KB pages.
+ */
+#define KMALLOC_MIN_SHIFT    4
+#define KMALLOC_NUM_CLASSES  8
+#define KMALLOC_MAX_SMALL    (1u << (KMALLOC_MIN_SHIFT + KMALLOC_NUM_CLASSES - 1))
+
+typedef struct kmalloc_class_stats {
+    uint32_t obj_size;     /* bytes per object in this class       */
+    uint32_t slab_pages;   /* 4KB pages carved for this class      */
+    uint32_t in_use;       /* objects currently handed out         */
+    uint32_t allocs;       /* total successful kmalloc() calls     */
+    uint32_t frees;        /* total kfree() calls                  */
+} kmalloc_class_stats_t;
+
+typedef struct kmalloc_stats {
+    uint32_t heap_pages;   /* pages committed below the heap break */
+    uint32_t free_pages;   /* pages sitting in free runs           */
+    uint32_t large_in_use; /* live large objects                   */
+    uint32_t large_pages;  /* pages held by live large objects     */
+    uint32_t large_allocs;
+    uint32_t large_frees;
+    uint32_t failures;     /* kmalloc() calls that returned NULL   */
+} kmalloc_stats_t;
+
 void kmalloc_init(void);
 void* kmalloc(uint32_t size);
+void kfree(void* ptr);
+
+void kmalloc_get_stats(kmalloc_stats_t* out);
+int  kmalloc_get_class_stats(int cls, kmalloc_class_stats_t* out);
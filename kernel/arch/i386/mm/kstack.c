@@ -0,0 +1,158 @@
+#include "kstack.h"
+#include "paging.h"
+#include "physmem.h"
+#include "console.h"
+
+#define PAGE_SIZE        4096
+#define KSTACK_MAX_PAGES (KSTACK_MAX_SIZE / PAGE_SIZE)
+#define KSTACK_CACHE_MAX 8      /* freed stacks kept per size */
+
+/*
+ * Slots that hold no stack are kept on a small index stack; slots that
+ * were never used are handed out from next_slot upward. A freed stack
+ * keeps its frames and goes on a per-size cache list (linked through its
+ * own lowest word), so creating a task of a common size is a list pop
+ * with no page table work. Past KSTACK_CACHE_MAX the pages go back to
+ * physmem.
+ */
+static uint16_t free_slots[KSTACK_SLOTS];
+static uint32_t nfree_slots = 0;
+static uint32_t next_slot   = 0;
+
+static void*    cache[KSTACK_MAX_PAGES + 1];
+static uint32_t cache_len[KSTACK_MAX_PAGES + 1];
+
+static kstack_stats_t stats;
+
+static inline uint32_t slot_top(uint32_t slot)
+{
+    return KSTACK_BASE + (slot + 1) * KSTACK_SLOT_SIZE;
+}
+
+static inline uint32_t slot_of(uint32_t addr)
+{
+    return (addr - KSTACK_BASE) / KSTACK_SLOT_SIZE;
+}
+
+static int slot_get(uint32_t* slot)
+{
+    if (nfree_slots) {
+        *slot = free_slots[--nfree_slots];
+        return 0;
+    }
+    if (next_slot < KSTACK_SLOTS) {
+        *slot = next_slot++;
+        return 0;
+    }
+    return -1;
+}
+
+void kstack_init(void)
+{
+    nfree_slots = 0;
+    next_slot   = 0;
+    for (uint32_t i = 0; i <= KSTACK_MAX_PAGES; i++) {
+        cache[i]     = 0;
+        cache_len[i] = 0;
+    }
+    stats = (kstack_stats_t){0};
+}
+
+void* kstack_alloc(uint32_t size)
+{
+    uint32_t npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t base;
+
+    if (npages == 0 || npages > KSTACK_MAX_PAGES) {
+        console_write("kstack_alloc: bad stack size\n");
+        stats.failures++;
+        return 0;
+    }
+
+    if (cache[npages]) {
+        void** s = (void**)cache[npages];
+        cache[npages] = *s;
+        cache_len[npages]--;
+
+        base = (uint32_t)s;
+        stats.cached--;
+        stats.cached_pages -= npages;
+        stats.reused++;
+    } else {
+        uint32_t slot;
+        if (slot_get(&slot) != 0) {
+            console_write("kstack_alloc: out of stack slots\n");
+            stats.failures++;
+            return 0;
+        }
+
+        base = slot_top(slot) - npages * PAGE_SIZE;
+        for (uint32_t i = 0; i < npages; i++) {
+            uint32_t frame = phys_alloc_frame();
+            if (frame && paging_map(base + i * PAGE_SIZE, frame,
+                                    PAGE_PRESENT | PAGE_RW) != 0) {
+                phys_free_frame(frame);
+                frame = 0;
+            }
+            if (!frame) {
+                paging_unmap_range(base, i, 1);
+                free_slots[nfree_slots++] = (uint16_t)slot;
+                console_write("kstack_alloc: out of memory\n");
+                stats.failures++;
+                return 0;
+            }
+        }
+        stats.slots_used++;
+    }
+
+    stats.allocs++;
+    stats.live++;
+    stats.live_pages += npages;
+    return (void*)base;
+}
+
+void kstack_free(void* base, uint32_t size)
+{
+    uint32_t npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t addr   = (uint32_t)base;
+
+    if (!base)
+        return;
+    if (addr < KSTACK_BASE || addr >= slot_top(KSTACK_SLOTS - 1) ||
+        npages == 0 || npages > KSTACK_MAX_PAGES ||
+        addr != slot_top(slot_of(addr)) - npages * PAGE_SIZE) {
+        console_write("kstack_free: not a kernel stack\n");
+        return;
+    }
+
+    stats.live--;
+    stats.live_pages -= npages;
+
+    if (cache_len[npages] < KSTACK_CACHE_MAX) {
+        void** s = (void**)base;
+        *s = cache[npages];
+        cache[npages] = s;
+        cache_len[npages]++;
+
+        stats.cached++;
+        stats.cached_pages += npages;
+        return;
+    }
+
+    paging_unmap_range(addr, npages, 1);
+    free_slots[nfree_slots++] = (uint16_t)slot_of(addr);
+    stats.slots_used--;
+}
+
+int kstack_is_guard(uint32_t addr)
+{
+    if (addr < KSTACK_BASE || addr >= slot_top(KSTACK_SLOTS - 1))
+        return 0;
+    return paging_get_phys(addr & ~(PAGE_SIZE - 1)) == 0;
+}
+
+void kstack_get_stats(kstack_stats_t* out)
+{
+    if (out)
+        *out = stats;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+
+/* Kernel stacks live in their own window above the heap, one 64KB slot
+ * per stack. The stack is mapped at the top of its slot and the rest of
+ * the slot stays unmapped, so running off the bottom faults instead of
+ * scribbling over a neighbour.
+ */
+#define KSTACK_BASE      0xD0000000u
+#define KSTACK_SLOT_SIZE 0x10000u
+#define KSTACK_SLOTS     1024u                          /* 64MB window */
+#define KSTACK_MAX_SIZE  (KSTACK_SLOT_SIZE - 0x1000u)   /* >= 1 guard page */
+
+typedef struct kstack_stats {
+    uint32_t live;          /* stacks handed out                          */
+    uint32_t live_pages;
+    uint32_t cached;        /* freed stacks kept mapped for reuse         */
+    uint32_t cached_pages;
+    uint32_t slots_used;    /* slots live or cached                       */
+    uint32_t allocs;
+    uint32_t reused;        /* allocs served from the cache               */
+    uint32_t failures;
+} kstack_stats_t;
+
+void kstack_init(void);
+
+/* A stack of at least size bytes (whole pages, at most KSTACK_MAX_SIZE).
+ * Returns its lowest address; the top is base + the rounded size.
+ */
+void* kstack_alloc(uint32_t size);
+void  kstack_free(void* base, uint32_t size);
+
+/* Is addr in the stack window but outside every mapped stack? */
+int   kstack_is_guard(uint32_t addr);
+
+void  kstack_get_stats(kstack_stats_t* out);
@@ -1,76 +1,232 @@
 #include <stdint.h>
 #include "paging.h"
+#include "physmem.h"
+#include "kmalloc.h"
 #include "console.h"
+#include "arch/i386/cpu/irq.h"
+#include "arch/i386/cpu/smp.h"
 
 #define PAGE_SIZE        4096
+#define LARGE_PAGE_SIZE  0x400000u
 #define MAX_IDENTITY_MB  2048
-#define NUM_PAGE_TABLES  (MAX_IDENTITY_MB / 4) // 4MB per page table & total pages = 2048MB
+#define NUM_IDENTITY_PDES (MAX_IDENTITY_MB / 4) // one 4MB page per PDE
 
 #define PAGE_PRESENT  0x001
 #define PAGE_RW       0x002
 #define PAGE_USER     0x004
+#define PAGE_LARGE    0x080   // PDE.PS: maps 4MB directly
+#define PAGE_COW      0x200   // available bit: read-only until the next write fault
 
+#define PF_PRESENT    0x1     // page fault error code bits
+#define PF_WRITE      0x2
+
+#define CR0_WP        0x00010000u
+#define CR4_PSE       0x010
+
+/* Above this many pages one CR3 reload is cheaper than invlpg per page */
+#define TLB_FLUSH_THRESHOLD 32
+
+#define USER_PDE_FIRST (USER_BASE >> 22)
+#define USER_PDE_LAST  ((USER_END >> 22) - 1)
+
+/*
+ * The 0-2GB identity map is built from 4MB PSE pages: 512 PDEs, no page
+ * tables, nothing in .bss but the directory itself. A 4KB table only
+ * appears when paging_map()/paging_unmap() needs finer control inside a
+ * large page (the large page is split, keeping its identity mapping) or
+ * touches a region above the identity map such as the kernel heap.
+ *
+ * Every address space has its own directory. All PDEs outside
+ * USER_BASE..USER_END are kernel PDEs: supervisor-only and identical in
+ * every directory, so kernel page tables are shared and a change to a
+ * kernel PDE is copied into all of them. The user PDEs are private.
+ */
 static uint32_t page_directory[1024] __attribute__((aligned(4096)));
-static uint32_t page_tables[NUM_PAGE_TABLES][1024] __attribute__((aligned(4096)));
+
+static addr_space_t  kernel_space = { page_directory, 0, 0, 0 };
+
+/* each CPU has its own CR3 */
+static addr_space_t* cpu_space[SMP_MAX_CPUS];
+#define current_space (cpu_space[smp_cpu_id()])
+
+static uint32_t mmio_next = KMMIO_BASE;
+
+static paging_stats_t vm_stats;
 
 static inline uint32_t pde_index(uint32_t addr) { return addr >> 22; }
 static inline uint32_t pte_index(uint32_t addr) { return (addr >> 12) & 0x3FF; }
 
-static inline uint32_t* get_pte(uint32_t vaddr)
+static inline int is_user_addr(uint32_t addr)
 {
-    uint32_t pdi = pde_index(vaddr);
-    uint32_t pti = pte_index(vaddr);
+    return addr >= USER_BASE && addr < USER_END;
+}
+
+static inline void flush_tlb(void)
+{
+    uint32_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    __asm__ volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    vm_stats.tlb_full_flushes++;
+}
 
-    if (pdi >= NUM_PAGE_TABLES)
+static inline void invlpg(uint32_t addr)
+{
+    __asm__ volatile("invlpg (%0)" :: "r"(addr) : "memory");
+    vm_stats.tlb_invlpg++;
+}
+
+/*
+ * Pending invalidations for one range operation. Only PTEs that were
+ * present can be cached, so newly mapped pages are never recorded.
+ */
+typedef struct tlb_batch {
+    uint32_t first;     /* lowest stale page  */
+    uint32_t last;      /* highest stale page */
+    uint32_t pages;     /* stale pages        */
+} tlb_batch_t;
+
+static inline void tlb_note(tlb_batch_t* b, uint32_t vaddr)
+{
+    if (b->pages == 0 || vaddr < b->first)
+        b->first = vaddr;
+    if (b->pages == 0 || vaddr > b->last)
+        b->last = vaddr;
+    b->pages++;
+}
+
+void paging_flush_local(uint32_t vaddr, uint32_t npages)
+{
+    if (npages == 0 || npages > TLB_FLUSH_THRESHOLD) {
+        flush_tlb();
+        return;
+    }
+
+    for (uint32_t i = 0; i < npages; i++)
+        invlpg((vaddr & ~0xFFFu) + i * PAGE_SIZE);
+}
+
+/* The kernel half is in every CPU's TLB; a user space is only ever live
+ * on one CPU at a time, so its entries need no shootdown.
+ */
+static void tlb_shoot(uint32_t vaddr, uint32_t npages)
+{
+    if (is_user_addr(vaddr) || !smp_active())
+        return;
+
+    smp_tlb_shootdown(vaddr, npages);
+    vm_stats.tlb_shootdowns++;
+}
+
+/* Invalidate everything recorded, here and on the other CPUs: invlpg over
+ * [first, last] when that is a handful of pages, otherwise a single CR3
+ * reload.
+ */
+static void tlb_finish(tlb_batch_t* b)
+{
+    vm_stats.range_ops++;
+
+    if (b->pages == 0)
+        return;
+
+    uint32_t npages = (b->last - b->first) / PAGE_SIZE + 1;
+    paging_flush_local(b->first, npages);
+    tlb_shoot(b->first, npages);
+}
+
+static uint32_t* alloc_table(void)
+{
+    uint32_t frame = phys_alloc_frame();
+    if (!frame)
         return 0;
 
-    return &page_tables[pdi][pti];
+    uint32_t* table = (uint32_t*)frame;
+    for (uint32_t i = 0; i < 1024; i++)
+        table[i] = 0;
+    return table;
+}
+
+/* kernel PDEs are the same in every directory */
+static void set_kernel_pde(uint32_t pdi, uint32_t pde)
+{
+    for (addr_space_t* as = &kernel_space; as; as = as->next)
+        as->dir[pdi] = pde;
+}
+
+/* Replace a 4MB PDE with a page table describing the same 1024 frames */
+static int split_large_pde(uint32_t pdi)
+{
+    uint32_t pde = page_directory[pdi];
+    uint32_t* table = alloc_table();
+    if (!table)
+        return -1;
+
+    uint32_t base  = pde & 0xFFC00000u;
+    uint32_t flags = pde & (PAGE_PRESENT | PAGE_RW | PAGE_USER);
+    for (uint32_t i = 0; i < 1024; i++)
+        table[i] = (base + i * PAGE_SIZE) | flags;
+
+    set_kernel_pde(pdi, (uint32_t)table | flags);
+
+    /* a large-page TLB entry may cover the whole 4MB */
+    flush_tlb();
+    tlb_shoot(pdi << 22, 0);
+    return 0;
 }
 
-void paging_set_user_for_range(uint32_t start, uint32_t end)
+static uint32_t* get_pte(addr_space_t* as, uint32_t vaddr, int create)
 {
-    if (end < start) return;
+    uint32_t pdi = pde_index(vaddr);
+    uint32_t pti = pte_index(vaddr);
+    uint32_t* dir = is_user_addr(vaddr) ? as->dir : page_directory;
+
+    if (dir[pdi] & PAGE_LARGE) {
+        if (!create || split_large_pde(pdi) != 0)
+            return 0;
+    }
 
-    uint32_t s = start & ~0xFFFu;
-    uint32_t e = (end + 0xFFFu) & ~0xFFFu;
+    /* Outside the identity map (kernel heap window, user space): page
+     * tables are allocated from physmem the first time something is
+     * mapped there.
+     */
+    if (!(dir[pdi] & PAGE_PRESENT)) {
+        if (!create)
+            return 0;
 
-    for (uint32_t addr = s; addr < e; addr += 0x1000) {
-        uint32_t* pte = get_pte(addr);
-        if (!pte) continue;
+        uint32_t* table = alloc_table();
+        if (!table)
+            return 0;
 
-        *pte |= PAGE_USER;
-        __asm__ volatile("invlpg (%0)" :: "r"(addr) : "memory");
+        if (is_user_addr(vaddr))
+            dir[pdi] = (uint32_t)table | (PAGE_PRESENT | PAGE_RW | PAGE_USER);
+        else
+            set_kernel_pde(pdi, (uint32_t)table | (PAGE_PRESENT | PAGE_RW));
     }
+
+    uint32_t* table = (uint32_t*)(dir[pdi] & ~0xFFFu);
+    return &table[pti];
 }
 
 void paging_init(void)
 {
-    console_write("Setting up identity-mapped paging (0–2048MB)...\n");
+    console_write("Setting up identity-mapped paging (0–2048MB, 4MB pages)...\n");
 
     for (uint32_t i = 0; i < 1024; i++)
         page_directory[i] = 0;
 
-    uint32_t addr = 0;
-    for (uint32_t t = 0; t < NUM_PAGE_TABLES; t++) {
-        for (uint32_t i = 0; i < 1024; i++) {
-            page_tables[t][i] =
-                (addr & ~0xFFFu) |
-                (PAGE_PRESENT | PAGE_RW);
-            addr += PAGE_SIZE;
-        }
-
+    /* supervisor-only: ring 3 code only sees its own user PDEs */
+    for (uint32_t t = 0; t < NUM_IDENTITY_PDES; t++) {
         page_directory[t] =
-            ((uint32_t)&page_tables[t]) |
-            (PAGE_PRESENT | PAGE_RW | PAGE_USER);
+            (t * LARGE_PAGE_SIZE) |
+            (PAGE_PRESENT | PAGE_RW | PAGE_LARGE);
     }
 
-    for (uint32_t t = NUM_PAGE_TABLES; t < 1024; t++)
-        page_directory[t] = 0;
+    kernel_space.next = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        cpu_space[cpu] = &kernel_space;
+    vm_stats = (paging_stats_t){0};
+    vm_stats.spaces = 1;
 
     console_write("Identity map complete.\n");
-
-    // First 2GB user-accessible
-    paging_set_user_for_range(0x00000000, 2048u * 1024u * 1024u);
 }
 
 void paging_enable(void)
@@ -79,31 +235,579 @@ void paging_enable(void)
 
     __asm__ volatile("mov %0, %%cr3" :: "r"(pd_addr));
 
+    /* 4MB pages must be on before the first translation */
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PSE;
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4));
+
+    /* WP: kernel writes to copy-on-write pages must fault too */
     uint32_t cr0;
     __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
-    cr0 |= 0x80000000;
+    cr0 |= 0x80000000 | CR0_WP;
     __asm__ volatile("mov %0, %%cr0" :: "r"(cr0));
 
     console_write("Paging enabled.\n\n");
 }
 
-void paging_map(uint32_t vaddr, uint32_t paddr, uint32_t flags)
+int paging_map(uint32_t vaddr, uint32_t paddr, uint32_t flags)
 {
-    uint32_t* pte = get_pte(vaddr);
+    uint32_t* pte = get_pte(current_space, vaddr, 1);
     if (!pte) {
-        console_write("paging_map: vaddr out of initial range.\n");
-        return;
+        console_write("paging_map: no page table for vaddr.\n");
+        return -1;
     }
 
+    uint32_t old = *pte;
     *pte = (paddr & ~0xFFFu) | (flags & 0xFFFu);
-    __asm__ volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
+
+    /* a not-present PTE cannot be in the TLB */
+    if (old & PAGE_PRESENT) {
+        invlpg(vaddr);
+        tlb_shoot(vaddr, 1);
+    } else {
+        vm_stats.tlb_skipped++;
+    }
+    return 0;
 }
 
 void paging_unmap(uint32_t vaddr)
 {
-    uint32_t* pte = get_pte(vaddr);
-    if (!pte) return;
+    /* unmapping inside a 4MB page splits it first */
+    uint32_t* pte = get_pte(current_space, vaddr,
+                            (page_directory[pde_index(vaddr)] & PAGE_LARGE) != 0);
+    if (!pte || !(*pte & PAGE_PRESENT)) return;
 
     *pte = 0;
-    __asm__ volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
+    invlpg(vaddr);
+    tlb_shoot(vaddr, 1);
+}
+
+void* paging_map_mmio(uint32_t paddr, uint32_t size)
+{
+    uint32_t off    = paddr & 0xFFFu;
+    uint32_t npages = (off + size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    if (npages > (KMMIO_BASE + KMMIO_SIZE - mmio_next) / PAGE_SIZE)
+        return 0;
+
+    uint32_t va = mmio_next;
+    if (paging_map_range(va, paddr & ~0xFFFu, npages,
+                         PAGE_PRESENT | PAGE_RW | PAGE_PCD | PAGE_PWT) != 0)
+        return 0;
+
+    mmio_next += npages * PAGE_SIZE;
+    return (void*)(va + off);
+}
+
+/* ---------------- range operations ---------------- */
+
+/* whole 4MB large page inside [vaddr, end)? */
+static inline int covers_large(uint32_t va, uint32_t end)
+{
+    return (va & (LARGE_PAGE_SIZE - 1)) == 0 && end - va >= LARGE_PAGE_SIZE;
+}
+
+int paging_map_range(uint32_t vaddr, uint32_t paddr, uint32_t npages, uint32_t flags)
+{
+    tlb_batch_t b = {0, 0, 0};
+    int rc = 0;
+
+    uint32_t irq = irq_save();
+    for (uint32_t i = 0; i < npages; i++) {
+        uint32_t va = (vaddr & ~0xFFFu) + i * PAGE_SIZE;
+        uint32_t* pte = get_pte(current_space, va, 1);
+        if (!pte) {
+            rc = -1;
+            break;
+        }
+
+        if (*pte & PAGE_PRESENT)
+            tlb_note(&b, va);
+        else
+            vm_stats.tlb_skipped++;
+
+        *pte = ((paddr & ~0xFFFu) + i * PAGE_SIZE) | (flags & 0xFFFu);
+    }
+    tlb_finish(&b);
+    irq_restore(irq);
+
+    return rc;
+}
+
+/* Second pass of a releasing unmap, after every TLB has been flushed:
+ * the entries left holding a frame (and no PAGE_PRESENT) give it back.
+ */
+static void put_unmapped(uint32_t va, uint32_t end)
+{
+    while (va < end) {
+        uint32_t* dir = is_user_addr(va) ? current_space->dir : page_directory;
+        uint32_t pde = dir[pde_index(va)];
+
+        if (!(pde & PAGE_PRESENT) || (pde & PAGE_LARGE)) {
+            va = (va & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        uint32_t* pte = &((uint32_t*)(pde & ~0xFFFu))[pte_index(va)];
+        if (*pte) {
+            phys_frame_put(*pte & ~0xFFFu);
+            *pte = 0;
+        }
+        va += PAGE_SIZE;
+    }
+}
+
+/*
+ * Frames are released only once the unmapped pages are out of every
+ * CPU's TLB, so another CPU cannot reuse one through a stale entry.
+ */
+void paging_unmap_range(uint32_t vaddr, uint32_t npages, int release)
+{
+    tlb_batch_t b = {0, 0, 0};
+    uint32_t va  = vaddr & ~0xFFFu;
+    uint32_t end = va + npages * PAGE_SIZE;
+
+    uint32_t irq = irq_save();
+    while (va < end) {
+        uint32_t pdi = pde_index(va);
+        uint32_t* dir = is_user_addr(va) ? current_space->dir : page_directory;
+
+        if (!(dir[pdi] & PAGE_PRESENT)) {
+            va = (va & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        if ((dir[pdi] & PAGE_LARGE) && covers_large(va, end)) {
+            set_kernel_pde(pdi, 0);
+            tlb_note(&b, va);
+            tlb_note(&b, va + LARGE_PAGE_SIZE - PAGE_SIZE);
+            va += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        uint32_t* pte = get_pte(current_space, va, (dir[pdi] & PAGE_LARGE) != 0);
+        if (pte && (*pte & PAGE_PRESENT)) {
+            if (is_user_addr(va))
+                current_space->user_pages--;
+            *pte = release ? (*pte & ~0xFFFu) : 0;
+            tlb_note(&b, va);
+        }
+        va += PAGE_SIZE;
+    }
+    tlb_finish(&b);
+    if (release)
+        put_unmapped(vaddr & ~0xFFFu, end);
+    irq_restore(irq);
+}
+
+int paging_protect_range(uint32_t vaddr, uint32_t npages, uint32_t flags)
+{
+    const uint32_t mask = PAGE_RW | PAGE_USER;
+    tlb_batch_t b = {0, 0, 0};
+    uint32_t va  = vaddr & ~0xFFFu;
+    uint32_t end = va + npages * PAGE_SIZE;
+    int rc = 0;
+
+    uint32_t irq = irq_save();
+    while (va < end) {
+        uint32_t pdi = pde_index(va);
+        int user = is_user_addr(va);
+        uint32_t* dir = user ? current_space->dir : page_directory;
+        uint32_t pde = dir[pdi];
+
+        if (!(pde & PAGE_PRESENT)) {
+            va = (va & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        /* whole 4MB page: one PDE instead of 1024 PTEs */
+        if ((pde & PAGE_LARGE) && covers_large(va, end)) {
+            uint32_t npde = (pde & ~mask) | (flags & mask);
+            if (npde != pde) {
+                set_kernel_pde(pdi, npde);
+                tlb_note(&b, va);
+                tlb_note(&b, va + LARGE_PAGE_SIZE - PAGE_SIZE);
+            }
+            va += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        uint32_t* pte = get_pte(current_space, va, (pde & PAGE_LARGE) != 0);
+        if (!pte) {
+            rc = -1;
+            break;
+        }
+
+        /* the PDE has to allow user access for the PTE bit to matter */
+        if ((flags & PAGE_USER) && !(dir[pdi] & PAGE_USER)) {
+            if (user)
+                dir[pdi] |= PAGE_USER;
+            else
+                set_kernel_pde(pdi, dir[pdi] | PAGE_USER);
+        }
+
+        if (*pte & PAGE_PRESENT) {
+            uint32_t npte = (*pte & ~mask) | (flags & mask);
+            /* copy-on-write pages only become writable through a fault */
+            if (npte & PAGE_COW)
+                npte &= ~PAGE_RW;
+            if (npte != *pte) {
+                *pte = npte;
+                tlb_note(&b, va);
+            }
+        }
+        va += PAGE_SIZE;
+    }
+    tlb_finish(&b);
+    irq_restore(irq);
+
+    return rc;
+}
+
+uint32_t paging_get_phys(uint32_t vaddr)
+{
+    uint32_t pde = page_directory[pde_index(vaddr)];
+    if ((pde & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE))
+        return (pde & 0xFFC00000u) | (vaddr & (LARGE_PAGE_SIZE - 1));
+
+    uint32_t* pte = get_pte(current_space, vaddr, 0);
+    if (!pte || !(*pte & PAGE_PRESENT))
+        return 0;
+
+    return (*pte & ~0xFFFu) | (vaddr & 0xFFFu);
+}
+
+/* ---------------- address spaces ---------------- */
+
+addr_space_t* paging_kernel_space(void)
+{
+    return &kernel_space;
+}
+
+addr_space_t* paging_current_space(void)
+{
+    return current_space;
+}
+
+addr_space_t* paging_create_space(void)
+{
+    addr_space_t* as = kmalloc(sizeof(addr_space_t));
+    if (!as)
+        return 0;
+
+    as->dir = alloc_table();
+    if (!as->dir) {
+        kfree(as);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < 1024; i++) {
+        if (i < USER_PDE_FIRST || i > USER_PDE_LAST)
+            as->dir[i] = page_directory[i];
+    }
+
+    as->user_pages = 0;
+    as->regions = 0;
+    as->next = kernel_space.next;
+    kernel_space.next = as;
+
+    vm_stats.spaces++;
+    return as;
+}
+
+void paging_destroy_space(addr_space_t* as)
+{
+    if (!as || as == &kernel_space || as == current_space) {
+        console_write("paging_destroy_space: space is in use.\n");
+        return;
+    }
+
+    for (uint32_t pdi = USER_PDE_FIRST; pdi <= USER_PDE_LAST; pdi++) {
+        if (!(as->dir[pdi] & PAGE_PRESENT))
+            continue;
+
+        uint32_t* table = (uint32_t*)(as->dir[pdi] & ~0xFFFu);
+        for (uint32_t i = 0; i < 1024; i++) {
+            if (table[i] & PAGE_PRESENT)
+                phys_frame_put(table[i] & ~0xFFFu);
+        }
+        phys_free_frame((uint32_t)table);
+    }
+
+    while (as->regions) {
+        vm_region_t* r = as->regions;
+        as->regions = r->next;
+        kfree(r);
+    }
+
+    addr_space_t** link = &kernel_space.next;
+    while (*link && *link != as)
+        link = &(*link)->next;
+    if (*link)
+        *link = as->next;
+
+    phys_free_frame((uint32_t)as->dir);
+    kfree(as);
+    vm_stats.spaces--;
+}
+
+/*
+ * Share every user page of src with a new space. Writable pages become
+ * read-only + PAGE_COW in both; the first write in either space takes a
+ * fault and gets a private copy (or the page back, if nobody else still
+ * holds it). Only page tables are copied here, never data.
+ */
+addr_space_t* paging_clone_space(addr_space_t* src)
+{
+    addr_space_t* as = paging_create_space();
+    if (!as)
+        return 0;
+
+    for (vm_region_t* r = src->regions; r; r = r->next) {
+        if (paging_reserve_user(as, r->start, r->end, r->flags, r->src, r->src_len) != 0) {
+            paging_destroy_space(as);
+            return 0;
+        }
+    }
+
+    for (uint32_t pdi = USER_PDE_FIRST; pdi <= USER_PDE_LAST; pdi++) {
+        if (!(src->dir[pdi] & PAGE_PRESENT))
+            continue;
+
+        uint32_t* from = (uint32_t*)(src->dir[pdi] & ~0xFFFu);
+        uint32_t* to   = alloc_table();
+        if (!to) {
+            paging_destroy_space(as);
+            if (src == current_space)
+                flush_tlb();
+            return 0;
+        }
+        as->dir[pdi] = (uint32_t)to | (src->dir[pdi] & 0xFFFu);
+
+        for (uint32_t i = 0; i < 1024; i++) {
+            uint32_t pte = from[i];
+            if (!(pte & PAGE_PRESENT))
+                continue;
+
+            if (pte & PAGE_RW) {
+                pte = (pte & ~PAGE_RW) | PAGE_COW;
+                from[i] = pte;
+            }
+            to[i] = pte;
+            phys_frame_get(pte & ~0xFFFu);
+            as->user_pages++;
+            vm_stats.cow_shared++;
+        }
+    }
+
+    /* src lost write access to its pages */
+    if (src == current_space)
+        flush_tlb();
+
+    return as;
+}
+
+void paging_switch_space(addr_space_t* as)
+{
+    if (!as || as == current_space)
+        return;
+
+    current_space = as;
+    __asm__ volatile("mov %0, %%cr3" :: "r"((uint32_t)as->dir) : "memory");
+}
+
+int paging_map_user(addr_space_t* as, uint32_t vaddr, uint32_t paddr, uint32_t flags)
+{
+    if (!is_user_addr(vaddr))
+        return -1;
+
+    uint32_t* pte = get_pte(as, vaddr, 1);
+    if (!pte)
+        return -1;
+
+    if (!(*pte & PAGE_PRESENT))
+        as->user_pages++;
+
+    *pte = (paddr & ~0xFFFu) | (flags & 0xFFFu) | PAGE_USER;
+    if (as == current_space)
+        invlpg(vaddr);
+    return 0;
+}
+
+int paging_reserve_user(addr_space_t* as, uint32_t start, uint32_t end,
+                        uint32_t flags, uint32_t src, uint32_t src_len)
+{
+    start &= ~0xFFFu;
+    end    = (end + 0xFFFu) & ~0xFFFu;
+
+    if (!as || start >= end || start < USER_BASE || end > USER_END)
+        return -1;
+
+    for (vm_region_t* r = as->regions; r; r = r->next) {
+        if (start < r->end && r->start < end)
+            return -1;
+    }
+
+    vm_region_t* r = kmalloc(sizeof(vm_region_t));
+    if (!r)
+        return -1;
+
+    r->start   = start;
+    r->end     = end;
+    r->flags   = (flags & PAGE_RW) | PAGE_PRESENT | PAGE_USER;
+    r->src     = src;
+    r->src_len = src ? src_len : 0;
+
+    r->next = as->regions;
+    as->regions = r;
+    return 0;
+}
+
+static void copy_page(uint32_t dst, uint32_t src)
+{
+    const uint32_t* s = (const uint32_t*)src;
+    uint32_t* d = (uint32_t*)dst;
+    for (uint32_t i = 0; i < PAGE_SIZE / 4; i++)
+        d[i] = s[i];
+}
+
+/* write to a present, read-only page that is shared copy-on-write */
+static int cow_fault(uint32_t* pte, uint32_t page)
+{
+    uint32_t frame = *pte & ~0xFFFu;
+    uint32_t flags = (*pte & 0xFFFu & ~PAGE_COW) | PAGE_RW;
+
+    vm_stats.cow_faults++;
+
+    /* last one holding the frame: just take it back */
+    if (phys_frame_refs(frame) == 1) {
+        *pte = frame | flags;
+        invlpg(page);
+        vm_stats.faults_minor++;
+        return 0;
+    }
+
+    uint32_t copy = phys_alloc_frame();
+    if (!copy)
+        return -1;
+
+    /* read through the (still read-only) user mapping, write through
+     * the identity map
+     */
+    copy_page(copy, page);
+
+    *pte = copy | flags;
+    invlpg(page);
+    phys_frame_put(frame);
+
+    vm_stats.cow_copies++;
+    vm_stats.faults_major++;
+    return 0;
+}
+
+/* first touch of a page inside a reserved region */
+static int demand_fault(uint32_t page)
+{
+    vm_region_t* r = current_space->regions;
+    while (r && !(page >= r->start && page < r->end))
+        r = r->next;
+    if (!r)
+        return -1;
+
+    uint32_t frame = phys_alloc_frame();
+    if (!frame)
+        return -1;
+
+    uint32_t off = page - r->start;
+    uint32_t* d = (uint32_t*)frame;
+
+    if (off + PAGE_SIZE <= r->src_len) {
+        copy_page(frame, r->src + off);
+        vm_stats.faults_major++;
+    } else {
+        /* zero-fill, keeping whatever part of the source reaches this page */
+        uint32_t keep = off < r->src_len ? r->src_len - off : 0;
+        const uint8_t* s = (const uint8_t*)(r->src + off);
+        uint8_t* b = (uint8_t*)frame;
+
+        for (uint32_t i = 0; i < PAGE_SIZE / 4; i++)
+            d[i] = 0;
+        for (uint32_t i = 0; i < keep; i++)
+            b[i] = s[i];
+
+        if (keep)
+            vm_stats.faults_major++;
+        else {
+            vm_stats.faults_minor++;
+            vm_stats.demand_zero++;
+        }
+    }
+
+    if (paging_map_user(current_space, page, frame, r->flags) != 0) {
+        phys_free_frame(frame);
+        return -1;
+    }
+    return 0;
+}
+
+int paging_handle_fault(uint32_t vaddr, uint32_t err)
+{
+    uint32_t page = vaddr & ~0xFFFu;
+
+    if (is_user_addr(vaddr)) {
+        uint32_t* pte = get_pte(current_space, vaddr, 0);
+
+        if (!(err & PF_PRESENT)) {
+            if ((!pte || !(*pte & PAGE_PRESENT)) && demand_fault(page) == 0)
+                return 0;
+        } else if ((err & PF_WRITE) && pte && (*pte & PAGE_COW)) {
+            if (cow_fault(pte, page) == 0)
+                return 0;
+        }
+    }
+
+    vm_stats.faults_bad++;
+    return -1;
+}
+
+int paging_copy_user_string(char* dst, uint32_t src, uint32_t max)
+{
+    const uint8_t* frame = 0;
+    uint32_t i;
+
+    if (max == 0)
+        return -1;
+
+    for (i = 0; i + 1 < max; i++) {
+        uint32_t va = src + i;
+        if (va < src || !is_user_addr(va))
+            return -1;
+
+        if (!frame || (va & 0xFFFu) == 0) {
+            uint32_t* pte = get_pte(current_space, va, 0);
+            if (!pte || !(*pte & PAGE_PRESENT)) {
+                if (demand_fault(va & ~0xFFFu) != 0)
+                    return -1;
+                pte = get_pte(current_space, va, 0);
+            }
+            if (!pte || (*pte & (PAGE_PRESENT | PAGE_USER)) != (PAGE_PRESENT | PAGE_USER))
+                return -1;
+            /* frames are identity mapped */
+            frame = (const uint8_t*)(*pte & ~0xFFFu);
+        }
+
+        dst[i] = (char)frame[va & 0xFFFu];
+        if (!dst[i])
+            return (int)i;
+    }
+
+    dst[i] = 0;
+    return (int)i;
+}
+
+void paging_get_stats(paging_stats_t* out)
+{
+    if (out)
+        *out = vm_stats;
 }
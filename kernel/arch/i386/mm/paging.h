@@ -4,10 +4,121 @@
 #define PAGE_PRESENT  0x001
 #define PAGE_RW       0x002
 #define PAGE_USER     0x004
+#define PAGE_PWT      0x008
+#define PAGE_PCD      0x010
+
+/* Private per-task user region; everything else is shared kernel space */
+#define USER_BASE     0x80000000u
+#define USER_END      0xC0000000u
+
+/* Device registers (LAPIC, I/O APIC, firmware tables above the identity
+ * map) are mapped uncached into this window by paging_map_mmio()
+ */
+#define KMMIO_BASE    0xE0000000u
+#define KMMIO_SIZE    0x00400000u
+
+/* A reserved piece of user space that is populated on first touch.
+ * Pages are zero-filled, or copied from src (physical) for the first
+ * src_len bytes of the region.
+ */
+typedef struct vm_region {
+    uint32_t start, end;        /* page aligned, end exclusive            */
+    uint32_t flags;             /* PTE flags for faulted-in pages         */
+    uint32_t src;
+    uint32_t src_len;
+    struct vm_region* next;
+} vm_region_t;
+
+typedef struct addr_space {
+    uint32_t* dir;              /* page directory (identity-mapped frame) */
+    struct addr_space* next;    /* all spaces, for kernel PDE updates     */
+    uint32_t user_pages;        /* user PTEs mapped in this space         */
+    vm_region_t* regions;
+} addr_space_t;
+
+typedef struct paging_stats {
+    uint32_t spaces;            /* live address spaces, kernel included   */
+    uint32_t cow_shared;        /* pages shared by paging_clone_space()   */
+    uint32_t cow_faults;        /* write faults on copy-on-write pages    */
+    uint32_t cow_copies;        /* ... that had to copy the frame         */
+    uint32_t faults_minor;      /* resolved without reading page data     */
+    uint32_t faults_major;      /* had to fill the page from a source     */
+    uint32_t faults_bad;        /* no region, protection violation, OOM   */
+    uint32_t demand_zero;       /* zero-filled pages handed out           */
+    uint32_t range_ops;         /* paging_*_range() calls                 */
+    uint32_t tlb_invlpg;        /* single-page invalidations              */
+    uint32_t tlb_full_flushes;  /* CR3 reloads                            */
+    uint32_t tlb_skipped;       /* PTEs set without a flush (not present) */
+    uint32_t tlb_shootdowns;    /* kernel changes flushed on other CPUs   */
+} paging_stats_t;
 
 void paging_init(void);
 void paging_enable(void);
 
-/* Map/unmap a single 4KB page (within the initially mapped 0–64MB range) */
-void paging_map(uint32_t vaddr, uint32_t paddr, uint32_t flags);
+/* Map/unmap a single 4KB page in the current address space. Addresses
+ * above the 2GB identity map get their page tables allocated from physmem
+ * on first use; kernel tables are shared by every address space.
+ * paging_map() returns -1 (nothing mapped) when that allocation fails.
+ */
+int  paging_map(uint32_t vaddr, uint32_t paddr, uint32_t flags);
 void paging_unmap(uint32_t vaddr);
+
+/* Map size bytes of device memory at paddr; NULL when the window is full.
+ * Mappings are permanent.
+ */
+void* paging_map_mmio(uint32_t paddr, uint32_t size);
+
+/* Physical address backing vaddr, or 0 if it is not mapped */
+uint32_t paging_get_phys(uint32_t vaddr);
+
+/* Range versions in the current space. TLB invalidations are collected
+ * and issued once at the end: invlpg over the touched span if it is
+ * small, otherwise a single CR3 reload.
+ *
+ * map_range maps npages physically contiguous pages from paddr.
+ * unmap_range with release != 0 drops a frame reference for every page
+ * (heap and user frames; not identity-mapped memory).
+ * protect_range sets PAGE_RW/PAGE_USER on present pages to match flags.
+ */
+int  paging_map_range(uint32_t vaddr, uint32_t paddr, uint32_t npages, uint32_t flags);
+void paging_unmap_range(uint32_t vaddr, uint32_t npages, int release);
+int  paging_protect_range(uint32_t vaddr, uint32_t npages, uint32_t flags);
+
+addr_space_t* paging_kernel_space(void);
+addr_space_t* paging_current_space(void);
+
+/* New space with the kernel mapped and an empty user region */
+addr_space_t* paging_create_space(void);
+/* Copy-on-write clone of src's user region */
+addr_space_t* paging_clone_space(addr_space_t* src);
+/* Drop a space that is not current; user frames lose one reference */
+void paging_destroy_space(addr_space_t* as);
+void paging_switch_space(addr_space_t* as);
+
+/* Map a user page (PAGE_USER is implied) into any space */
+int paging_map_user(addr_space_t* as, uint32_t vaddr, uint32_t paddr, uint32_t flags);
+
+/* Reserve [start, end) of as's user region for demand paging; src/src_len
+ * give the initial contents (0 = zero-filled)
+ */
+int paging_reserve_user(addr_space_t* as, uint32_t start, uint32_t end,
+                        uint32_t flags, uint32_t src, uint32_t src_len);
+
+/* #PF: copy-on-write and demand paging in the current space; 0 if handled */
+int paging_handle_fault(uint32_t vaddr, uint32_t err);
+
+/* Copy a NUL-terminated string from user address src in the current space
+ * into dst (at most max - 1 chars, always terminated). Pages are looked up
+ * (and demand-faulted) here rather than touched, so a bad pointer cannot
+ * fault in the kernel. Returns the length copied, max - 1 meaning no NUL
+ * was seen yet, or -1 if the string leaves user space or hits a page that
+ * is neither mapped nor reserved.
+ */
+int paging_copy_user_string(char* dst, uint32_t src, uint32_t max);
+
+/* Drop this CPU's TLB entries for npages pages at vaddr, or all of them
+ * when npages is 0 or large; the other CPUs do this for a shootdown
+ */
+void paging_flush_local(uint32_t vaddr, uint32_t npages);
+
+void paging_get_stats(paging_stats_t* out);
@@ -3,21 +3,130 @@
 #include "console.h"
 
 #define PAGE_SIZE       4096
-#define MAX_MEM_BYTES   (2048u * 1024u * 1024u)   // 2GB as *unsigned*
+#define MAX_MEM_BYTES   (2048u * 1024u * 1024u)   // identity-mapped ceiling (2GB)
 #define MAX_FRAMES      (MAX_MEM_BYTES / PAGE_SIZE)
 
-// bitmap: 1 bit per frame
-static uint32_t frame_bitmap[MAX_FRAMES / 32];
+#define FULL_WORD       0xFFFFFFFFu
+
+/* Frame counts are rounded up to a whole bitmap-of-summaries (32*32*32
+ * frames = 128MB) so every level is an integral number of words.
+ */
+#define FRAMES_GRANULE  (32u * 32u * 32u)
+
+/*
+ * All allocator metadata is sized to the RAM GRUB reports and placed
+ * right after the kernel image, so a 64MB VM pays for 128MB worth of
+ * bitmap instead of 2GB.
+ *
+ * frame_bitmap: 1 bit per frame, set = used (or not RAM at all)
+ *
+ * Summary levels on top of the bitmap, each bit set = "something free below":
+ *   l1_free bit w  -> frame_bitmap[w] has at least one clear bit
+ *   l2_free bit i  -> l1_free[i] != 0
+ *   l3_free bit j  -> l2_free[j] != 0
+ * Finding a free frame is four __builtin_ctz() calls no matter how full
+ * memory is; set/clear touch the upper levels only when a word flips
+ * between full and not-full.
+ *
+ * The e*_empty levels do the same for words that are completely free
+ * (32 frames, 128KB). Multi-page blocks of order >= 5 are found there.
+ */
+static uint32_t* frame_bitmap;
+static uint32_t* l1_free;
+static uint32_t* l2_free;
+static uint32_t  l3_free;
+
+static uint32_t* e1_empty;
+static uint32_t* e2_empty;
+static uint32_t  e3_empty;
+
+/* Share counts for frames mapped into more than one address space
+ * (copy-on-write). phys_alloc_frame() starts a frame at 1.
+ */
+static uint16_t* frame_refs;
+
+static uint32_t max_frames   = 0;   /* frames covered by the bitmap */
+static uint32_t usable_frames = 0;  /* frames the firmware calls RAM */
+static uint32_t free_frames  = 0;
+
+static uint32_t order_allocs[PHYS_MAX_ORDER + 1];
+static uint32_t order_frees[PHYS_MAX_ORDER + 1];
+static uint32_t order_failures[PHYS_MAX_ORDER + 1];
 
 extern uint32_t kernel_start;
 extern uint32_t kernel_end;
 
+/* positions where an aligned group of 2^order bits may start */
+static const uint32_t group_align[6] = {
+    0xFFFFFFFFu, 0x55555555u, 0x11111111u, 0x01010101u, 0x00010001u, 0x00000001u
+};
+
+
+static inline void summary_mark_free(uint32_t w)
+{
+    l1_free[w / 32]   |= 1u << (w % 32);
+    l2_free[w / 1024] |= 1u << ((w / 32) % 32);
+    l3_free           |= 1u << (w / 1024);
+}
+
+static inline void summary_mark_full(uint32_t w)
+{
+    l1_free[w / 32] &= ~(1u << (w % 32));
+    if (l1_free[w / 32])
+        return;
+
+    l2_free[w / 1024] &= ~(1u << ((w / 32) % 32));
+    if (l2_free[w / 1024])
+        return;
+
+    l3_free &= ~(1u << (w / 1024));
+}
+
+static inline void summary_mark_empty(uint32_t w)
+{
+    e1_empty[w / 32]   |= 1u << (w % 32);
+    e2_empty[w / 1024] |= 1u << ((w / 32) % 32);
+    e3_empty           |= 1u << (w / 1024);
+}
+
+static inline void summary_mark_used(uint32_t w)
+{
+    e1_empty[w / 32] &= ~(1u << (w % 32));
+    if (e1_empty[w / 32])
+        return;
+
+    e2_empty[w / 1024] &= ~(1u << ((w / 32) % 32));
+    if (e2_empty[w / 1024])
+        return;
+
+    e3_empty &= ~(1u << (w / 1024));
+}
+
+/* store a new bitmap word and keep both summary hierarchies in sync */
+static inline void word_update(uint32_t w, uint32_t val)
+{
+    uint32_t old = frame_bitmap[w];
+    frame_bitmap[w] = val;
+
+    if (old == FULL_WORD && val != FULL_WORD)
+        summary_mark_free(w);
+    else if (old != FULL_WORD && val == FULL_WORD)
+        summary_mark_full(w);
+
+    if (old == 0 && val != 0)
+        summary_mark_used(w);
+    else if (old != 0 && val == 0)
+        summary_mark_empty(w);
+}
+
 static inline void set_frame(uint32_t frame) {
-    frame_bitmap[frame / 32] |=  (1u << (frame % 32));
+    uint32_t w = frame / 32;
+    word_update(w, frame_bitmap[w] | (1u << (frame % 32)));
 }
 
 static inline void clear_frame(uint32_t frame) {
-    frame_bitmap[frame / 32] &= ~(1u << (frame % 32));
+    uint32_t w = frame / 32;
+    word_update(w, frame_bitmap[w] & ~(1u << (frame % 32)));
 }
 
 static inline int test_frame(uint32_t frame) {
@@ -26,37 +135,279 @@ static inline int test_frame(uint32_t frame) {
 
 static uint32_t first_free_frame(void)
 {
-    for (uint32_t i = 0; i < MAX_FRAMES / 32; i++) {
-        if (frame_bitmap[i] != 0xFFFFFFFFu) {
-            // there is at least one free bit
-            for (uint32_t j = 0; j < 32; j++) {
-                uint32_t frame = i * 32 + j;
-                if (frame < MAX_FRAMES && !test_frame(frame)) {
-                    return frame;
-                }
+    if (!l3_free)
+        return (uint32_t)-1;
+
+    uint32_t j = __builtin_ctz(l3_free);
+    uint32_t i = j * 32 + __builtin_ctz(l2_free[j]);
+    uint32_t w = i * 32 + __builtin_ctz(l1_free[i]);
+
+    return w * 32 + __builtin_ctz(~frame_bitmap[w]);
+}
+
+/* bit p of the result is set if bits p..p+2^order-1 of `free` are all set
+ * and p is a multiple of 2^order (order <= 5)
+ */
+static inline uint32_t aligned_groups(uint32_t free, uint32_t order)
+{
+    for (uint32_t s = 1; s < (1u << order); s <<= 1)
+        free &= free >> s;
+    return free & group_align[order];
+}
+
+/* orders 1..4: an aligned group inside one bitmap word, lowest address first */
+static uint32_t find_small_block(uint32_t order)
+{
+    for (uint32_t b3 = l3_free; b3; b3 &= b3 - 1) {
+        uint32_t j = __builtin_ctz(b3);
+        for (uint32_t b2 = l2_free[j]; b2; b2 &= b2 - 1) {
+            uint32_t i = j * 32 + __builtin_ctz(b2);
+            for (uint32_t b1 = l1_free[i]; b1; b1 &= b1 - 1) {
+                uint32_t w = i * 32 + __builtin_ctz(b1);
+                uint32_t m = aligned_groups(~frame_bitmap[w], order);
+                if (m)
+                    return w * 32 + __builtin_ctz(m);
             }
         }
     }
     return (uint32_t)-1;
 }
 
-void phys_init(void)
+/* orders 5..10: an aligned run of 2^(order-5) empty bitmap words */
+static uint32_t find_large_block(uint32_t order)
+{
+    for (uint32_t b3 = e3_empty; b3; b3 &= b3 - 1) {
+        uint32_t j = __builtin_ctz(b3);
+        for (uint32_t b2 = e2_empty[j]; b2; b2 &= b2 - 1) {
+            uint32_t i = j * 32 + __builtin_ctz(b2);
+            uint32_t m = aligned_groups(e1_empty[i], order - 5);
+            if (m)
+                return (i * 32 + __builtin_ctz(m)) * 32;
+        }
+    }
+    return (uint32_t)-1;
+}
+
+/* no libgcc in the kernel, so __builtin_popcount would not link */
+static inline uint32_t popcount32(uint32_t v)
+{
+    v = v - ((v >> 1) & 0x55555555u);
+    v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+    v = (v + (v >> 4)) & 0x0F0F0F0Fu;
+    return (v * 0x01010101u) >> 24;
+}
+
+/* mark [frame, frame + 2^order) used (set != 0) or free; returns how many
+ * frames actually changed state
+ */
+static uint32_t mark_block(uint32_t frame, uint32_t order, int set)
+{
+    uint32_t changed = 0;
+
+    if (order < 5) {
+        uint32_t w    = frame / 32;
+        uint32_t mask = ((1u << (1u << order)) - 1) << (frame % 32);
+        uint32_t old  = frame_bitmap[w];
+
+        changed = popcount32(set ? (~old & mask) : (old & mask));
+        word_update(w, set ? (old | mask) : (old & ~mask));
+        return changed;
+    }
+
+    uint32_t first = frame / 32;
+    uint32_t words = 1u << (order - 5);
+    for (uint32_t w = first; w < first + words; w++) {
+        uint32_t old = frame_bitmap[w];
+        changed += set ? 32 - popcount32(old) : popcount32(old);
+        word_update(w, set ? FULL_WORD : 0);
+    }
+    return changed;
+}
+
+static void kprint_u32(uint32_t v)
+{
+    char buf[16];
+    int i = 0;
+
+    if (v == 0) {
+        console_write("0");
+        return;
+    }
+
+    while (v > 0 && i < (int)sizeof(buf)) {
+        buf[i++] = '0' + (v % 10);
+        v /= 10;
+    }
+    while (i > 0)
+        console_putc(buf[--i]);
+}
+
+/* set (used) or clear (free) every frame in [first, end) */
+static void mark_range(uint32_t first, uint32_t end, int used)
+{
+    if (end > max_frames)
+        end = max_frames;
+
+    while (first < end) {
+        uint32_t w   = first / 32;
+        uint32_t bit = first % 32;
+        uint32_t n   = 32 - bit;
+        if (n > end - first)
+            n = end - first;
+
+        uint32_t mask = (n == 32) ? FULL_WORD : (((1u << n) - 1) << bit);
+        word_update(w, used ? (frame_bitmap[w] | mask) : (frame_bitmap[w] & ~mask));
+        first += n;
+    }
+}
+
+/* call fn(first_frame, end_frame) for every RAM region, clipped to 2GB */
+static void for_each_ram_region(const multiboot_info_t* mbi,
+                                void (*fn)(uint32_t first, uint32_t end))
+{
+    if (mbi && (mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+        uint32_t p   = mbi->mmap_addr;
+        uint32_t end = mbi->mmap_addr + mbi->mmap_length;
+
+        while (p < end) {
+            const multiboot_mmap_entry_t* e = (const multiboot_mmap_entry_t*)p;
+            p += e->size + 4;
+
+            if (e->type != MULTIBOOT_MEMORY_AVAILABLE || e->addr >= MAX_MEM_BYTES)
+                continue;
+
+            uint64_t top = e->addr + e->len;
+            if (top > MAX_MEM_BYTES)
+                top = MAX_MEM_BYTES;
+
+            /* only whole frames inside the region count */
+            uint32_t first = (uint32_t)((e->addr + PAGE_SIZE - 1) / PAGE_SIZE);
+            uint32_t last  = (uint32_t)(top / PAGE_SIZE);
+            if (last > first)
+                fn(first, last);
+        }
+        return;
+    }
+
+    if (mbi && (mbi->flags & MULTIBOOT_INFO_MEMORY)) {
+        uint64_t top = 0x100000ull + (uint64_t)mbi->mem_upper * 1024;
+        if (top > MAX_MEM_BYTES)
+            top = MAX_MEM_BYTES;
+
+        fn(0, (mbi->mem_lower * 1024) / PAGE_SIZE);
+        fn(0x100000 / PAGE_SIZE, (uint32_t)(top / PAGE_SIZE));
+        return;
+    }
+
+    /* no memory information at all: fall back to the old 2GB assumption */
+    fn(0, MAX_FRAMES);
+}
+
+/* RAM regions copied out of the boot info before the metadata is laid
+ * down, in case GRUB left the map right after the kernel image.
+ */
+#define MAX_RAM_REGIONS 32
+
+static struct { uint32_t first, end; } ram_regions[MAX_RAM_REGIONS];
+static uint32_t ram_region_count;
+
+static void note_ram_region(uint32_t first, uint32_t end)
+{
+    if (ram_region_count == MAX_RAM_REGIONS)
+        return;
+    ram_regions[ram_region_count].first = first;
+    ram_regions[ram_region_count].end   = end;
+    ram_region_count++;
+}
+
+void phys_init(const multiboot_info_t* mbi)
 {
     console_write("Initializing physical memory allocator...\n");
 
-    for (uint32_t i = 0; i < MAX_FRAMES / 32; i++) {
-        frame_bitmap[i] = 0;
+    if (!mbi || !(mbi->flags & (MULTIBOOT_INFO_MEM_MAP | MULTIBOOT_INFO_MEMORY)))
+        console_write("physmem: no memory map from bootloader, assuming 2GB.\n");
+
+    uint32_t ram_top_frame = 0;
+    ram_region_count = 0;
+    for_each_ram_region(mbi, note_ram_region);
+    for (uint32_t i = 0; i < ram_region_count; i++) {
+        if (ram_regions[i].end > ram_top_frame)
+            ram_top_frame = ram_regions[i].end;
     }
 
+    max_frames = (ram_top_frame + FRAMES_GRANULE - 1) / FRAMES_GRANULE * FRAMES_GRANULE;
+    if (max_frames > MAX_FRAMES)
+        max_frames = MAX_FRAMES;
+
+    uint32_t bitmap_words = max_frames / 32;
+    uint32_t l1_words     = bitmap_words / 32;
+    uint32_t l2_words     = l1_words / 32;
+
+    /* metadata goes right after the kernel image */
     uint32_t kernel_end_addr = (uint32_t)&kernel_end;
-    uint32_t first_free_addr = (kernel_end_addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t meta = (kernel_end_addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    frame_bitmap = (uint32_t*)meta;  meta += bitmap_words * 4;
+    l1_free      = (uint32_t*)meta;  meta += l1_words * 4;
+    e1_empty     = (uint32_t*)meta;  meta += l1_words * 4;
+    l2_free      = (uint32_t*)meta;  meta += l2_words * 4;
+    e2_empty     = (uint32_t*)meta;  meta += l2_words * 4;
+    frame_refs   = (uint16_t*)meta;  meta += max_frames * 2;
+
+    uint32_t first_free_addr = (meta + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    /* start with everything used; RAM regions are then released */
+    for (uint32_t i = 0; i < bitmap_words; i++) {
+        frame_bitmap[i] = FULL_WORD;
+    }
+    for (uint32_t i = 0; i < l1_words; i++) {
+        l1_free[i]  = 0;
+        e1_empty[i] = 0;
+    }
+    for (uint32_t i = 0; i < l2_words; i++) {
+        l2_free[i]  = 0;
+        e2_empty[i] = 0;
+    }
+    l3_free  = 0;
+    e3_empty = 0;
+
+    for (uint32_t i = 0; i < max_frames; i++) {
+        frame_refs[i] = 0;
+    }
+
+    for (uint32_t o = 0; o <= PHYS_MAX_ORDER; o++) {
+        order_allocs[o] = order_frees[o] = order_failures[o] = 0;
+    }
+
+    usable_frames = 0;
+    for (uint32_t i = 0; i < ram_region_count; i++) {
+        uint32_t first = ram_regions[i].first;
+        uint32_t end   = ram_regions[i].end;
+        if (end > max_frames)
+            end = max_frames;
+        if (first >= end)
+            continue;
+
+        mark_range(first, end, 0);
+        usable_frames += end - first;
+    }
 
-    uint32_t first_free_frame_idx = first_free_addr / PAGE_SIZE;
+    /* low 1MB (BIOS, VGA), the kernel image and this metadata stay used */
+    mark_range(0, first_free_addr / PAGE_SIZE, 1);
 
-    for (uint32_t i = 0; i < first_free_frame_idx; i++) {
-        set_frame(i);
+    free_frames = 0;
+    for (uint32_t i = 0; i < bitmap_words; i++) {
+        free_frames += 32 - popcount32(frame_bitmap[i]);
     }
 
+    console_write("physmem: ");
+    kprint_u32(usable_frames / 256);
+    console_write(" MB usable RAM, ");
+    kprint_u32((meta - ((kernel_end_addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))) / 1024);
+    console_write(" KB metadata, ");
+    kprint_u32(free_frames);
+    console_write(" frames free.\n");
+
     console_write("Physical memory allocator ready.\n");
 }
 
@@ -69,6 +420,9 @@ uint32_t phys_alloc_frame(void)
     }
 
     set_frame(frame);
+    frame_refs[frame] = 1;
+    free_frames--;
+    order_allocs[0]++;
     return frame * PAGE_SIZE;
 }
 
@@ -76,7 +430,139 @@ void phys_free_frame(uint32_t addr)
 {
     if (addr == 0) return;
     uint32_t frame = addr / PAGE_SIZE;
-    if (frame < MAX_FRAMES) {
+    if (frame < max_frames && test_frame(frame)) {
         clear_frame(frame);
+        frame_refs[frame] = 0;
+        free_frames++;
+        order_frees[0]++;
+    }
+}
+
+void phys_frame_get(uint32_t addr)
+{
+    uint32_t frame = addr / PAGE_SIZE;
+    if (frame < max_frames && frame_refs[frame] < 0xFFFF)
+        frame_refs[frame]++;
+}
+
+uint32_t phys_frame_put(uint32_t addr)
+{
+    uint32_t frame = addr / PAGE_SIZE;
+    if (frame >= max_frames || frame_refs[frame] == 0)
+        return 0;
+
+    if (--frame_refs[frame] == 0) {
+        phys_free_frame(addr);
+        return 0;
+    }
+    return frame_refs[frame];
+}
+
+uint32_t phys_frame_refs(uint32_t addr)
+{
+    uint32_t frame = addr / PAGE_SIZE;
+    return frame < max_frames ? frame_refs[frame] : 0;
+}
+
+uint32_t phys_alloc_pages(uint32_t order)
+{
+    if (order == 0)
+        return phys_alloc_frame();
+    if (order > PHYS_MAX_ORDER)
+        return 0;
+
+    uint32_t frame = (order < 5) ? find_small_block(order)
+                                 : find_large_block(order);
+    if (frame == (uint32_t)-1) {
+        order_failures[order]++;
+        return 0;
+    }
+
+    free_frames -= mark_block(frame, order, 1);
+    order_allocs[order]++;
+    return frame * PAGE_SIZE;
+}
+
+void phys_free_pages(uint32_t addr, uint32_t order)
+{
+    if (order == 0) {
+        phys_free_frame(addr);
+        return;
+    }
+    if (addr == 0 || order > PHYS_MAX_ORDER)
+        return;
+
+    uint32_t frame = addr / PAGE_SIZE;
+    if (frame & ((1u << order) - 1)) {
+        console_write("phys_free_pages: misaligned block!\n");
+        return;
+    }
+    if (frame + (1u << order) > max_frames)
+        return;
+
+    /* clearing the bits is all the coalescing needed: the buddy's state
+     * lives in the same bitmap, so the merged block is visible at once
+     */
+    free_frames += mark_block(frame, order, 0);
+    order_frees[order]++;
+}
+
+/* is the aligned block [frame, frame + 2^order) completely free? */
+static int block_is_free(uint32_t frame, uint32_t order)
+{
+    if (order < 5) {
+        uint32_t mask = ((1u << (1u << order)) - 1) << (frame % 32);
+        return (frame_bitmap[frame / 32] & mask) == 0;
     }
+
+    uint32_t first = frame / 32;
+    for (uint32_t w = first; w < first + (1u << (order - 5)); w++) {
+        if (frame_bitmap[w])
+            return 0;
+    }
+    return 1;
+}
+
+/* split free memory into maximal aligned free blocks, buddy style */
+static void count_free_blocks(uint32_t frame, uint32_t order, uint32_t* counts)
+{
+    if (block_is_free(frame, order)) {
+        counts[order]++;
+        return;
+    }
+    if (order == 0)
+        return;
+    if (!l1_free[frame / 1024])
+        return;
+
+    uint32_t half = 1u << (order - 1);
+    count_free_blocks(frame, order - 1, counts);
+    count_free_blocks(frame + half, order - 1, counts);
+}
+
+void phys_get_frag_stats(phys_frag_stats_t* out)
+{
+    if (!out) return;
+
+    for (uint32_t o = 0; o <= PHYS_MAX_ORDER; o++) {
+        out->free_blocks[o] = 0;
+        out->allocs[o]      = order_allocs[o];
+        out->frees[o]       = order_frees[o];
+        out->failures[o]    = order_failures[o];
+    }
+
+    for (uint32_t f = 0; f < max_frames; f += 1u << PHYS_MAX_ORDER) {
+        if (l1_free[f / 1024])
+            count_free_blocks(f, PHYS_MAX_ORDER, out->free_blocks);
+    }
+}
+
+uint32_t phys_total_frames(void)
+{
+    return usable_frames;
+}
+
+uint32_t phys_free_frames(void)
+{
+    return free_frames;
 }
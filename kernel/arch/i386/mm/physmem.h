@@ -1,6 +1,39 @@
 #pragma once
 #include <stdint.h>
+#include "arch/i386/start/multiboot.h"
 
-void phys_init(void);
+/* Largest contiguous block: 2^10 frames = 4MB */
+#define PHYS_MAX_ORDER 10
+
+/* Size the allocator from the bootloader memory map (NULL = assume 2GB).
+ * Only RAM regions become allocatable; BIOS/ACPI holes stay reserved.
+ */
+void phys_init(const multiboot_info_t* mbi);
 uint32_t phys_alloc_frame(void);
 void phys_free_frame(uint32_t addr);
+
+/* Share counts for single frames (copy-on-write user pages).
+ * phys_alloc_frame() returns a frame with one reference; phys_frame_put()
+ * frees it when the last reference goes away.
+ */
+void     phys_frame_get(uint32_t addr);
+uint32_t phys_frame_put(uint32_t addr);   /* references left */
+uint32_t phys_frame_refs(uint32_t addr);
+
+/* Physically contiguous, naturally aligned blocks of 2^order frames.
+ * Returns the physical address, or 0 if no such block is free.
+ */
+uint32_t phys_alloc_pages(uint32_t order);
+void phys_free_pages(uint32_t addr, uint32_t order);
+
+typedef struct phys_frag_stats {
+    uint32_t free_blocks[PHYS_MAX_ORDER + 1]; /* maximal free aligned blocks */
+    uint32_t allocs[PHYS_MAX_ORDER + 1];
+    uint32_t frees[PHYS_MAX_ORDER + 1];
+    uint32_t failures[PHYS_MAX_ORDER + 1];
+} phys_frag_stats_t;
+
+void phys_get_frag_stats(phys_frag_stats_t* out);
+
+uint32_t phys_total_frames(void);   /* usable RAM frames */
+uint32_t phys_free_frames(void);
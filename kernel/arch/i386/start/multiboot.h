@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+
+/* Multiboot (v1) boot information, as handed over by GRUB in %ebx */
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+#define MULTIBOOT_INFO_MEMORY      (1u << 0)   /* mem_lower/mem_upper valid */
+#define MULTIBOOT_INFO_MEM_MAP     (1u << 6)   /* mmap_* valid              */
+
+#define MULTIBOOT_MEMORY_AVAILABLE        1
+#define MULTIBOOT_MEMORY_RESERVED         2
+#define MULTIBOOT_MEMORY_ACPI_RECLAIMABLE 3
+#define MULTIBOOT_MEMORY_NVS              4
+#define MULTIBOOT_MEMORY_BADRAM           5
+
+typedef struct multiboot_info {
+    uint32_t flags;
+    uint32_t mem_lower;      /* KB below 1MB            */
+    uint32_t mem_upper;      /* KB above 1MB            */
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;    /* bytes                   */
+    uint32_t mmap_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+/* `size` does not include itself: next entry is at (entry + size + 4) */
+typedef struct multiboot_mmap_entry {
+    uint32_t size;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
@@ -17,20 +17,34 @@ void crypto_set_key(const char* key)
     }
 }
 
-static void crypto_apply(const uint8_t* in, uint8_t* out, size_t len)
+static void crypto_apply(const uint8_t* in, uint8_t* out, size_t len, uint32_t pos)
 {
+    size_t k = pos % g_key_len;
+
     for (size_t i = 0; i < len; i++) {
-        out[i] = in[i] ^ g_key[i % g_key_len];
+        out[i] = in[i] ^ g_key[k];
+        if (++k == g_key_len)
+            k = 0;
     }
 }
 
 void crypto_encrypt(const uint8_t* in, uint8_t* out, size_t len)
 {
-    crypto_apply(in, out, len);
+    crypto_apply(in, out, len, 0);
 }
 
 void crypto_decrypt(const uint8_t* in, uint8_t* out, size_t len)
 {
-    crypto_apply(in, out, len);
+    crypto_apply(in, out, len, 0);
+}
+
+void crypto_encrypt_at(const uint8_t* in, uint8_t* out, size_t len, uint32_t pos)
+{
+    crypto_apply(in, out, len, pos);
+}
+
+void crypto_decrypt_at(const uint8_t* in, uint8_t* out, size_t len, uint32_t pos)
+{
+    crypto_apply(in, out, len, pos);
 }
-    
\ No newline at end of file
+    
\ No newline at end of file
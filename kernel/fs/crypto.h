@@ -6,3 +6,8 @@ void crypto_set_key(const char* key);
 
 void crypto_encrypt(const uint8_t* in, uint8_t* out, size_t len);
 void crypto_decrypt(const uint8_t* in, uint8_t* out, size_t len);
+
+/* Same, for a piece of a stream that starts at byte pos: the result
+ * matches the corresponding bytes of a whole-buffer encrypt/decrypt. */
+void crypto_encrypt_at(const uint8_t* in, uint8_t* out, size_t len, uint32_t pos);
+void crypto_decrypt_at(const uint8_t* in, uint8_t* out, size_t len, uint32_t pos);
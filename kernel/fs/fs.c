@@ -1,20 +1,56 @@
 #include "fs/fs.h"
+#include "fs/fs_disk.h"
+#include "fs/blockdev.h"
+#include "fs/ramdisk.h"
 #include "fs/crypto.h"
 #include "arch/i386/mm/kmalloc.h"
 #include "console.h"
+#include "sched/lock.h"
+#include "sched/task.h"
 #include <stddef.h>
 
-#define MAX_NAME_LEN  32
+#define MAX_NAME_LEN  FS_NAME_MAX
 #define MAX_PATH_LEN  128
 
+/* used when the root block device cannot be mounted */
+#define FS_RAMDISK_SIZE  (4u * 1024 * 1024)
+
+/*
+ * The tree below fs_root is a cache of the on-disk directories (fs_disk.h),
+ * filled in lazily: a directory's entries are read the first time it is
+ * searched or listed, and file contents are read from disk on every
+ * fs_read(). Nodes stay cached until they are deleted.
+ *
+ * Snapshots are detached copies held entirely in RAM: ino == 0, with the
+ * file bytes (as stored, i.e. encrypted) in data/size.
+ *
+ * Each loaded directory also indexes its children by name hash (chained
+ * buckets, doubled when the average chain passes DIR_HASH_LOAD), so a
+ * lookup costs the same in a directory of ten entries or ten thousand.
+ * The child/sibling list is kept for listing. Snapshot copies have no
+ * index; they are only ever walked.
+ */
+#define DIR_HASH_MIN   8
+#define DIR_HASH_LOAD  2
+
 struct fs_node {
     char name[MAX_NAME_LEN];
+    uint32_t hash;          /* fs_name_hash(name) */
     int is_dir;
-    char* data;
-    uint32_t size;
+    uint32_t ino;           /* 0 for snapshot copies */
+    int loaded;             /* directory entries read from disk */
+    char* data;             /* snapshot copies only */
+    uint32_t size;          /* snapshot copies only */
     struct fs_node* parent;
     struct fs_node* child;
     struct fs_node* sibling;
+    struct fs_node* hnext;  /* next in the parent's bucket */
+    struct fs_node** buckets;   /* directories: children by hash */
+    uint32_t nbuckets;      /* power of two, 0 until the first child */
+    uint32_t nchildren;
+    uint32_t opens;         /* descriptors referring to this file */
+    uint32_t slot;          /* its dirent's index in the parent */
+    uint32_t free_slot;     /* directories: every dirent below is in use */
 };
 
 typedef struct fs_node fs_node_t;
@@ -32,6 +68,65 @@ typedef struct snap {
 
 static snap_t* snap_head = NULL;
 
+/* an open file; node == NULL marks a free descriptor */
+typedef struct fs_file {
+    fs_node_t* node;
+    uint32_t   pos;
+    int        flags;
+} fs_file_t;
+
+/* per task, in task_t.fd_table, allocated on its first fs_open() */
+typedef struct fs_fdtable {
+    fs_file_t files[FS_MAX_FDS];
+} fs_fdtable_t;
+
+static uint32_t open_files = 0;
+
+static uint32_t nodes_cached = 0;     /* on-disk nodes in the tree */
+static uint32_t dirs_loaded  = 0;
+
+/* block buffers for directory and file I/O (under fs_lock) */
+static uint8_t dir_buf[FS_BLOCK_SIZE];
+static uint8_t file_buf[FS_BLOCK_SIZE];
+
+/*
+ * Path lookup cache: remembers what fs_resolve() returned for a path,
+ * keyed by the directory it started from (root or cwd), the path string
+ * and the mode, so a repeated lookup of a deep path costs one hash probe
+ * instead of a walk. Direct mapped; a colliding path just replaces the
+ * entry.
+ *
+ * A result depends on some names existing, and (when nothing or only the
+ * parent was found) on a name not existing. Rather than track which
+ * entries mention a node, two generation counters invalidate in bulk:
+ * removing or moving a node bumps dc_gen, which drops everything, and
+ * creating one bumps dc_neg_gen, which drops the entries that relied on
+ * a name being absent. Lookups vastly outnumber removals.
+ */
+#define DCACHE_SIZE  64     /* power of two */
+
+typedef struct dcache_entry {
+    uint32_t   hash;
+    uint32_t   gen;         /* 0 = empty */
+    uint32_t   neg_gen;     /* 0 = does not depend on absence */
+    fs_node_t* base;
+    fs_node_t* result;      /* NULL: negative entry */
+    uint8_t    want_parent;
+    char       path[MAX_PATH_LEN];
+    char       last[MAX_NAME_LEN];
+} dcache_entry_t;
+
+static dcache_entry_t dcache[DCACHE_SIZE];
+static uint32_t dc_gen     = 1;
+static uint32_t dc_neg_gen = 1;
+static uint32_t dc_hits, dc_neg_hits, dc_misses;
+
+/* Serializes every operation on the tree, cwd and snapshots. A sleeping
+ * mutex, since operations allocate and copy whole files. Not recursive:
+ * the listing callbacks must not call back into the fs.
+ */
+static mutex_t fs_lock = MUTEX_INIT("fs");
+
 
 static int kstrcmp(const char* a, const char* b) {
     while (*a && (*a == *b)) { a++; b++; }
@@ -57,6 +152,17 @@ static void kstrncpy(char* dst, const char* src, size_t n) {
     else dst[n-1] = 0;
 }
 
+/* FNV-1a */
+static uint32_t fs_name_hash(const char* name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
 
 static fs_node_t* fs_new_node(const char* name, int is_dir)
 {
@@ -64,15 +170,518 @@ static fs_node_t* fs_new_node(const char* name, int is_dir)
     if (!n) return NULL;
 
     kstrncpy(n->name, name, MAX_NAME_LEN);
+    n->hash   = fs_name_hash(n->name);
     n->is_dir = is_dir;
+    n->ino    = 0;
+    n->loaded = 0;
     n->data   = NULL;
     n->size   = 0;
     n->parent = NULL;
     n->child  = NULL;
     n->sibling= NULL;
+    n->hnext  = NULL;
+    n->buckets  = NULL;
+    n->nbuckets = 0;
+    n->nchildren = 0;
+    n->opens  = 0;
+    n->slot   = 0;
+    n->free_slot = 0;
+    return n;
+}
+
+static void fs_node_free(fs_node_t* n)
+{
+    if (n->ino)
+        nodes_cached--;
+    kfree(n->buckets);
+    kfree(n->data);
+    kfree(n);
+}
+
+/* release a subtree (node, its children and all following siblings);
+ * RAM only, the disk is not touched */
+static void fs_free_tree(fs_node_t* n)
+{
+    while (n) {
+        fs_node_t* next = n->sibling;
+        if (n->child)
+            fs_free_tree(n->child);
+        fs_node_free(n);
+        n = next;
+    }
+}
+
+/* ---------------- directory hash index ---------------- */
+
+/* rebuild dir's index from its child list with nb buckets; 0 on success,
+ * otherwise the old table (if any) is left as it was */
+static int dir_index_resize(fs_node_t* dir, uint32_t nb)
+{
+    fs_node_t** nbk = (fs_node_t**)kmalloc(nb * sizeof(fs_node_t*));
+    if (!nbk) return -1;
+    for (uint32_t i = 0; i < nb; i++)
+        nbk[i] = NULL;
+
+    for (fs_node_t* c = dir->child; c; c = c->sibling) {
+        c->hnext = nbk[c->hash & (nb - 1)];
+        nbk[c->hash & (nb - 1)] = c;
+    }
+
+    kfree(dir->buckets);
+    dir->buckets = nbk;
+    dir->nbuckets = nb;
+    return 0;
+}
+
+/* n is already on dir's child list */
+static void dir_index_add(fs_node_t* dir, fs_node_t* n)
+{
+    dir->nchildren++;
+
+    /* growing rehashes the whole list, n included; if it fails, a full
+     * table just gets longer chains, and with no table at all lookups
+     * fall back to the list */
+    if (dir->nchildren > dir->nbuckets * DIR_HASH_LOAD &&
+        dir_index_resize(dir, dir->nbuckets ? dir->nbuckets * 2 : DIR_HASH_MIN) == 0)
+        return;
+    if (!dir->nbuckets) return;
+
+    fs_node_t** b = &dir->buckets[n->hash & (dir->nbuckets - 1)];
+    n->hnext = *b;
+    *b = n;
+}
+
+static void dir_index_remove(fs_node_t* dir, fs_node_t* n)
+{
+    dir->nchildren--;
+    if (!dir->nbuckets) return;
+
+    fs_node_t** pp = &dir->buckets[n->hash & (dir->nbuckets - 1)];
+    while (*pp) {
+        if (*pp == n) {
+            *pp = n->hnext;
+            break;
+        }
+        pp = &(*pp)->hnext;
+    }
+    n->hnext = NULL;
+}
+
+static void fs_attach(fs_node_t* dir, fs_node_t* n)
+{
+    n->parent = dir;
+    n->sibling = dir->child;
+    dir->child = n;
+    dir_index_add(dir, n);
+}
+
+/* detach node from its parent's child list (does not free memory) */
+static void fs_detach_from_parent(fs_node_t* node)
+{
+    if (!node || !node->parent) return;
+    dc_gen++;
+    fs_node_t* parent = node->parent;
+    fs_node_t** curp = &parent->child;
+    while (*curp) {
+        if (*curp == node) {
+            *curp = node->sibling;
+            node->sibling = NULL;
+            node->parent = NULL;
+            dir_index_remove(parent, node);
+            return;
+        }
+        curp = &(*curp)->sibling;
+    }
+}
+
+/* ---------------- on-disk directories and files ---------------- */
+
+/* read dir's entries into the tree the first time it is needed */
+static int dir_load(fs_node_t* dir)
+{
+    if (dir->loaded || !dir->ino)
+        return 0;
+
+    fs_dinode_t di;
+    if (fsd_inode_read(dir->ino, &di) != 0)
+        return -1;
+
+    fs_dirent_t* ents = (fs_dirent_t*)dir_buf;
+    uint32_t slots = di.size / FS_DIRENT_SIZE;
+    fs_node_t* first = dir->child;   /* new nodes go in front of this */
+    uint32_t free_slot = slots;
+
+    for (uint32_t i = 0; i < slots; i++) {
+        uint32_t k = i % FS_DIRENTS_PER_BLOCK;
+        if (k == 0) {
+            uint32_t b = fsd_bmap(&di, i / FS_DIRENTS_PER_BLOCK, FSD_BMAP_LOOKUP);
+            if (!b || fsd_read_block(b, dir_buf) != 0)
+                goto fail;
+        }
+        if (!ents[k].ino) {
+            if (free_slot == slots)
+                free_slot = i;
+            continue;
+        }
+
+        ents[k].name[MAX_NAME_LEN - 1] = 0;
+        fs_node_t* n = fs_new_node(ents[k].name, ents[k].type == FS_T_DIR);
+        if (!n)
+            goto fail;
+        n->ino  = ents[k].ino;
+        n->slot = i;
+        nodes_cached++;
+        fs_attach(dir, n);
+    }
+
+    dir->loaded = 1;
+    dir->free_slot = free_slot;
+    dirs_loaded++;
+    return 0;
+
+fail:
+    /* drop what was attached so far; the next lookup starts over */
+    while (dir->child != first) {
+        fs_node_t* n = dir->child;
+        fs_detach_from_parent(n);
+        fs_node_free(n);
+    }
+    return -1;
+}
+
+/* write a dirent for ino into a free slot of dir, returned in *slot */
+static int dir_add(fs_node_t* dir, const char* name, uint32_t ino, int type,
+                   uint32_t* slot)
+{
+    fs_dinode_t di;
+    if (fsd_inode_read(dir->ino, &di) != 0)
+        return -1;
+
+    fs_dirent_t* ents = (fs_dirent_t*)dir_buf;
+    uint32_t slots = di.size / FS_DIRENT_SIZE;
+    uint32_t b = 0;
+    uint32_t i = dir->free_slot < slots ? dir->free_slot : slots;
+    int grow;
+
+    /* starting inside a block (the hint, or the tail to append to) */
+    if (i % FS_DIRENTS_PER_BLOCK) {
+        b = fsd_bmap(&di, i / FS_DIRENTS_PER_BLOCK, FSD_BMAP_LOOKUP);
+        if (!b || fsd_read_block(b, dir_buf) != 0)
+            return -1;
+    }
+
+    /* reuse a free slot, or append one */
+    for (; i < slots; i++) {
+        if (i % FS_DIRENTS_PER_BLOCK == 0) {
+            b = fsd_bmap(&di, i / FS_DIRENTS_PER_BLOCK, FSD_BMAP_LOOKUP);
+            if (!b || fsd_read_block(b, dir_buf) != 0)
+                return -1;
+        }
+        if (!ents[i % FS_DIRENTS_PER_BLOCK].ino)
+            break;
+    }
+
+    grow = i == slots;
+    if (grow) {
+        if (i % FS_DIRENTS_PER_BLOCK == 0) {
+            b = fsd_bmap(&di, i / FS_DIRENTS_PER_BLOCK, FSD_BMAP_ZERO);
+            if (!b)
+                return -1;
+            for (uint32_t k = 0; k < FS_BLOCK_SIZE; k++)
+                dir_buf[k] = 0;
+        }
+        di.size += FS_DIRENT_SIZE;
+    }
+
+    fs_dirent_t* e = &ents[i % FS_DIRENTS_PER_BLOCK];
+    uint8_t* raw = (uint8_t*)e;
+    for (uint32_t k = 0; k < FS_DIRENT_SIZE; k++)
+        raw[k] = 0;
+    e->ino  = ino;
+    e->type = (uint8_t)type;
+    kstrncpy(e->name, name, MAX_NAME_LEN);
+    e->name_len = (uint8_t)kstrlen(e->name);
+    *slot = i;
+
+    if (fsd_write_block(b, dir_buf) != 0)
+        return -1;
+    dir->free_slot = i + 1;
+    return grow ? fsd_inode_write(dir->ino, &di) : 0;
+}
+
+/* free dirent slot of dir, which must still hold ino */
+static int dir_remove(fs_node_t* dir, uint32_t slot, uint32_t ino)
+{
+    fs_dinode_t di;
+    if (fsd_inode_read(dir->ino, &di) != 0)
+        return -1;
+
+    fs_dirent_t* ents = (fs_dirent_t*)dir_buf;
+    fs_dirent_t* e = &ents[slot % FS_DIRENTS_PER_BLOCK];
+    uint32_t slots = di.size / FS_DIRENT_SIZE;
+    if (slot >= slots)
+        return -1;
+
+    uint32_t b = fsd_bmap(&di, slot / FS_DIRENTS_PER_BLOCK, FSD_BMAP_LOOKUP);
+    if (!b || fsd_read_block(b, dir_buf) != 0 || e->ino != ino)
+        return -1;
+
+    e->ino = 0;
+    if (fsd_write_block(b, dir_buf) != 0)
+        return -1;
+    if (slot < dir->free_slot)
+        dir->free_slot = slot;
+
+    /* the last slot: shrink the directory, dropping an emptied block */
+    if (slot == slots - 1) {
+        di.size -= FS_DIRENT_SIZE;
+        fsd_truncate(&di, (di.size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+        return fsd_inode_write(dir->ino, &di);
+    }
+    return 0;
+}
+
+/* file contents as stored (encrypted), NUL-terminated; caller frees */
+static char* file_read_raw(fs_node_t* n, uint32_t* len)
+{
+    if (!n->ino) {
+        char* copy = (char*)kmalloc(n->size + 1);
+        if (!copy) return NULL;
+        for (uint32_t i = 0; i < n->size; i++)
+            copy[i] = n->data ? n->data[i] : 0;
+        copy[n->size] = 0;
+        *len = n->size;
+        return copy;
+    }
+
+    fs_dinode_t di;
+    if (fsd_inode_read(n->ino, &di) != 0)
+        return NULL;
+
+    char* buf = (char*)kmalloc(di.size + 1);
+    if (!buf) return NULL;
+
+    for (uint32_t off = 0; off < di.size; off += FS_BLOCK_SIZE) {
+        uint32_t chunk = di.size - off < FS_BLOCK_SIZE ? di.size - off : FS_BLOCK_SIZE;
+        uint32_t b = fsd_bmap(&di, off / FS_BLOCK_SIZE, FSD_BMAP_LOOKUP);
+
+        if (b && fsd_read_block(b, file_buf) != 0) {
+            kfree(buf);
+            return NULL;
+        }
+        for (uint32_t i = 0; i < chunk; i++)
+            buf[off + i] = b ? (char)file_buf[i] : 0;
+    }
+
+    buf[di.size] = 0;
+    *len = di.size;
+    return buf;
+}
+
+/* replace the contents of file n with len bytes (already encrypted) */
+static int file_write_raw(fs_node_t* n, const char* data, uint32_t len)
+{
+    fs_dinode_t di;
+    if (fsd_inode_read(n->ino, &di) != 0)
+        return -1;
+
+    uint32_t nblk = (len + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (nblk > FS_MAX_FILE_BLOCKS)
+        return -1;
+
+    int err = 0;
+    for (uint32_t i = 0; i < nblk && !err; i++) {
+        uint32_t off = i * FS_BLOCK_SIZE;
+        uint32_t chunk = len - off < FS_BLOCK_SIZE ? len - off : FS_BLOCK_SIZE;
+        uint32_t b = fsd_bmap(&di, i, FSD_BMAP_ALLOC);
+
+        if (!b) {
+            err = 1;
+            break;
+        }
+        for (uint32_t k = 0; k < FS_BLOCK_SIZE; k++)
+            file_buf[k] = k < chunk ? (uint8_t)data[off + k] : 0;
+        err = fsd_write_block(b, file_buf) != 0;
+    }
+
+    if (!err) {
+        fsd_truncate(&di, nblk);
+        di.size = len;
+    }
+    /* written either way: blocks mapped so far must not leak */
+    if (fsd_inode_write(n->ino, &di) != 0)
+        err = 1;
+    return err ? -1 : 0;
+}
+
+/*
+ * Plaintext reads and writes at an offset, a block at a time through
+ * file_buf, so the cost follows the bytes touched rather than the file
+ * size. The cipher is positional (crypto_*_at), so a piece of the file
+ * can be encrypted or decrypted without the rest.
+ */
+
+/* up to len bytes from off; bytes read, 0 at or past the end, -1 error */
+static int file_pread(fs_node_t* n, void* buf, uint32_t len, uint32_t off)
+{
+    fs_dinode_t di;
+    if (fsd_inode_read(n->ino, &di) != 0)
+        return -1;
+
+    if (off >= di.size)
+        return 0;
+    if (len > di.size - off)
+        len = di.size - off;
+
+    uint8_t* out = (uint8_t*)buf;
+    for (uint32_t done = 0; done < len; ) {
+        uint32_t pos   = off + done;
+        uint32_t in    = pos % FS_BLOCK_SIZE;
+        uint32_t chunk = FS_BLOCK_SIZE - in;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        uint32_t b = fsd_bmap(&di, pos / FS_BLOCK_SIZE, FSD_BMAP_LOOKUP);
+        if (!b) {
+            /* never written (should not happen below size): reads as 0 */
+            for (uint32_t i = 0; i < chunk; i++)
+                out[done + i] = 0;
+        } else {
+            if (fsd_read_block(b, file_buf) != 0)
+                return -1;
+            crypto_decrypt_at(file_buf + in, out + done, chunk, pos);
+        }
+        done += chunk;
+    }
+    return (int)len;
+}
+
+/* len bytes at off, growing the file if needed (a gap past the old end
+ * is filled with zeros); 0 on success */
+static int file_pwrite(fs_node_t* n, const void* buf, uint32_t len, uint32_t off)
+{
+    fs_dinode_t di;
+    if (fsd_inode_read(n->ino, &di) != 0)
+        return -1;
+
+    uint32_t end = off + len;
+    if (end < off || (end + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE > FS_MAX_FILE_BLOCKS)
+        return -1;
+
+    const uint8_t* src = (const uint8_t*)buf;
+    uint32_t old_size = di.size;
+    uint32_t from = off < old_size ? off : old_size;
+    int err = 0;
+
+    for (uint32_t pos = from; pos < end && !err; ) {
+        uint32_t in    = pos % FS_BLOCK_SIZE;
+        uint32_t chunk = FS_BLOCK_SIZE - in;
+        if (chunk > end - pos)
+            chunk = end - pos;
+
+        /* keep the old bytes of a block we only partly overwrite */
+        uint32_t bstart = pos - in;
+        uint32_t b = fsd_bmap(&di, pos / FS_BLOCK_SIZE, FSD_BMAP_LOOKUP);
+        int keep = b && bstart < old_size && (in || chunk < FS_BLOCK_SIZE);
+
+        if (!b)
+            b = fsd_bmap(&di, pos / FS_BLOCK_SIZE, FSD_BMAP_ALLOC);
+        if (!b) {
+            err = 1;
+            break;
+        }
+
+        if (keep) {
+            if (fsd_read_block(b, file_buf) != 0) {
+                err = 1;
+                break;
+            }
+        } else {
+            for (uint32_t k = 0; k < FS_BLOCK_SIZE; k++)
+                file_buf[k] = 0;
+        }
+
+        /* [pos, off) is the gap past the old end: encrypted zeros */
+        uint32_t gap = pos < off ? off - pos : 0;
+        if (gap > chunk)
+            gap = chunk;
+        for (uint32_t k = 0; k < gap; k++)
+            file_buf[in + k] = 0;
+        crypto_encrypt_at(file_buf + in, file_buf + in, gap, pos);
+        if (chunk > gap)
+            crypto_encrypt_at(src + (pos + gap - off), file_buf + in + gap,
+                              chunk - gap, pos + gap);
+
+        err = fsd_write_block(b, file_buf) != 0;
+        if (!err && pos + chunk > di.size)
+            di.size = pos + chunk;
+        pos += chunk;
+    }
+
+    /* written either way: blocks mapped so far must not leak */
+    if (fsd_inode_write(n->ino, &di) != 0)
+        err = 1;
+    return err ? -1 : 0;
+}
+
+/* cut the file down to size bytes */
+static int file_truncate(fs_node_t* n, uint32_t size)
+{
+    fs_dinode_t di;
+    if (fsd_inode_read(n->ino, &di) != 0)
+        return -1;
+    if (size >= di.size)
+        return 0;
+
+    fsd_truncate(&di, (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+    di.size = size;
+    return fsd_inode_write(n->ino, &di);
+}
+
+/* new file or directory name in dir, on disk and in the tree; dir's
+ * entries must all be loaded, or name might already be on disk */
+static fs_node_t* node_create(fs_node_t* dir, const char* name, int is_dir)
+{
+    if (dir->ino && !dir->loaded)
+        return NULL;
+
+    int type = is_dir ? FS_T_DIR : FS_T_FILE;
+    uint32_t ino = fsd_inode_alloc(type, dir->ino);
+    if (!ino)
+        return NULL;
+
+    fs_node_t* n = fs_new_node(name, is_dir);
+    if (!n || dir_add(dir, n->name, ino, type, &n->slot) != 0) {
+        kfree(n);
+        fsd_inode_free(ino);
+        return NULL;
+    }
+
+    n->ino = ino;
+    n->loaded = 1;          /* nothing to read for a new directory */
+    nodes_cached++;
+    fs_attach(dir, n);
+    dc_neg_gen++;
     return n;
 }
 
+/* free n and everything below it on disk and in RAM; n must already be
+ * out of its parent (tree and directory entry) */
+static void node_delete(fs_node_t* n)
+{
+    if (n->is_dir) {
+        dir_load(n);
+        while (n->child) {
+            fs_node_t* c = n->child;
+            fs_detach_from_parent(c);
+            node_delete(c);
+        }
+    }
+
+    fsd_inode_free(n->ino);
+    fs_node_free(n);
+}
+
 static fs_node_t* fs_clone_tree(fs_node_t* n, fs_node_t* parent)
 {
     if (!n) return NULL;
@@ -81,17 +690,12 @@ static fs_node_t* fs_clone_tree(fs_node_t* n, fs_node_t* parent)
     if (!copy) return NULL;
 
     copy->parent = parent;
-    copy->size   = n->size;
 
-    if (!n->is_dir && n->data && n->size > 0) {
+    if (!n->is_dir) {
         /* copy file data */
-        char* buf = (char*)kmalloc(n->size + 1);
-        if (buf) {
-            for (uint32_t i = 0; i < n->size; i++)
-                buf[i] = n->data[i];
-            buf[n->size] = 0;
-            copy->data = buf;
-        }
+        copy->data = file_read_raw(n, &copy->size);
+    } else {
+        dir_load(n);
     }
 
     if (n->child) {
@@ -108,15 +712,31 @@ static fs_node_t* fs_clone_tree(fs_node_t* n, fs_node_t* parent)
 }
 
 
-static fs_node_t* fs_find_in_dir(fs_node_t* dir, const char* name)
+/* child of dir called name in *out, NULL if there is none; -1 (and no
+ * answer) if dir's entries could not be read */
+static int fs_find_in_dir(fs_node_t* dir, const char* name, fs_node_t** out)
 {
-    fs_node_t* cur = dir->child;
-    while (cur) {
-        if (!kstrcmp(cur->name, name))
-            return cur;
-        cur = cur->sibling;
+    *out = NULL;
+    if (dir_load(dir) != 0)
+        return -1;
+
+    fs_node_t* cur;
+    uint32_t h = fs_name_hash(name);
+
+    if (dir->nbuckets) {
+        cur = dir->buckets[h & (dir->nbuckets - 1)];
+        for (; cur; cur = cur->hnext)
+            if (cur->hash == h && !kstrcmp(cur->name, name))
+                break;
+    } else {
+        /* no index (empty directory, or it could not be allocated) */
+        for (cur = dir->child; cur; cur = cur->sibling)
+            if (cur->hash == h && !kstrcmp(cur->name, name))
+                break;
     }
-    return NULL;
+
+    *out = cur;
+    return 0;
 }
 
 /* split path into components, return next component and advance *p */
@@ -140,18 +760,20 @@ static int fs_next_component(const char** p, char* out, size_t out_sz)
     return 1;
 }
 
-static fs_node_t* fs_resolve(const char* path, int want_parent, char* last_name)
+/* *failed is set when a directory on the way could not be read */
+static fs_node_t* fs_walk(fs_node_t* cur, const char* path, int want_parent,
+                          char* last_name, int* failed)
 {
-    if (!path || !*path) return NULL;
-    fs_node_t* cur;
-    if (path[0] == '/') cur = fs_root;
-    else cur = fs_cwd;
     const char* p = path;
     char comp[MAX_NAME_LEN];
     fs_node_t* parent = NULL;
     while (fs_next_component(&p, comp, sizeof(comp))) {
         parent = cur;
-        fs_node_t* next = fs_find_in_dir(cur, comp);
+        fs_node_t* next;
+        if (fs_find_in_dir(cur, comp, &next) != 0) {
+            if (failed) *failed = 1;
+            return NULL;
+        }
         if (!next) {
             if (want_parent && *p == 0) {
                 if (last_name)
@@ -169,15 +791,115 @@ static fs_node_t* fs_resolve(const char* path, int want_parent, char* last_name)
     return cur;
 }
 
+static fs_node_t* fs_resolve(const char* path, int want_parent, char* last_name)
+{
+    if (!path || !*path) return NULL;
+    fs_node_t* base = path[0] == '/' ? fs_root : fs_cwd;
+    if (!base) return NULL;
+
+    size_t len = kstrlen(path);
+    if (len >= MAX_PATH_LEN)
+        return fs_walk(base, path, want_parent, last_name, NULL);
+
+    uint32_t h = fs_name_hash(path) ^ (uint32_t)(uintptr_t)base ^ (uint32_t)want_parent;
+    h ^= h >> 16;
+    dcache_entry_t* e = &dcache[h & (DCACHE_SIZE - 1)];
+
+    if (e->gen == dc_gen && (!e->neg_gen || e->neg_gen == dc_neg_gen) &&
+        e->hash == h && e->base == base && e->want_parent == want_parent &&
+        !kstrcmp(e->path, path)) {
+        if (e->result) dc_hits++;
+        else dc_neg_hits++;
+        if (want_parent && last_name)
+            kstrncpy(last_name, e->last, MAX_NAME_LEN);
+        return e->result;
+    }
+
+    dc_misses++;
+    char last[MAX_NAME_LEN] = "";
+    int failed = 0;
+    fs_node_t* r = fs_walk(base, path, want_parent, last, &failed);
+    if (failed)
+        return NULL;    /* not absent, just unreadable: worth retrying */
+
+    /* found outright, the only case that cannot be undone by a create */
+    int whole = r && (!want_parent || !last[0]);
+
+    e->hash        = h;
+    e->gen         = dc_gen;
+    e->neg_gen     = whole ? 0 : dc_neg_gen;
+    e->base        = base;
+    e->result      = r;
+    e->want_parent = (uint8_t)want_parent;
+    for (size_t i = 0; i <= len; i++)
+        e->path[i] = path[i];
+    if (want_parent)
+        kstrncpy(e->last, last, MAX_NAME_LEN);
+
+    if (want_parent && last_name)
+        kstrncpy(last_name, last, MAX_NAME_LEN);
+    return r;
+}
+
 void fs_init(void)
 {
+    block_device_t* dev = blockdev_get_root();
+
+    if (!dev || fsd_mount(dev) != 0) {
+        console_write("fs: cannot mount the root device, using a RAM disk\n");
+        dev = ramdisk_create(FS_RAMDISK_SIZE);
+        if (!dev || fsd_mount(dev) != 0) {
+            console_write("fs: no filesystem!\n");
+            return;
+        }
+        blockdev_set_root(dev);
+    }
+
+    dc_gen++;
     fs_root = fs_new_node("/", 1);
+    if (!fs_root) return;
+    fs_root->ino = FS_ROOT_INO;
     fs_root->parent = fs_root; 
     fs_cwd  = fs_root;
-    console_write("RAM filesystem with directories initialized.\n");
+    nodes_cached++;
+
+    fs_disk_stats_t st;
+    fsd_get_stats(&st);
+    console_write("fs: mounted ");
+    console_write(dev->name);
+    console_write(st.formatted ? " (new filesystem)\n" : "\n");
 }
 
-int fs_mkdir(const char* path)
+/* store a NUL-terminated string as the contents of node */
+static int file_store(fs_node_t* node, const char* data)
+{
+    if (node->is_dir) return -1;
+
+    uint32_t len = (uint32_t)kstrlen(data);
+    if (file_pwrite(node, data, len, 0) != 0) return -1;
+    return file_truncate(node, len);
+}
+
+/* the file at path, created (with its last component) if create is set
+ * and it does not exist yet */
+static fs_node_t* file_lookup(const char* path, int create)
+{
+    if (!path || !*path) return NULL;
+    if (kstrlen(path) >= MAX_PATH_LEN) return NULL;
+
+    fs_node_t* node = fs_resolve(path, 0, NULL);
+    if (node)
+        return node->is_dir ? NULL : node;
+    if (!create)
+        return NULL;
+
+    char last[MAX_NAME_LEN];
+    fs_node_t* parent = fs_resolve(path, 1, last);
+    if (!parent || !parent->is_dir || !last[0]) return NULL;
+    return node_create(parent, last, 0);
+}
+
+static int fs_mkdir_locked(const char* path)
 {
     if (!path || !*path) return -1;
     if (kstrlen(path) >= MAX_PATH_LEN) return -1;
@@ -187,17 +909,13 @@ int fs_mkdir(const char* path)
     if (!parent || !parent->is_dir) return -1;
     if (!last[0]) return -1;
 
-    if (fs_find_in_dir(parent, last))
+    fs_node_t* node;
+    if (fs_find_in_dir(parent, last, &node) != 0 || node)
         return -1; 
-    fs_node_t* n = fs_new_node(last, 1);
-    if (!n) return -1;
-    n->parent = parent;
-    n->sibling = parent->child;
-    parent->child = n;
-    return 0;
+    return node_create(parent, last, 1) ? 0 : -1;
 }
 
-int fs_touch(const char* path)
+static int fs_touch_locked(const char* path)
 {
     if (!path || !*path) return -1;
     if (kstrlen(path) >= MAX_PATH_LEN) return -1;
@@ -207,100 +925,97 @@ int fs_touch(const char* path)
     if (!parent || !parent->is_dir) return -1;
     if (!last[0]) return -1;
 
-    fs_node_t* node = fs_find_in_dir(parent, last);
+    fs_node_t* node;
+    if (fs_find_in_dir(parent, last, &node) != 0) return -1;
     if (node) {
         if (node->is_dir) return -1;
         return 0;
     }
 
-    node = fs_new_node(last, 0);
-    if (!node) return -1;
-    node->parent = parent;
-    node->sibling = parent->child;
-    parent->child = node;
-    return 0;
+    return node_create(parent, last, 0) ? 0 : -1;
 }
 
-int fs_write(const char* path, const char* data)
+static int fs_write_locked(const char* path, const char* data)
 {
-    if (!path || !data) return -1;
+    if (!data) return -1;
 
-    char last[MAX_NAME_LEN];
-    fs_node_t* parent = fs_resolve(path, 1, last);
-    if (!parent || !parent->is_dir) return -1;
-    if (!last[0]) return -1;
+    fs_node_t* node = file_lookup(path, 1);
+    if (!node) return -1;
 
-    fs_node_t* node = fs_find_in_dir(parent, last);
-    if (!node) {
-        if (fs_touch(path) != 0) return -1;
-        node = fs_find_in_dir(parent, last);
-        if (!node) return -1;
-    }
+    return file_store(node, data);
+}
 
-    if (node->is_dir) return -1;
+static int fs_pread_locked(const char* path, void* buf, uint32_t len, uint32_t off)
+{
+    if (!buf) return -1;
+
+    fs_node_t* node = file_lookup(path, 0);
+    if (!node) return -1;
 
-    size_t len = kstrlen(data);
-    char* buf = (char*)kmalloc(len + 1);
+    return file_pread(node, buf, len, off);
+}
+
+static int fs_pwrite_locked(const char* path, const void* buf, uint32_t len, uint32_t off)
+{
     if (!buf) return -1;
 
-    crypto_encrypt((const uint8_t*)data, (uint8_t*)buf, len);
-    buf[len] = 0;
+    fs_node_t* node = file_lookup(path, 1);
+    if (!node) return -1;
 
-    node->data = buf;
-    node->size = (uint32_t)len;
+    return file_pwrite(node, buf, len, off);
+}
 
-    return 0;
+static int fs_append_locked(const char* path, const void* buf, uint32_t len)
+{
+    if (!buf) return -1;
+
+    fs_node_t* node = file_lookup(path, 1);
+    if (!node) return -1;
+
+    fs_dinode_t di;
+    if (fsd_inode_read(node->ino, &di) != 0) return -1;
+    return file_pwrite(node, buf, len, di.size);
 }
 
-int fs_write_cwd(const char* name, const char* data)
+static int fs_write_cwd_locked(const char* name, const char* data)
 {
     if (!name || !name[0] || !data)
         return -1;
     if (!fs_cwd || !fs_cwd->is_dir)
         return -1;
-    fs_node_t* node = fs_find_in_dir(fs_cwd, name);
+    fs_node_t* node;
+    if (fs_find_in_dir(fs_cwd, name, &node) != 0)
+        return -1;
     if (!node) {
-        node = fs_new_node(name, 0);
+        node = node_create(fs_cwd, name, 0);
         if (!node) return -1;
-        node->parent  = fs_cwd;
-        node->sibling = fs_cwd->child;
-        fs_cwd->child = node;
     }
 
-    if (node->is_dir)
-        return -1;
-    size_t len = kstrlen(data);
-
-    char* buf = (char*)kmalloc(len + 1);
-    if (!buf) return -1;
-
-    crypto_encrypt((const uint8_t*)data, (uint8_t*)buf, len);
-    buf[len] = 0;
-
-    node->data = buf;
-    node->size = (uint32_t)len;
-
-    return 0;
+    return file_store(node, data);
 }
 
 
-const char* fs_read(const char* path)
+static const char* fs_read_locked(const char* path)
 {
     fs_node_t* node = fs_resolve(path, 0, NULL);
-    if (!node || node->is_dir || !node->data || node->size == 0)
+    if (!node || node->is_dir)
         return NULL;
 
-    char* buf = (char*)kmalloc(node->size + 1);
+    uint32_t len;
+    char* buf = file_read_raw(node, &len);
     if (!buf) return NULL;
+    if (len == 0) {
+        kfree(buf);
+        return NULL;
+    }
 
-    crypto_decrypt((const uint8_t*)node->data, (uint8_t*)buf, node->size);
-    buf[node->size] = 0;
+    crypto_decrypt((const uint8_t*)buf, (uint8_t*)buf, len);
 
-    return buf;   /* caller (cat) just prints it; we leak a little, which is fine for now */
+    return buf;   /* caller owns the plaintext copy and must kfree() it */
 }
 
 
-int fs_chdir(const char* path)
+static int fs_chdir_locked(const char* path)
 {
     if (!path || !*path) return -1;
 
@@ -311,7 +1026,7 @@ int fs_chdir(const char* path)
     return 0;
 }
 
-const char* fs_getcwd(void)
+static const char* fs_getcwd_locked(void)
 {
     static char buf[MAX_PATH_LEN];
     char tmp[MAX_PATH_LEN];
@@ -346,8 +1061,11 @@ const char* fs_getcwd(void)
     return buf;
 }
 
-void fs_list(fs_list_cb cb)
+static void fs_list_locked(fs_list_cb cb)
 {
+    if (!fs_cwd || dir_load(fs_cwd) != 0)
+        return;
+
     fs_node_t* cur = fs_cwd->child;
     while (cur) {
         cb(cur->name, cur->is_dir);
@@ -355,7 +1073,7 @@ void fs_list(fs_list_cb cb)
     }
 }
 
-int fs_snap_create(const char* name)
+static int fs_snap_create_locked(const char* name)
 {
     if (!name || !name[0]) return -1;
     if (kstrlen(name) >= MAX_SNAP_NAME) return -1;
@@ -370,7 +1088,10 @@ int fs_snap_create(const char* name)
     if (!root_copy) return -1;
     root_copy->parent = root_copy;
     snap_t* s = (snap_t*)kmalloc(sizeof(snap_t));
-    if (!s) return -1;
+    if (!s) {
+        fs_free_tree(root_copy);
+        return -1;
+    }
     kstrncpy(s->name, name, MAX_SNAP_NAME);
     s->root_copy = root_copy;
     s->next = snap_head;
@@ -379,22 +1100,54 @@ int fs_snap_create(const char* name)
     return 0;
 }
 
-int fs_snap_restore(const char* name)
+/* recreate the snapshot nodes src (and siblings) on disk below dir */
+static int fs_restore_tree(fs_node_t* src, fs_node_t* dir)
+{
+    for (; src; src = src->sibling) {
+        fs_node_t* n = node_create(dir, src->name, src->is_dir);
+        if (!n) return -1;
+
+        if (src->is_dir) {
+            if (fs_restore_tree(src->child, n) != 0) return -1;
+        } else if (src->size) {
+            if (file_write_raw(n, src->data, src->size) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+static int fs_snap_restore_locked(const char* name)
 {
     if (!name || !name[0]) return -1;
+    if (open_files) return -1;      /* would free nodes still in use */
 
     snap_t* cur = snap_head;
     while (cur) {
         if (!kstrcmp(cur->name, name)) {
-            fs_root = cur->root_copy;
-            fs_cwd  = fs_root;
-            return 0;
+            /* empty the disk below the root, then write the snapshot back;
+             * the snapshot itself stays intact */
+            if (dir_load(fs_root) != 0) return -1;
+            while (fs_root->child) {
+                fs_node_t* c = fs_root->child;
+                fs_detach_from_parent(c);
+                node_delete(c);
+            }
+
+            fs_dinode_t di;
+            if (fsd_inode_read(FS_ROOT_INO, &di) != 0) return -1;
+            fsd_truncate(&di, 0);
+            di.size = 0;
+            if (fsd_inode_write(FS_ROOT_INO, &di) != 0) return -1;
+            fs_root->free_slot = 0;
+
+            fs_cwd = fs_root;
+            return fs_restore_tree(cur->root_copy->child, fs_root);
         }
         cur = cur->next;
     }
     return -1;
 }
-void fs_snap_list(fs_snap_list_cb cb)
+static void fs_snap_list_locked(fs_snap_list_cb cb)
 {
     snap_t* cur = snap_head;
     while (cur) {
@@ -415,50 +1168,40 @@ static const char* kstrstr(const char* hay, const char* needle)
     return NULL;
 }
 
-/* detach node from its parent's child list (does not free memory) */
-static void fs_detach_from_parent(fs_node_t* node)
-{
-    if (!node || !node->parent) return;
-    fs_node_t* parent = node->parent;
-    fs_node_t** curp = &parent->child;
-    while (*curp) {
-        if (*curp == node) {
-            *curp = node->sibling;
-            node->sibling = NULL;
-            node->parent = NULL;
-            return;
-        }
-        curp = &(*curp)->sibling;
-    }
-}
-
-int fs_unlink(const char *path)
+static int fs_unlink_locked(const char *path)
 {
     if (!path || !*path) return -1;
     fs_node_t* node = fs_resolve(path, 0, NULL);
     if (!node) return -1;
     if (node->is_dir) return -1;
     if (!node->parent) return -1;
+    if (node->opens) return -1;
 
+    if (dir_remove(node->parent, node->slot, node->ino) != 0) return -1;
     fs_detach_from_parent(node);
+    node_delete(node);
     return 0;
 }
 
-int fs_rmdir(const char *path)
+static int fs_rmdir_locked(const char *path)
 {
     if (!path || !*path) return -1;
     fs_node_t* node = fs_resolve(path, 0, NULL);
     if (!node) return -1;
     if (!node->is_dir) return -1;
+    if (dir_load(node) != 0) return -1;
     if (node->child) return -1;
 
     if (node == fs_root) return -1;
+    if (node == fs_cwd) return -1;
 
+    if (dir_remove(node->parent, node->slot, node->ino) != 0) return -1;
     fs_detach_from_parent(node);
+    node_delete(node);
     return 0;
 }
 
-int fs_rename(const char *oldpath, const char *newpath)
+static int fs_rename_locked(const char *oldpath, const char *newpath)
 {
     if (!oldpath || !newpath) return -1;
 
@@ -470,21 +1213,44 @@ int fs_rename(const char *oldpath, const char *newpath)
     if (!dst_parent || !dst_parent->is_dir) return -1;
     if (!last[0]) return -1;
 
-    if (fs_find_in_dir(dst_parent, last))
+    fs_node_t* existing;
+    if (fs_find_in_dir(dst_parent, last, &existing) != 0 || existing)
         return -1;
 
     if (src == fs_root) return -1;
 
+    /* a directory cannot move below itself */
+    for (fs_node_t* p = dst_parent; p != fs_root; p = p->parent)
+        if (p == src) return -1;
+
+    /* the new entry first, then exactly the old one: a free slot ahead
+     * of it in the same directory may now hold the new name */
+    int type = src->is_dir ? FS_T_DIR : FS_T_FILE;
+    uint32_t slot;
+    if (dir_add(dst_parent, last, src->ino, type, &slot) != 0) return -1;
+    if (dir_remove(src->parent, src->slot, src->ino) != 0) {
+        dir_remove(dst_parent, slot, src->ino);
+        return -1;
+    }
+
+    if (dst_parent != src->parent) {
+        fs_dinode_t di;
+        if (fsd_inode_read(src->ino, &di) == 0) {
+            di.parent = dst_parent->ino;
+            fsd_inode_write(src->ino, &di);
+        }
+    }
+
     fs_detach_from_parent(src);
+    src->slot = slot;
     kstrncpy(src->name, last, MAX_NAME_LEN);
-    src->parent = dst_parent;
-    src->sibling = dst_parent->child;
-    dst_parent->child = src;
+    src->hash = fs_name_hash(src->name);
+    fs_attach(dst_parent, src);
 
     return 0;
 }
 
-int fs_copy(const char *src_path, const char *dst_path)
+static int fs_copy_locked(const char *src_path, const char *dst_path)
 {
     if (!src_path || !dst_path) return -1;
 
@@ -498,26 +1264,19 @@ int fs_copy(const char *src_path, const char *dst_path)
     if (!dst_parent || !dst_parent->is_dir) return -1;
     if (!last[0]) return -1;
 
-    if (fs_find_in_dir(dst_parent, last))
+    fs_node_t* existing;
+    if (fs_find_in_dir(dst_parent, last, &existing) != 0 || existing)
         return -1;
 
-    fs_node_t* n = fs_new_node(last, 0);
-    if (!n) return -1;
-    n->parent = dst_parent;
-    n->sibling = dst_parent->child;
-    dst_parent->child = n;
-
-    if (src->data && src->size > 0) {
-        char* buf = (char*)kmalloc(src->size + 1);
-        if (!buf) return -1;
-        for (uint32_t i = 0; i < src->size; i++)
-            buf[i] = src->data[i];
-        buf[src->size] = 0;
-        n->data = buf;
-        n->size = src->size;
-    }
+    /* stored bytes are copied as they are: same key, same offsets */
+    uint32_t len;
+    char* buf = file_read_raw(src, &len);
+    if (!buf) return -1;
 
-    return 0;
+    fs_node_t* n = node_create(dst_parent, last, 0);
+    int r = n ? file_write_raw(n, buf, len) : -1;
+    kfree(buf);
+    return r;
 }
 
 static void fs_find_walk(fs_node_t* node, char* pathbuf, size_t pathlen, const char* needle)
@@ -546,7 +1305,7 @@ static void fs_find_walk(fs_node_t* node, char* pathbuf, size_t pathlen, const c
             console_write("\n");
         }
 
-        if (node->is_dir && node->child) {
+        if (node->is_dir && dir_load(node) == 0 && node->child) {
             fs_find_walk(node->child, pathbuf, pathlen, needle);
         }
 
@@ -557,7 +1316,7 @@ static void fs_find_walk(fs_node_t* node, char* pathbuf, size_t pathlen, const c
     }
 }
 
-int fs_find(const char *name)
+static int fs_find_locked(const char *name)
 {
     if (!name || !*name) return -1;
     if (!fs_root) return -1;
@@ -565,7 +1324,7 @@ int fs_find(const char *name)
     char buf[MAX_PATH_LEN];
     buf[0] = '/';
     buf[1] = 0;
-    if (fs_root->child)
+    if (dir_load(fs_root) == 0 && fs_root->child)
         fs_find_walk(fs_root->child, buf, 1, name);
     return 0;
 }
@@ -575,7 +1334,7 @@ static void fs_tree_walk(fs_node_t* node, fs_tree_cb cb, int depth)
     while (node) {
         cb(node->name, node->is_dir, depth);
 
-        if (node->is_dir && node->child) {
+        if (node->is_dir && dir_load(node) == 0 && node->child) {
             fs_tree_walk(node->child, cb, depth + 1);
         }
 
@@ -583,10 +1342,395 @@ static void fs_tree_walk(fs_node_t* node, fs_tree_cb cb, int depth)
     }
 }
 
-void fs_tree_cwd(fs_tree_cb cb)
+static void fs_tree_cwd_locked(fs_tree_cb cb)
 {
-    if (!cb || !fs_cwd || !fs_cwd->is_dir)
+    if (!cb || !fs_cwd || !fs_cwd->is_dir || dir_load(fs_cwd) != 0)
         return;
 
     fs_tree_walk(fs_cwd->child, cb, 0);
 }
+
+/* ---------------- open files ---------------- */
+
+static fs_file_t* fd_get(int fd)
+{
+    task_t* t = task_current();
+    if (!t || !t->fd_table || fd < 0 || fd >= FS_MAX_FDS)
+        return NULL;
+
+    fs_file_t* f = &((fs_fdtable_t*)t->fd_table)->files[fd];
+    return f->node ? f : NULL;
+}
+
+static void fd_release(fs_file_t* f)
+{
+    f->node->opens--;
+    f->node = NULL;
+    open_files--;
+}
+
+static int fs_open_locked(const char* path, int flags)
+{
+    if (!(flags & (FS_O_READ | FS_O_WRITE))) return -1;
+    if ((flags & FS_O_TRUNC) && !(flags & FS_O_WRITE)) return -1;
+
+    task_t* t = task_current();
+    if (!t) return -1;
+    if (!t->fd_table) {
+        fs_fdtable_t* tab = (fs_fdtable_t*)kmalloc(sizeof(fs_fdtable_t));
+        if (!tab) return -1;
+        for (int i = 0; i < FS_MAX_FDS; i++)
+            tab->files[i].node = NULL;
+        t->fd_table = tab;
+    }
+
+    fs_fdtable_t* tab = (fs_fdtable_t*)t->fd_table;
+    int fd = 0;
+    while (fd < FS_MAX_FDS && tab->files[fd].node)
+        fd++;
+    if (fd == FS_MAX_FDS) return -1;
+
+    fs_node_t* node = file_lookup(path, flags & FS_O_CREATE);
+    if (!node) return -1;
+    if ((flags & FS_O_TRUNC) && file_truncate(node, 0) != 0) return -1;
+
+    tab->files[fd].node  = node;
+    tab->files[fd].pos   = 0;
+    tab->files[fd].flags = flags;
+    node->opens++;
+    open_files++;
+    return fd;
+}
+
+static int fs_close_locked(int fd)
+{
+    fs_file_t* f = fd_get(fd);
+    if (!f) return -1;
+
+    fd_release(f);
+    return 0;
+}
+
+static int fs_fread_locked(int fd, void* buf, uint32_t len)
+{
+    fs_file_t* f = fd_get(fd);
+    if (!f || !(f->flags & FS_O_READ) || !buf) return -1;
+
+    int n = file_pread(f->node, buf, len, f->pos);
+    if (n > 0)
+        f->pos += (uint32_t)n;
+    return n;
+}
+
+static int fs_fwrite_locked(int fd, const void* buf, uint32_t len)
+{
+    fs_file_t* f = fd_get(fd);
+    if (!f || !(f->flags & FS_O_WRITE) || !buf) return -1;
+    if (len > 0x7FFFFFFFu) return -1;
+
+    if (f->flags & FS_O_APPEND) {
+        fs_dinode_t di;
+        if (fsd_inode_read(f->node->ino, &di) != 0) return -1;
+        f->pos = di.size;
+    }
+
+    if (file_pwrite(f->node, buf, len, f->pos) != 0) return -1;
+    f->pos += len;
+    return (int)len;
+}
+
+static int fs_fseek_locked(int fd, int32_t off, int whence)
+{
+    fs_file_t* f = fd_get(fd);
+    if (!f) return -1;
+
+    int64_t base;
+    if (whence == FS_SEEK_SET) {
+        base = 0;
+    } else if (whence == FS_SEEK_CUR) {
+        base = f->pos;
+    } else if (whence == FS_SEEK_END) {
+        fs_dinode_t di;
+        if (fsd_inode_read(f->node->ino, &di) != 0) return -1;
+        base = di.size;
+    } else {
+        return -1;
+    }
+
+    /* past the end is fine: a write there zero-fills the gap */
+    int64_t pos = base + off;
+    if (pos < 0 || pos > 0x7FFFFFFF) return -1;
+    f->pos = (uint32_t)pos;
+    return (int)pos;
+}
+
+/* ---------------- locked entry points ---------------- */
+
+int fs_mkdir(const char* path)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_mkdir_locked(path);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_touch(const char* path)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_touch_locked(path);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_write(const char* path, const char* data)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_write_locked(path, data);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_pread(const char* path, void* buf, uint32_t len, uint32_t off)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_pread_locked(path, buf, len, off);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_pwrite(const char* path, const void* buf, uint32_t len, uint32_t off)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_pwrite_locked(path, buf, len, off);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_append(const char* path, const void* buf, uint32_t len)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_append_locked(path, buf, len);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_write_cwd(const char* name, const char* data)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_write_cwd_locked(name, data);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+const char* fs_read(const char* path)
+{
+    mutex_lock(&fs_lock);
+    const char* r = fs_read_locked(path);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_chdir(const char* path)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_chdir_locked(path);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+const char* fs_getcwd(void)
+{
+    mutex_lock(&fs_lock);
+    const char* r = fs_getcwd_locked();
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+void fs_list(fs_list_cb cb)
+{
+    mutex_lock(&fs_lock);
+    fs_list_locked(cb);
+    mutex_unlock(&fs_lock);
+}
+
+int fs_snap_create(const char* name)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_snap_create_locked(name);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_snap_restore(const char* name)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_snap_restore_locked(name);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+void fs_snap_list(fs_snap_list_cb cb)
+{
+    mutex_lock(&fs_lock);
+    fs_snap_list_locked(cb);
+    mutex_unlock(&fs_lock);
+}
+
+int fs_unlink(const char *path)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_unlink_locked(path);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_rmdir(const char *path)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_rmdir_locked(path);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_rename(const char *oldpath, const char *newpath)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_rename_locked(oldpath, newpath);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_copy(const char *src_path, const char *dst_path)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_copy_locked(src_path, dst_path);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_find(const char *name)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_find_locked(name);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+void fs_tree_cwd(fs_tree_cb cb)
+{
+    mutex_lock(&fs_lock);
+    fs_tree_cwd_locked(cb);
+    mutex_unlock(&fs_lock);
+}
+
+int fs_open(const char* path, int flags)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_open_locked(path, flags);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_close(int fd)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_close_locked(fd);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_fread(int fd, void* buf, uint32_t len)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_fread_locked(fd, buf, len);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_fwrite(int fd, const void* buf, uint32_t len)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_fwrite_locked(fd, buf, len);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_fseek(int fd, int32_t off, int whence)
+{
+    mutex_lock(&fs_lock);
+    int r = fs_fseek_locked(fd, off, whence);
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+void fs_task_release(struct task* t)
+{
+    fs_fdtable_t* tab = (fs_fdtable_t*)t->fd_table;
+    if (!tab) return;
+
+    mutex_lock(&fs_lock);
+    for (int i = 0; i < FS_MAX_FDS; i++)
+        if (tab->files[i].node)
+            fd_release(&tab->files[i]);
+    t->fd_table = NULL;
+    mutex_unlock(&fs_lock);
+
+    kfree(tab);
+}
+
+void fs_get_stats(fs_stats_t* out)
+{
+    fs_disk_stats_t st;
+
+    mutex_lock(&fs_lock);
+    fsd_get_stats(&st);
+    out->dev_name     = st.dev_name;
+    out->block_size   = FS_BLOCK_SIZE;
+    out->total_blocks = st.total_blocks;
+    out->free_blocks  = st.free_blocks;
+    out->total_inodes = st.inode_count;
+    out->free_inodes  = st.free_inodes;
+    out->mounts       = st.mounts;
+    out->block_reads  = st.block_reads;
+    out->block_writes = st.block_writes;
+    out->nodes_cached = nodes_cached;
+    out->dirs_loaded  = dirs_loaded;
+    out->lookup_hits     = dc_hits;
+    out->lookup_neg_hits = dc_neg_hits;
+    out->lookup_misses   = dc_misses;
+    out->open_files      = open_files;
+    mutex_unlock(&fs_lock);
+}
+
+/* ---------------- raw sectors past the filesystem ---------------- */
+
+/* dev if lba is on it and outside the blocks the fs owns, else NULL */
+static block_device_t* spare_sector(uint32_t lba)
+{
+    block_device_t* dev = blockdev_get_root();
+    fs_disk_stats_t st;
+
+    fsd_get_stats(&st);
+    if (!dev || lba < st.total_blocks * FS_SECTORS_PER_BLOCK ||
+        lba >= dev->num_sectors)
+        return NULL;
+    return dev;
+}
+
+int fs_sector_read(uint32_t lba, void* buf)
+{
+    mutex_lock(&fs_lock);
+    block_device_t* dev = spare_sector(lba);
+    int r = dev ? dev->read(dev, lba, 1, buf) : -1;
+    mutex_unlock(&fs_lock);
+    return r;
+}
+
+int fs_sector_write(uint32_t lba, const void* buf)
+{
+    mutex_lock(&fs_lock);
+    block_device_t* dev = spare_sector(lba);
+    int r = dev ? dev->write(dev, lba, 1, buf) : -1;
+    mutex_unlock(&fs_lock);
+    return r;
+}
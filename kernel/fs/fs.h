@@ -4,13 +4,78 @@
 typedef struct fs_node fs_node_t;
 typedef void (*fs_tree_cb)(const char* name, int is_dir, int depth);
 
+/* Mounts the root block device (formatting it if it holds no fs yet),
+ * or a RAM disk if that fails.
+ */
 void fs_init(void);
 
+typedef struct fs_stats {
+    const char* dev_name;
+    uint32_t block_size;
+    uint32_t total_blocks, free_blocks;
+    uint32_t total_inodes, free_inodes;
+    uint32_t mounts;                    /* including this boot */
+    uint32_t block_reads, block_writes; /* since boot */
+    uint32_t nodes_cached;              /* inodes loaded into the tree */
+    uint32_t dirs_loaded;
+    uint32_t lookup_hits;               /* path lookup cache */
+    uint32_t lookup_neg_hits;           /* hits that found nothing */
+    uint32_t lookup_misses;
+    uint32_t open_files;                /* descriptors, all tasks */
+} fs_stats_t;
+
+void fs_get_stats(fs_stats_t* out);
+
+/* Raw 512-byte sectors of the root device past the total_blocks that
+ * belong to the fs (its metadata is cached in RAM, so those are off
+ * limits). Serialized with fs operations; 0, or -1 for an fs sector, a
+ * sector past the end of the device or an I/O error.
+ */
+int fs_sector_read(uint32_t lba, void* buf);
+int fs_sector_write(uint32_t lba, const void* buf);
+
 /* file & dir operations */
 int fs_touch(const char* path);
 int fs_write(const char* path, const char* data);
 const char* fs_read(const char* path);
 
+/* Byte ranges of a file, without reading or rewriting the rest of it.
+ * fs_pread returns the bytes read (0 at the end of the file) or -1;
+ * fs_pwrite and fs_append create a missing file, grow it as needed
+ * (zero-filling any gap) and return 0 or -1.
+ */
+int fs_pread(const char* path, void* buf, uint32_t len, uint32_t off);
+int fs_pwrite(const char* path, const void* buf, uint32_t len, uint32_t off);
+int fs_append(const char* path, const void* buf, uint32_t len);
+
+/*
+ * Open files. Descriptors belong to the calling task (FS_MAX_FDS each)
+ * and are closed when it is reaped. Lengths are explicit, so contents may
+ * hold zero bytes. While a file is open it cannot be unlinked, and no
+ * snapshot can be restored.
+ */
+#define FS_MAX_FDS   16
+
+#define FS_O_READ    0x01
+#define FS_O_WRITE   0x02
+#define FS_O_CREATE  0x04   /* create a missing file */
+#define FS_O_TRUNC   0x08   /* empty it first (needs FS_O_WRITE) */
+#define FS_O_APPEND  0x10   /* every write goes to the end */
+
+#define FS_SEEK_SET  0
+#define FS_SEEK_CUR  1
+#define FS_SEEK_END  2
+
+struct task;
+
+int fs_open(const char* path, int flags);             /* fd, or -1 */
+int fs_close(int fd);
+int fs_fread(int fd, void* buf, uint32_t len);        /* bytes, 0 at end */
+int fs_fwrite(int fd, const void* buf, uint32_t len); /* bytes, or -1 */
+int fs_fseek(int fd, int32_t off, int whence);        /* new position */
+/* Close everything t has open (task teardown) */
+void fs_task_release(struct task* t);
+
 /* directory operations */
 int fs_mkdir(const char* path);
 int fs_chdir(const char* path);
@@ -0,0 +1,536 @@
+#include "fs/fs_disk.h"
+#include "arch/i386/mm/kmalloc.h"
+#include "console.h"
+#include <stddef.h>
+
+#define BITS_PER_BLOCK  (FS_BLOCK_SIZE * 8)
+
+/*
+ * Everything here runs under the fs mutex (fs.c), so the scratch buffers
+ * below are plain statics.
+ *
+ * Both bitmaps are kept in RAM for the life of the mount (9KB for a full
+ * 64MB fs); changing a bit writes back only the bitmap block holding it.
+ * The free counts are recounted from the bitmaps at mount, so the ones in
+ * the on-disk superblock are only refreshed then.
+ */
+static block_device_t *fs_dev = NULL;
+static fs_super_t      sb;
+static uint8_t        *ibitmap = NULL;
+static uint8_t        *bbitmap = NULL;
+static uint32_t        block_hint = 0;
+static uint32_t        inode_hint = 1;
+static fs_disk_stats_t dstats;
+
+static const uint8_t zero_block[FS_BLOCK_SIZE];
+
+/* last inode table block touched, kept for read-modify-write */
+static uint8_t  itab_buf[FS_BLOCK_SIZE];
+static uint32_t itab_blk = 0;
+
+/* one cached block per level of indirection, so walking a file reads
+ * each indirect block once instead of once per data block */
+typedef struct ind_cache {
+    uint32_t blk;
+    uint32_t ptrs[FS_PTRS_PER_BLOCK];
+} ind_cache_t;
+
+static ind_cache_t ind_cache[2];
+
+static void ind_cache_drop(uint32_t blk)
+{
+    for (int i = 0; i < 2; i++)
+        if (ind_cache[i].blk == blk)
+            ind_cache[i].blk = 0;
+}
+
+/* ---------------- block I/O ---------------- */
+
+static int dev_read(uint32_t blk, void *buf)
+{
+    dstats.block_reads++;
+    return fs_dev->read(fs_dev, (uint64_t)blk * FS_SECTORS_PER_BLOCK,
+                        FS_SECTORS_PER_BLOCK, buf);
+}
+
+static int dev_write(uint32_t blk, const void *buf)
+{
+    dstats.block_writes++;
+    return fs_dev->write(fs_dev, (uint64_t)blk * FS_SECTORS_PER_BLOCK,
+                         FS_SECTORS_PER_BLOCK, buf);
+}
+
+int fsd_read_block(uint32_t blk, void *buf)
+{
+    if (!fs_dev || blk >= sb.total_blocks)
+        return -1;
+    return dev_read(blk, buf);
+}
+
+int fsd_write_block(uint32_t blk, const void *buf)
+{
+    if (!fs_dev || blk < sb.data_start || blk >= sb.total_blocks)
+        return -1;
+    return dev_write(blk, buf);
+}
+
+/* ---------------- bitmaps ---------------- */
+
+static inline int bit_test(const uint8_t *map, uint32_t n)
+{
+    return map[n >> 3] & (1u << (n & 7));
+}
+
+/* flip bit n and write back the bitmap block that holds it */
+static int bit_store(uint8_t *map, uint32_t start, uint32_t n, int set)
+{
+    if (set) map[n >> 3] |=  (uint8_t)(1u << (n & 7));
+    else     map[n >> 3] &= (uint8_t)~(1u << (n & 7));
+
+    uint32_t b = n / BITS_PER_BLOCK;
+    return dev_write(start + b, map + b * FS_BLOCK_SIZE);
+}
+
+/* first clear bit in [from, limit), wrapping to lo; limit if none */
+static uint32_t bit_find_clear(const uint8_t *map, uint32_t lo, uint32_t from, uint32_t limit)
+{
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        uint32_t n = pass ? lo : from;
+        uint32_t end = pass ? from : limit;
+
+        while (n < end) {
+            if ((n & 7) == 0 && map[n >> 3] == 0xFF) {
+                n += 8;
+                continue;
+            }
+            if (!bit_test(map, n))
+                return n;
+            n++;
+        }
+    }
+    return limit;
+}
+
+static uint32_t count_set(const uint8_t *map, uint32_t bits)
+{
+    static const uint8_t nibble[16] = { 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4 };
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < bits / 8; i++)
+        n += nibble[map[i] & 0xF] + nibble[map[i] >> 4];
+    for (uint32_t i = bits & ~7u; i < bits; i++)
+        n += bit_test(map, i) ? 1 : 0;
+    return n;
+}
+
+/* zero != 0: the caller may not overwrite the whole block, clear it */
+static uint32_t block_alloc(int zero)
+{
+    uint32_t b = bit_find_clear(bbitmap, sb.data_start, block_hint, sb.total_blocks);
+    if (b >= sb.total_blocks) {
+        console_write("fs: out of disk blocks\n");
+        return 0;
+    }
+
+    if (bit_store(bbitmap, sb.bbitmap_start, b, 1) != 0)
+        return 0;
+    if (zero && dev_write(b, zero_block) != 0)
+        return 0;
+
+    sb.free_blocks--;
+    block_hint = b + 1;
+    return b;
+}
+
+static void block_free(uint32_t b)
+{
+    if (b < sb.data_start || b >= sb.total_blocks || !bit_test(bbitmap, b))
+        return;
+
+    ind_cache_drop(b);
+    bit_store(bbitmap, sb.bbitmap_start, b, 0);
+    sb.free_blocks++;
+    if (b < block_hint)
+        block_hint = b;
+}
+
+/* ---------------- block mapping ---------------- */
+
+/* entry i of the indirect block *ind at cache level lvl */
+static uint32_t ind_get(uint32_t *ind, uint32_t i, int alloc, int lvl, int *created)
+{
+    ind_cache_t *c = &ind_cache[lvl];
+
+    if (!*ind) {
+        if (!alloc)
+            return 0;
+        *ind = block_alloc(1);
+        if (!*ind)
+            return 0;
+    }
+
+    if (c->blk != *ind) {
+        c->blk = 0;
+        if (dev_read(*ind, c->ptrs) != 0)
+            return 0;
+        c->blk = *ind;
+    }
+
+    if (!c->ptrs[i] && alloc) {
+        /* indirect blocks below the top level are always zeroed */
+        uint32_t b = block_alloc(lvl == 1 ? 1 : alloc == FSD_BMAP_ZERO);
+        if (!b)
+            return 0;
+        c->ptrs[i] = b;
+        if (dev_write(*ind, c->ptrs) != 0)
+            return 0;
+        if (created)
+            *created = 1;
+    }
+    return c->ptrs[i];
+}
+
+uint32_t fsd_bmap(fs_dinode_t *di, uint32_t idx, int alloc)
+{
+    int created = 0;
+    uint32_t b = 0;
+
+    if (idx < FS_NDIRECT) {
+        b = di->direct[idx];
+        if (!b && alloc) {
+            b = block_alloc(alloc == FSD_BMAP_ZERO);
+            di->direct[idx] = b;
+            created = b != 0;
+        }
+    } else if ((idx -= FS_NDIRECT) < FS_PTRS_PER_BLOCK) {
+        b = ind_get(&di->indirect, idx, alloc, 0, &created);
+    } else if ((idx -= FS_PTRS_PER_BLOCK) < FS_PTRS_PER_BLOCK * FS_PTRS_PER_BLOCK) {
+        uint32_t mid = ind_get(&di->dindirect, idx / FS_PTRS_PER_BLOCK, alloc, 1, 0);
+        if (mid)
+            b = ind_get(&mid, idx % FS_PTRS_PER_BLOCK, alloc, 0, &created);
+    }
+
+    if (created)
+        di->nblocks++;
+    return b;
+}
+
+/* free what *blk maps from file block `from` on (relative to it);
+ * depth 1 points at data blocks, depth 2 at depth-1 blocks */
+static void free_indirect(uint32_t *blk, uint32_t from, int depth, uint32_t *freed)
+{
+    static uint32_t bufs[2][FS_PTRS_PER_BLOCK];
+    uint32_t *ptrs = bufs[depth - 1];
+    uint32_t span  = depth == 2 ? FS_PTRS_PER_BLOCK : 1;
+    int dirty = 0;
+
+    if (!*blk)
+        return;
+    if (dev_read(*blk, ptrs) != 0)
+        return;
+
+    for (uint32_t i = from / span; i < FS_PTRS_PER_BLOCK; i++) {
+        if (!ptrs[i])
+            continue;
+
+        if (depth == 2) {
+            uint32_t sub = (i == from / span) ? from % span : 0;
+            uint32_t before = ptrs[i];
+            free_indirect(&ptrs[i], sub, 1, freed);
+            dirty |= ptrs[i] != before;
+        } else {
+            block_free(ptrs[i]);
+            ptrs[i] = 0;
+            (*freed)++;
+            dirty = 1;
+        }
+    }
+
+    if (from == 0) {
+        block_free(*blk);
+        *blk = 0;
+    } else if (dirty) {
+        ind_cache_drop(*blk);
+        dev_write(*blk, ptrs);
+    }
+}
+
+void fsd_truncate(fs_dinode_t *di, uint32_t nblocks)
+{
+    uint32_t freed = 0;
+    uint32_t n = nblocks;
+
+    for (uint32_t i = n; i < FS_NDIRECT; i++) {
+        if (di->direct[i]) {
+            block_free(di->direct[i]);
+            di->direct[i] = 0;
+            freed++;
+        }
+    }
+
+    n = n > FS_NDIRECT ? n - FS_NDIRECT : 0;
+    free_indirect(&di->indirect, n, 1, &freed);
+
+    n = n > FS_PTRS_PER_BLOCK ? n - FS_PTRS_PER_BLOCK : 0;
+    free_indirect(&di->dindirect, n, 2, &freed);
+
+    di->nblocks = freed < di->nblocks ? di->nblocks - freed : 0;
+}
+
+/* ---------------- inodes ---------------- */
+
+static int itab_load(uint32_t ino, fs_dinode_t **slot)
+{
+    if (ino == 0 || ino >= sb.inode_count)
+        return -1;
+
+    uint32_t blk = sb.itable_start + ino / FS_INODES_PER_BLOCK;
+    if (itab_blk != blk) {
+        itab_blk = 0;
+        if (dev_read(blk, itab_buf) != 0)
+            return -1;
+        itab_blk = blk;
+    }
+
+    *slot = (fs_dinode_t *)(itab_buf + (ino % FS_INODES_PER_BLOCK) * FS_INODE_SIZE);
+    return 0;
+}
+
+int fsd_inode_read(uint32_t ino, fs_dinode_t *out)
+{
+    fs_dinode_t *slot;
+
+    if (itab_load(ino, &slot) != 0)
+        return -1;
+
+    dstats.inode_reads++;
+    *out = *slot;
+    return 0;
+}
+
+int fsd_inode_write(uint32_t ino, const fs_dinode_t *in)
+{
+    fs_dinode_t *slot;
+
+    if (itab_load(ino, &slot) != 0)
+        return -1;
+
+    *slot = *in;
+    return dev_write(itab_blk, itab_buf);
+}
+
+uint32_t fsd_inode_alloc(int type, uint32_t parent)
+{
+    uint32_t ino = bit_find_clear(ibitmap, 1, inode_hint, sb.inode_count);
+    if (ino >= sb.inode_count) {
+        console_write("fs: out of inodes\n");
+        return 0;
+    }
+
+    fs_dinode_t di = {0};
+    di.type   = (uint16_t)type;
+    di.parent = parent ? parent : ino;
+
+    if (bit_store(ibitmap, sb.ibitmap_start, ino, 1) != 0)
+        return 0;
+    if (fsd_inode_write(ino, &di) != 0)
+        return 0;
+
+    sb.free_inodes--;
+    inode_hint = ino + 1;
+    return ino;
+}
+
+void fsd_inode_free(uint32_t ino)
+{
+    fs_dinode_t di;
+
+    if (fsd_inode_read(ino, &di) != 0 || !bit_test(ibitmap, ino))
+        return;
+
+    fsd_truncate(&di, 0);
+    di.type = FS_T_FREE;
+    di.size = 0;
+    fsd_inode_write(ino, &di);
+
+    bit_store(ibitmap, sb.ibitmap_start, ino, 0);
+    sb.free_inodes++;
+    if (ino < inode_hint)
+        inode_hint = ino;
+}
+
+/* ---------------- mount / format ---------------- */
+
+static uint32_t div_round_up(uint32_t n, uint32_t d)
+{
+    return (n + d - 1) / d;
+}
+
+static int bitmaps_alloc(void)
+{
+    kfree(ibitmap);
+    kfree(bbitmap);
+    ibitmap = (uint8_t *)kmalloc(sb.ibitmap_blocks * FS_BLOCK_SIZE);
+    bbitmap = (uint8_t *)kmalloc(sb.bbitmap_blocks * FS_BLOCK_SIZE);
+    return (ibitmap && bbitmap) ? 0 : -1;
+}
+
+/* the layout fsd_format() gives a filesystem of total blocks */
+static void layout(fs_super_t *s, uint32_t total)
+{
+    *s = (fs_super_t){0};
+    s->magic          = FS_MAGIC;
+    s->version        = FS_VERSION;
+    s->block_size     = FS_BLOCK_SIZE;
+    s->total_blocks   = total;
+    s->inode_count    = total / FS_BLOCKS_PER_INODE;
+    s->ibitmap_start  = 1;
+    s->ibitmap_blocks = div_round_up(s->inode_count, BITS_PER_BLOCK);
+    s->bbitmap_start  = s->ibitmap_start + s->ibitmap_blocks;
+    s->bbitmap_blocks = div_round_up(total, BITS_PER_BLOCK);
+    s->itable_start   = s->bbitmap_start + s->bbitmap_blocks;
+    s->itable_blocks  = div_round_up(s->inode_count, FS_INODES_PER_BLOCK);
+    s->data_start     = s->itable_start + s->itable_blocks;
+}
+
+/* blocks dev can hold, up to FS_MAX_BLOCKS */
+static uint32_t dev_fs_blocks(block_device_t *dev)
+{
+    uint64_t dev_blocks = dev->num_sectors / FS_SECTORS_PER_BLOCK;
+    return dev_blocks > FS_MAX_BLOCKS ? FS_MAX_BLOCKS : (uint32_t)dev_blocks;
+}
+
+/* a superblock we wrote: the layout follows from total_blocks, and the
+ * device is big enough for it (bitmaps and I/O stay in bounds) */
+static int super_valid(const fs_super_t *disk)
+{
+    fs_super_t want;
+
+    if (disk->total_blocks < FS_MIN_BLOCKS ||
+        disk->total_blocks > dev_fs_blocks(fs_dev))
+        return 0;
+
+    layout(&want, disk->total_blocks);
+    return disk->inode_count    == want.inode_count    &&
+           disk->ibitmap_start  == want.ibitmap_start  &&
+           disk->ibitmap_blocks == want.ibitmap_blocks &&
+           disk->bbitmap_start  == want.bbitmap_start  &&
+           disk->bbitmap_blocks == want.bbitmap_blocks &&
+           disk->itable_start   == want.itable_start   &&
+           disk->itable_blocks  == want.itable_blocks  &&
+           disk->data_start     == want.data_start;
+}
+
+static int fsd_format(void)
+{
+    uint32_t total = dev_fs_blocks(fs_dev);
+
+    if (total < FS_MIN_BLOCKS) {
+        console_write("fs: device too small to format\n");
+        return -1;
+    }
+
+    layout(&sb, total);
+
+    if (bitmaps_alloc() != 0)
+        return -1;
+
+    uint8_t *maps[2]   = { ibitmap, bbitmap };
+    uint32_t counts[2] = { sb.ibitmap_blocks, sb.bbitmap_blocks };
+    for (int m = 0; m < 2; m++)
+        for (uint32_t i = 0; i < counts[m] * FS_BLOCK_SIZE; i++)
+            maps[m][i] = 0;
+
+    /* inode 0 and all metadata blocks are never handed out */
+    ibitmap[0] |= 1;
+    for (uint32_t b = 0; b < sb.data_start; b++)
+        bbitmap[b >> 3] |= (uint8_t)(1u << (b & 7));
+
+    for (uint32_t i = 0; i < sb.ibitmap_blocks; i++)
+        if (dev_write(sb.ibitmap_start + i, ibitmap + i * FS_BLOCK_SIZE) != 0)
+            return -1;
+    for (uint32_t i = 0; i < sb.bbitmap_blocks; i++)
+        if (dev_write(sb.bbitmap_start + i, bbitmap + i * FS_BLOCK_SIZE) != 0)
+            return -1;
+
+    /* the inode table is not cleared: inodes are initialized on alloc */
+    sb.free_inodes = sb.inode_count - 1;
+    sb.free_blocks = total - sb.data_start;
+    block_hint = sb.data_start;
+    inode_hint = 1;
+    itab_blk   = 0;
+
+    if (fsd_inode_alloc(FS_T_DIR, FS_ROOT_INO) != FS_ROOT_INO)
+        return -1;
+
+    dstats.formatted = 1;
+    return 0;
+}
+
+int fsd_mount(block_device_t *dev)
+{
+    static uint8_t buf[FS_BLOCK_SIZE];
+
+    fs_dev = dev;
+    sb = (fs_super_t){0};
+    dstats.formatted = 0;
+    itab_blk = 0;
+    ind_cache[0].blk = ind_cache[1].blk = 0;
+
+    if (dev_read(0, buf) != 0)
+        return -1;
+
+    fs_super_t *disk = (fs_super_t *)buf;
+    if (disk->magic != FS_MAGIC || disk->version != FS_VERSION ||
+        disk->block_size != FS_BLOCK_SIZE) {
+        console_write("fs: no filesystem on ");
+        console_write(dev->name);
+        console_write(", formatting\n");
+        if (fsd_format() != 0)
+            return -1;
+    } else if (!super_valid(disk)) {
+        /* not formatted over: the data may still be worth recovering */
+        console_write("fs: bad superblock on ");
+        console_write(dev->name);
+        console_write("\n");
+        return -1;
+    } else {
+        sb = *disk;
+        if (bitmaps_alloc() != 0)
+            return -1;
+        for (uint32_t i = 0; i < sb.ibitmap_blocks; i++)
+            if (dev_read(sb.ibitmap_start + i, ibitmap + i * FS_BLOCK_SIZE) != 0)
+                return -1;
+        for (uint32_t i = 0; i < sb.bbitmap_blocks; i++)
+            if (dev_read(sb.bbitmap_start + i, bbitmap + i * FS_BLOCK_SIZE) != 0)
+                return -1;
+
+        sb.free_inodes = sb.inode_count  - count_set(ibitmap, sb.inode_count);
+        sb.free_blocks = sb.total_blocks - count_set(bbitmap, sb.total_blocks);
+        block_hint = sb.data_start;
+        inode_hint = 1;
+    }
+
+    sb.mounts++;
+    for (uint32_t i = 0; i < FS_BLOCK_SIZE; i++)
+        buf[i] = 0;
+    *(fs_super_t *)buf = sb;
+    if (dev_write(0, buf) != 0)
+        return -1;
+
+    dstats.dev_name = dev->name;
+    return 0;
+}
+
+void fsd_get_stats(fs_disk_stats_t *out)
+{
+    if (!out)
+        return;
+
+    *out = dstats;
+    out->total_blocks = sb.total_blocks;
+    out->free_blocks  = sb.free_blocks;
+    out->inode_count  = sb.inode_count;
+    out->free_inodes  = sb.free_inodes;
+    out->mounts       = sb.mounts;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <stdint.h>
+#include "fs/blockdev.h"
+
+/*
+ * On-disk layout (all numbers little endian, in FS_BLOCK_SIZE blocks):
+ *
+ *   0                 superblock
+ *   ibitmap_start     inode bitmap (1 bit per inode)
+ *   bbitmap_start     block bitmap (1 bit per block, metadata included)
+ *   itable_start      inode table, FS_INODES_PER_BLOCK per block
+ *   data_start ...    file data, directory blocks, indirect blocks
+ *
+ * Inode 0 is never used; inode 1 is the root directory. A directory's
+ * data is an array of fs_dirent_t (free slots have ino == 0).
+ *
+ * Updates are written through as they happen: no journal, so a crash in
+ * the middle of an operation can leak blocks or inodes.
+ */
+#define FS_MAGIC            0x48594653u     /* "HYFS" */
+#define FS_VERSION          1
+#define FS_BLOCK_SIZE       1024
+#define FS_SECTORS_PER_BLOCK (FS_BLOCK_SIZE / 512)
+#define FS_MAX_BLOCKS       65536           /* 64MB; the rest of the disk is unused */
+#define FS_MIN_BLOCKS       256
+#define FS_BLOCKS_PER_INODE 8               /* inode count = blocks / this */
+#define FS_ROOT_INO         1
+
+#define FS_NDIRECT          22
+#define FS_PTRS_PER_BLOCK   (FS_BLOCK_SIZE / 4)
+#define FS_MAX_FILE_BLOCKS  (FS_NDIRECT + FS_PTRS_PER_BLOCK + \
+                             FS_PTRS_PER_BLOCK * FS_PTRS_PER_BLOCK)
+
+#define FS_NAME_MAX         32              /* including the NUL */
+
+enum {
+    FS_T_FREE = 0,
+    FS_T_FILE = 1,
+    FS_T_DIR  = 2,
+};
+
+typedef struct fs_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint32_t ibitmap_start, ibitmap_blocks;
+    uint32_t bbitmap_start, bbitmap_blocks;
+    uint32_t itable_start, itable_blocks;
+    uint32_t data_start;
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t mounts;            /* times mounted, for sysinfo/df */
+} fs_super_t;
+
+typedef struct fs_dinode {
+    uint16_t type;              /* FS_T_* */
+    uint16_t reserved0;
+    uint32_t size;              /* bytes */
+    uint32_t parent;            /* containing directory (root: itself) */
+    uint32_t nblocks;           /* data blocks mapped, indirect ones excluded */
+    uint32_t direct[FS_NDIRECT];
+    uint32_t indirect;
+    uint32_t dindirect;
+    uint32_t reserved[4];
+} fs_dinode_t;
+
+#define FS_INODE_SIZE       128
+#define FS_INODES_PER_BLOCK (FS_BLOCK_SIZE / FS_INODE_SIZE)
+
+typedef struct fs_dirent {
+    uint32_t ino;               /* 0 = free slot */
+    uint8_t  type;              /* FS_T_FILE / FS_T_DIR */
+    uint8_t  name_len;
+    uint8_t  reserved0[2];
+    char     name[FS_NAME_MAX];
+    uint8_t  reserved[24];
+} fs_dirent_t;
+
+#define FS_DIRENT_SIZE       64
+#define FS_DIRENTS_PER_BLOCK (FS_BLOCK_SIZE / FS_DIRENT_SIZE)
+
+_Static_assert(sizeof(fs_dinode_t) == FS_INODE_SIZE, "fs_dinode_t size");
+_Static_assert(sizeof(fs_dirent_t) == FS_DIRENT_SIZE, "fs_dirent_t size");
+_Static_assert(sizeof(fs_super_t) <= FS_BLOCK_SIZE, "fs_super_t size");
+
+typedef struct fs_disk_stats {
+    const char *dev_name;
+    uint32_t total_blocks;
+    uint32_t free_blocks;
+    uint32_t inode_count;
+    uint32_t free_inodes;
+    uint32_t mounts;
+    uint32_t block_reads;       /* since boot */
+    uint32_t block_writes;
+    uint32_t inode_reads;
+    uint32_t formatted;         /* 1 if this boot created the fs */
+} fs_disk_stats_t;
+
+/* Mount the fs on dev, formatting it first when there is no valid
+ * superblock. 0 on success.
+ */
+int  fsd_mount(block_device_t *dev);
+
+int  fsd_read_block(uint32_t blk, void *buf);
+int  fsd_write_block(uint32_t blk, const void *buf);
+
+/* Inode table access; ino must be allocated (except for alloc) */
+int  fsd_inode_read(uint32_t ino, fs_dinode_t *out);
+int  fsd_inode_write(uint32_t ino, const fs_dinode_t *in);
+/* New zeroed inode of the given type, written out; 0 if the table is full */
+uint32_t fsd_inode_alloc(int type, uint32_t parent);
+/* Free the inode and every block it maps */
+void fsd_inode_free(uint32_t ino);
+
+/* Disk block holding file block idx of di, 0 if there is none (or the
+ * disk is full). FSD_BMAP_ALLOC allocates a missing block for a caller
+ * that overwrites all of it, FSD_BMAP_ZERO also clears it; indirect
+ * blocks on the way are always zeroed. di is updated but not written
+ * back.
+ */
+#define FSD_BMAP_LOOKUP  0
+#define FSD_BMAP_ALLOC   1
+#define FSD_BMAP_ZERO    2
+
+uint32_t fsd_bmap(fs_dinode_t *di, uint32_t idx, int alloc);
+/* Free file blocks from nblocks on; di is updated but not written back */
+void fsd_truncate(fs_dinode_t *di, uint32_t nblocks);
+
+void fsd_get_stats(fs_disk_stats_t *out);
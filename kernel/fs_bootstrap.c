@@ -1,5 +1,6 @@
 #include "fs/fs.h"
 #include "console.h"
+#include "arch/i386/mm/kmalloc.h"
 
 /*
  * Create an initial directory structure on the root filesystem
@@ -20,6 +21,7 @@ void fs_bootstrap(void)
     fs_chdir("/");
     const char *sentinel = fs_read(".hypnos_root_initialized");
     if (sentinel) {
+        kfree((void *)sentinel);
         console_write("fs_bootstrap: filesystem already initialized.\n");
         fs_chdir(saved_cwd);
         return;
@@ -44,7 +46,7 @@ void fs_bootstrap(void)
     fs_chdir("/etc");
     fs_write("motd",
         "Welcome to Hypnos OS!\n"
-        "This is a demo filesystem stored on an 8GB virtual disk.\n"
+        "This is a demo filesystem stored on the root disk.\n"
         "Commands: ls, cd, pwd, mkdir, touch, write, cat, edit, snap-*, log, whoami, users ...\n"
     );
     fs_chdir("/");
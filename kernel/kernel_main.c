@@ -4,7 +4,10 @@
 #include "console.h"
 #include "arch/i386/cpu/gdt.h"
 #include "arch/i386/cpu/idt.h"
+#include "arch/i386/cpu/isr.h"
 #include "arch/i386/cpu/irq.h"
+#include "arch/i386/cpu/fpu.h"
+#include "arch/i386/cpu/smp.h"
 #include "arch/i386/drivers/timer.h"
 #include "arch/i386/drivers/keyboard.h"
 #include "arch/i386/mm/paging.h"
@@ -50,6 +53,12 @@ static void sleep_ticks(uint32_t ticks)
     if (ticks == 0)
         return;
 
+    /* from a task, get off the CPU instead of polling the tick count */
+    if (task_can_block()) {
+        task_sleep(ticks);
+        return;
+    }
+
     uint32_t start = timer_get_ticks();
 
         /* Timer not running yet: approximate delay using a busy loop.
@@ -141,8 +150,9 @@ static void demo_task(void)
     }
 }
 
-void kernel_main(void)
+void kernel_main(uint32_t magic, uint32_t mbi_addr)
 {
+    const multiboot_info_t* mbi = 0;
     console_set_theme_default();
     console_clear();
 
@@ -162,12 +172,18 @@ void kernel_main(void)
 
     paging_init();
     paging_enable();
+    isr_install_double_fault();
     ok("Paging initialized and enabled.");
     sleep_ticks(sleep_timer);
     log_event("[BOOT] Paging initialized and enabled.");
     sleep_ticks(sleep_timer);
 
-    phys_init();
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC)
+        mbi = (const multiboot_info_t*)mbi_addr;
+    else
+        console_write("Not booted by a multiboot loader, no memory map.\n");
+
+    phys_init(mbi);
     ok("Physical memory manager initialized.");
     sleep_ticks(sleep_timer);
     log_event("[BOOT] Physical memory manager initialized.");
@@ -189,6 +205,7 @@ void kernel_main(void)
             console_write("Heap test: ");
             console_write(buf);
             console_write("\n");
+            kfree(buf);
             log_event("[BOOT] Heap test OK.");
         } else {
             log_event("[BOOT] Heap test FAILED (kmalloc returned NULL).");
@@ -226,14 +243,14 @@ void kernel_main(void)
     log_event("[BOOT] Filesystem encryption key installed.");
     sleep_ticks(sleep_timer);
 
-    // Initialize ATA 8GB disk and make it the root FS device
+    // Initialize the ATA disk and make it the root FS device
     block_device_t *ata0 = ata_pio_init();
     blockdev_set_root(ata0);
 
     fs_init();
     ok("Filesystem initialized.");
     sleep_ticks(sleep_timer);
-    log_event("[BOOT] Filesystem initialized on /dev/ata0 (8GB).");
+    log_event("[BOOT] Filesystem initialized on the root disk.");
     sleep_ticks(sleep_timer);
 
     fs_bootstrap();
@@ -270,6 +287,10 @@ void kernel_main(void)
     ok("Syscalls (INT 0x80) initialized.");
     sleep_ticks(sleep_timer);
 
+    fpu_init();
+    ok("FPU enabled (lazy save/restore).");
+    log_event("[BOOT] FPU enabled.");
+
     keyboard_install();
     ok("Keyboard driver installed.");
     sleep_ticks(sleep_timer);
@@ -285,6 +306,10 @@ void kernel_main(void)
     task_init();
     log_event("[BOOT] Task subsystem initialized.");
 
+    /* APs wait in scheduler_start_ap() until scheduler_start() below */
+    smp_init();
+    log_event("[BOOT] SMP initialized.");
+
     console_clear();
     console_clear();
     print_ascii_banner();
@@ -292,7 +317,8 @@ void kernel_main(void)
     banner("Starting Hypnos...");
     log_event("[BOOT] Hypnos banner displayed.");
 
-    task_create(shell_thread, "shell");
+    /* the shell blocks on the keyboard, so it can outrank batch work */
+    task_set_priority(task_create(shell_thread, "shell"), TASK_PRIO_INTERACTIVE);
     // task_create(demo_task, "demo");
 
     log_event("[BOOT] Initial tasks created.");
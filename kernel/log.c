@@ -2,6 +2,7 @@
 #include "console.h"
 #include <stdint.h>
 #include "arch/i386/drivers/debugcon.h"   // <— ADD THIS
+#include "sched/spinlock.h"
 
 #define LOG_MAX_LINES 128
 #define LOG_LINE_LEN  80
@@ -10,6 +11,9 @@ static char log_buf[LOG_MAX_LINES][LOG_LINE_LEN];
 static int  log_head = 0;
 static int  log_count = 0;
 
+/* log_event() runs on any CPU, sometimes with interrupts already off */
+static spinlock_t log_lock = SPINLOCK_INIT("log");
+
 static int l_strlen(const char* s) {
     int n = 0;
     while (s && s[n]) n++;
@@ -38,9 +42,11 @@ void log_event(const char* msg)
     if (!msg) return;
 
     // Save in ring buffer for in-kernel dump
+    uint32_t flags = spin_lock_irqsave(&log_lock);
     l_strncpy(log_buf[log_head], msg, LOG_LINE_LEN);
     log_head = (log_head + 1) % LOG_MAX_LINES;
     if (log_count < LOG_MAX_LINES) log_count++;
+    spin_unlock_irqrestore(&log_lock, flags);
 
     // Also send to QEMU debugcon so it gets written to logs/all.log
     debugcon_write(msg);
@@ -50,11 +56,13 @@ void log_event(const char* msg)
 void log_dump(void)
 {
     console_write("=== Hypnos audit log ===\n");
+    uint32_t flags = spin_lock_irqsave(&log_lock);
     int start = (log_head - log_count + LOG_MAX_LINES) % LOG_MAX_LINES;
     for (int i = 0; i < log_count; i++) {
         int idx = (start + i) % LOG_MAX_LINES;
         console_write(log_buf[idx]);
         console_write("\n");
     }
+    spin_unlock_irqrestore(&log_lock, flags);
     console_write("=== end ===\n");
 }
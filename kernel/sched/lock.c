@@ -0,0 +1,329 @@
+#include "sched/lock.h"
+#include "arch/i386/cpu/irq.h"
+#include "arch/i386/drivers/timer.h"
+
+#define RW_WRITER   0x80000000u
+#define RW_PENDING  0x40000000u     /* a writer is waiting */
+#define RW_READERS  0x3FFFFFFFu
+
+/*
+ * Registry of named locks, newest first. Its own guard is a bare flag:
+ * a spinlock_t here would try to register itself.
+ */
+static lock_stats_t     *lock_list = 0;
+static volatile uint32_t lock_list_busy = 0;
+
+static uint32_t registry_lock(void)
+{
+    uint32_t flags = irq_save();
+    while (__atomic_exchange_n(&lock_list_busy, 1, __ATOMIC_ACQUIRE))
+        cpu_relax();
+    return flags;
+}
+
+static void registry_unlock(uint32_t flags)
+{
+    __atomic_store_n(&lock_list_busy, 0, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+static void lock_register(lock_stats_t *st)
+{
+    uint32_t flags = registry_lock();
+
+    /* readers of an rwlock can race here; only one of them links it */
+    if (!st->registered) {
+        st->next = lock_list;
+        lock_list = st;
+        st->registered = 1;
+    }
+
+    registry_unlock(flags);
+}
+
+void lock_unregister(lock_stats_t *st)
+{
+    uint32_t flags = registry_lock();
+
+    for (lock_stats_t **pp = &lock_list; *pp; pp = &(*pp)->next) {
+        if (*pp == st) {
+            *pp = st->next;
+            break;
+        }
+    }
+    st->registered = 0;
+    st->next = 0;
+
+    registry_unlock(flags);
+}
+
+/* ---------------- counters ---------------- */
+
+uint64_t lock_clock(void)
+{
+    return ktime_ns();
+}
+
+void lock_acquired(lock_stats_t *st, int contended, uint64_t wait_start)
+{
+    if (!st->name)
+        return;
+
+    uint64_t now = ktime_ns();
+
+    if (!st->registered)
+        lock_register(st);
+
+    st->acquires++;
+    if (contended) {
+        st->contended++;
+        st->wait_ns += now - wait_start;
+    }
+    st->held_since = now;
+}
+
+void lock_released(lock_stats_t *st)
+{
+    if (!st->name)
+        return;
+
+    uint64_t held = ktime_ns() - st->held_since;
+
+    st->hold_ns += held;
+    if (held > st->max_hold_ns)
+        st->max_hold_ns = held;
+}
+
+/* shared holders run concurrently: counts only, no times */
+static void lock_acquired_shared(lock_stats_t *st, int contended)
+{
+    if (!st->name)
+        return;
+
+    if (!st->registered)
+        lock_register(st);
+
+    __atomic_fetch_add(&st->acquires, 1, __ATOMIC_RELAXED);
+    if (contended)
+        __atomic_fetch_add(&st->contended, 1, __ATOMIC_RELAXED);
+}
+
+/* ---------------- ticket lock ---------------- */
+
+void ticket_lock(ticketlock_t *l)
+{
+    uint16_t me = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+    uint64_t t0 = 0;
+    int contended = 0;
+
+    if (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != me) {
+        contended = 1;
+        t0 = lock_clock();
+        while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != me)
+            cpu_relax();
+    }
+
+    lock_acquired(&l->stats, contended, t0);
+}
+
+int ticket_trylock(ticketlock_t *l)
+{
+    uint16_t owner = __atomic_load_n(&l->owner, __ATOMIC_ACQUIRE);
+    uint16_t next  = owner;
+
+    /* only free if nobody holds or waits for a ticket */
+    if (!__atomic_compare_exchange_n(&l->next, &next, (uint16_t)(owner + 1),
+                                     0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    lock_acquired(&l->stats, 0, 0);
+    return 1;
+}
+
+void ticket_unlock(ticketlock_t *l)
+{
+    lock_released(&l->stats);
+    __atomic_store_n(&l->owner, (uint16_t)(l->owner + 1), __ATOMIC_RELEASE);
+}
+
+/* ---------------- reader-writer lock ---------------- */
+
+void read_lock(rwlock_t *l)
+{
+    int contended = 0;
+
+    for (;;) {
+        uint32_t s = l->state;
+
+        if (!(s & (RW_WRITER | RW_PENDING)) &&
+            __atomic_compare_exchange_n(&l->state, &s, s + 1,
+                                        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+
+        contended = 1;
+        cpu_relax();
+    }
+
+    lock_acquired_shared(&l->stats, contended);
+}
+
+void read_unlock(rwlock_t *l)
+{
+    __atomic_fetch_sub(&l->state, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(rwlock_t *l)
+{
+    uint64_t t0 = 0;
+    int contended = 0;
+
+    for (;;) {
+        uint32_t s = l->state;
+
+        if (!(s & (RW_WRITER | RW_READERS)) &&
+            __atomic_compare_exchange_n(&l->state, &s, RW_WRITER,
+                                        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+
+        if (!contended) {
+            contended = 1;
+            t0 = lock_clock();
+        }
+        /* keep new readers out until we are in; another writer taking
+         * the lock clears this, so set it again on every pass */
+        if (!(s & RW_PENDING))
+            __atomic_fetch_or(&l->state, RW_PENDING, __ATOMIC_RELAXED);
+        cpu_relax();
+    }
+
+    lock_acquired(&l->stats, contended, t0);
+}
+
+void write_unlock(rwlock_t *l)
+{
+    lock_released(&l->stats);
+    /* leave RW_PENDING for a writer that is still waiting */
+    __atomic_fetch_and(&l->state, RW_PENDING, __ATOMIC_RELEASE);
+}
+
+/* ---------------- mutex ---------------- */
+
+void mutex_lock(mutex_t *m)
+{
+    uint32_t flags = spin_lock_irqsave(&m->guard);
+    uint64_t t0 = 0;
+    int contended = 0;
+
+    while (m->locked) {
+        if (!contended) {
+            contended = 1;
+            t0 = lock_clock();
+        }
+
+        if (task_can_block()) {
+            task_wait_spinlock(&m->waiters, &m->guard);
+        } else {
+            spin_unlock(&m->guard);
+            cpu_relax();
+            spin_lock(&m->guard);
+        }
+    }
+
+    m->locked = 1;
+    m->owner  = task_current();
+    lock_acquired(&m->stats, contended, t0);
+
+    spin_unlock_irqrestore(&m->guard, flags);
+}
+
+int mutex_trylock(mutex_t *m)
+{
+    uint32_t flags = spin_lock_irqsave(&m->guard);
+    int ok = !m->locked;
+
+    if (ok) {
+        m->locked = 1;
+        m->owner  = task_current();
+        lock_acquired(&m->stats, 0, 0);
+    }
+
+    spin_unlock_irqrestore(&m->guard, flags);
+    return ok;
+}
+
+void mutex_unlock(mutex_t *m)
+{
+    uint32_t flags = spin_lock_irqsave(&m->guard);
+
+    lock_released(&m->stats);
+    m->locked = 0;
+    m->owner  = 0;
+
+    /* the woken task competes again, so a barging task may still win */
+    if (m->waiters.head)
+        task_wake_one(&m->waiters);
+
+    spin_unlock_irqrestore(&m->guard, flags);
+}
+
+int mutex_held(mutex_t *m)
+{
+    return m->locked && m->owner == task_current();
+}
+
+/* ---------------- reporting ---------------- */
+
+static uint32_t ns_to_us(uint64_t ns)
+{
+    uint32_t sec, nsec;
+
+    ktime_split(ns, &sec, &nsec);
+    if (sec >= 4294)
+        return 0xFFFFFFFFu;
+    return sec * 1000000u + nsec / 1000u;
+}
+
+int lock_snapshot(lock_info_t *out, int max)
+{
+    uint32_t flags = registry_lock();
+    int n = 0;
+
+    for (lock_stats_t *st = lock_list; st && n < max; st = st->next, n++) {
+        out[n].name        = st->name;
+        out[n].kind        = st->kind;
+        out[n].acquires    = st->acquires;
+        out[n].contended   = st->contended;
+        out[n].wait_us     = ns_to_us(st->wait_ns);
+        out[n].hold_us     = ns_to_us(st->hold_ns);
+        out[n].max_hold_us = ns_to_us(st->max_hold_ns);
+    }
+
+    registry_unlock(flags);
+    return n;
+}
+
+void lock_stats_reset(void)
+{
+    uint32_t flags = registry_lock();
+
+    for (lock_stats_t *st = lock_list; st; st = st->next) {
+        st->acquires    = 0;
+        st->contended   = 0;
+        st->wait_ns     = 0;
+        st->hold_ns     = 0;
+        st->max_hold_ns = 0;
+    }
+
+    registry_unlock(flags);
+}
+
+const char *lock_kind_name(int kind)
+{
+    switch (kind) {
+    case LOCK_SPIN:   return "spin";
+    case LOCK_TICKET: return "ticket";
+    case LOCK_RW:     return "rw";
+    case LOCK_MUTEX:  return "mutex";
+    default:          return "?";
+    }
+}
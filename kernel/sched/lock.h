@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include "sched/spinlock.h"
+#include "sched/task.h"
+
+/*
+ * Ticket lock: like a spinlock, but waiters get the lock in the order
+ * they arrived, so one CPU cannot starve the others under contention.
+ */
+typedef struct ticketlock {
+    volatile uint16_t next;     /* ticket handed to the next arrival */
+    volatile uint16_t owner;    /* ticket being served               */
+    lock_stats_t      stats;
+} ticketlock_t;
+
+#define TICKETLOCK_INIT(name)  { 0, 0, LOCK_STATS_INIT(name, LOCK_TICKET) }
+
+void ticket_lock(ticketlock_t *l);
+int  ticket_trylock(ticketlock_t *l);
+void ticket_unlock(ticketlock_t *l);
+
+/*
+ * Spinning reader-writer lock. Any number of readers, or one writer; a
+ * waiting writer keeps new readers out so it cannot be starved. Same
+ * rules as a spinlock: no sleeping, interrupts off if an IRQ takes it.
+ */
+typedef struct rwlock {
+    volatile uint32_t state;    /* reader count | RW_WRITER | RW_PENDING */
+    lock_stats_t      stats;
+} rwlock_t;
+
+#define RWLOCK_INIT(name)  { 0, LOCK_STATS_INIT(name, LOCK_RW) }
+
+void read_lock(rwlock_t *l);
+void read_unlock(rwlock_t *l);
+void write_lock(rwlock_t *l);
+void write_unlock(rwlock_t *l);
+
+/*
+ * Sleeping mutex for longer sections that may allocate or wait on a
+ * device. Contended callers block on a wait queue instead of spinning
+ * (they spin only before the scheduler runs or in interrupt context,
+ * where a mutex should not be used anyway). Not recursive.
+ */
+typedef struct mutex {
+    spinlock_t   guard;         /* protects owner and waiters */
+    task_t      *owner;
+    int          locked;
+    wait_queue_t waiters;
+    lock_stats_t stats;
+} mutex_t;
+
+#define MUTEX_INIT(name)  { SPINLOCK_INIT(0), 0, 0, WAIT_QUEUE_INIT, \
+                            LOCK_STATS_INIT(name, LOCK_MUTEX) }
+
+void mutex_lock(mutex_t *m);
+int  mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+int  mutex_held(mutex_t *m);    /* by the current task */
+
+/* Registry of every lock taken so far, for the `locks` command */
+typedef struct lock_info {
+    const char *name;
+    int         kind;
+    uint32_t    acquires;
+    uint32_t    contended;
+    uint32_t    wait_us;
+    uint32_t    hold_us;
+    uint32_t    max_hold_us;
+} lock_info_t;
+
+int  lock_snapshot(lock_info_t *out, int max);   /* entries filled */
+void lock_stats_reset(void);
+const char *lock_kind_name(int kind);
+
+/* A lock embedded in memory that is about to be freed must leave the
+ * registry first
+ */
+void lock_unregister(lock_stats_t *st);
@@ -0,0 +1,99 @@
+#pragma once
+#include <stdint.h>
+#include "arch/i386/cpu/irq.h"
+#include "arch/i386/cpu/smp.h"
+
+enum {
+    LOCK_SPIN,
+    LOCK_TICKET,
+    LOCK_RW,
+    LOCK_MUTEX,
+};
+
+/*
+ * Counters every lock carries. A lock joins the registry (sched/lock.h)
+ * the first time it is taken, so static locks need no init call.
+ *
+ * Times are ktime_ns() deltas. Hold time is only tracked for exclusive
+ * holders (readers of an rwlock overlap); it is charged to the lock, not
+ * the CPU, so a lock handed over across a context switch still adds up.
+ * A lock with a NULL name is not tracked at all.
+ */
+typedef struct lock_stats {
+    const char *name;
+    uint8_t     kind;
+    uint8_t     registered;
+    uint32_t    acquires;
+    uint32_t    contended;      /* acquisitions that had to wait */
+    uint64_t    wait_ns;
+    uint64_t    hold_ns;
+    uint64_t    max_hold_ns;
+    uint64_t    held_since;
+    struct lock_stats *next;
+} lock_stats_t;
+
+#define LOCK_STATS_INIT(n, k)  { .name = (n), .kind = (k) }
+
+/* lock.c; called with the lock held */
+uint64_t lock_clock(void);
+void     lock_acquired(lock_stats_t *st, int contended, uint64_t wait_start);
+void     lock_released(lock_stats_t *st);
+
+/*
+ * Test-and-set lock for short critical sections shared between CPUs.
+ * A holder must not sleep. If an interrupt handler can take the same
+ * lock, take it with spin_lock_irqsave() or the handler will spin on its
+ * own CPU forever.
+ */
+typedef struct spinlock {
+    volatile uint32_t locked;
+    lock_stats_t      stats;
+} spinlock_t;
+
+#define SPINLOCK_INIT(name)  { 0, LOCK_STATS_INIT(name, LOCK_SPIN) }
+
+static inline void spin_lock(spinlock_t *l)
+{
+    uint64_t t0 = 0;
+    int contended = 0;
+
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+        if (!contended) {
+            contended = 1;
+            t0 = lock_clock();
+        }
+        /* wait on a plain read so the line is not bounced around */
+        while (l->locked)
+            cpu_relax();
+    }
+
+    lock_acquired(&l->stats, contended, t0);
+}
+
+static inline int spin_trylock(spinlock_t *l)
+{
+    if (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+        return 0;
+
+    lock_acquired(&l->stats, 0, 0);
+    return 1;
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+    lock_released(&l->stats);
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t spin_lock_irqsave(spinlock_t *l)
+{
+    uint32_t flags = irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, uint32_t flags)
+{
+    spin_unlock(l);
+    irq_restore(flags);
+}
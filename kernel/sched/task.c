@@ -1,42 +1,590 @@
 #include "sched/task.h"
+#include "sched/spinlock.h"
 #include "arch/i386/mm/kmalloc.h"
+#include "arch/i386/mm/kstack.h"
+#include "arch/i386/mm/paging.h"
+#include "arch/i386/cpu/gdt.h"
+#include "arch/i386/cpu/irq.h"
+#include "arch/i386/cpu/fpu.h"
+#include "arch/i386/cpu/smp.h"
+#include "arch/i386/drivers/timer.h"
+#include "fs/fs.h"
 #include "console.h"
 #include "log.h"
 
-extern void start_task(uint32_t esp, uint32_t eip);
-extern void switch_task(cpu_state_t *old, cpu_state_t *new);
+extern void switch_stack(uint32_t *old_esp, uint32_t new_esp);
+extern void task_trampoline(void);
+extern void enter_user_mode(uint32_t eip, uint32_t esp);
 
-static task_t *current   = 0;
 static task_t *task_head = 0;
+static task_t *task_tail = 0;
 static int     next_id   = 1;
 
+/*
+ * One FIFO per priority class plus a bitmap of the non-empty ones: enqueue
+ * is a tail insert, picking the next task is one ctz and a head removal,
+ * however many tasks exist.
+ */
+typedef struct run_queue {
+    task_t *head;
+    task_t *tail;
+} run_queue_t;
+
+/*
+ * Every CPU schedules from its own set of queues. A task is queued on the
+ * CPU it last ran on (or the least loaded one it may use, when it is
+ * new), and a CPU that runs out of work steals from the others before
+ * it falls back to its idle task.
+ *
+ * sched_lock covers all of it: the queues, task states, wait queues and
+ * the task list. It is held with interrupts off and across switch_stack;
+ * whichever task runs next drops it (sched_finish / task_started), so a
+ * task is never visible as ready while its registers are still live on
+ * another CPU.
+ */
+typedef struct cpu_rq {
+    run_queue_t  queues[TASK_NUM_PRIOS];
+    uint32_t     ready_mask;
+    uint32_t     nr_ready;          /* idle task not counted */
+    task_t      *current;           /* 0 until this CPU starts scheduling */
+    task_t      *idle;
+    volatile int need_resched;
+    uint32_t     ticks;
+    uint32_t     idle_ticks;
+    uint32_t     switches;
+    uint32_t     steals;
+} cpu_rq_t;
+
+static cpu_rq_t   cpu_rqs[SMP_MAX_CPUS];
+static spinlock_t sched_lock = SPINLOCK_INIT("sched");
+
+#define IDLE_BIT  (1u << TASK_PRIO_IDLE)
+
+static inline cpu_rq_t *this_rq(void)
+{
+    return &cpu_rqs[smp_cpu_id()];
+}
+
+static inline uint32_t sched_lock_irqsave(void)
+{
+    uint32_t flags = irq_save();
+    spin_lock(&sched_lock);
+    return flags;
+}
+
+static inline void sched_unlock_irqrestore(uint32_t flags)
+{
+    spin_unlock(&sched_lock);
+    irq_restore(flags);
+}
+
+/* after a schedule(): drop the scheduler lock, then take back the big
+ * kernel lock if the task held it when it was switched out */
+static void sched_finish(uint32_t flags)
+{
+    task_t *t = this_rq()->current;
+
+    spin_unlock(&sched_lock);
+    if (t && t->bkl_depth) {
+        int depth = t->bkl_depth;
+        t->bkl_depth = 0;
+        bkl_reacquire(depth);
+    }
+    irq_restore(flags);
+}
+
+static inline int is_idle(task_t *t)
+{
+    return t == cpu_rqs[t->cpu].idle;
+}
+
+static void rq_push(task_t *t)
+{
+    cpu_rq_t *rq = &cpu_rqs[t->cpu];
+    run_queue_t *q = &rq->queues[t->priority];
+
+    t->state   = TASK_READY;
+    t->rq_next = 0;
+    t->rq_prev = q->tail;
+    if (q->tail)
+        q->tail->rq_next = t;
+    else
+        q->head = t;
+    q->tail = t;
+
+    rq->ready_mask |= 1u << t->priority;
+    if (!is_idle(t))
+        rq->nr_ready++;
+}
+
+static void rq_remove(task_t *t)
+{
+    cpu_rq_t *rq = &cpu_rqs[t->cpu];
+    run_queue_t *q = &rq->queues[t->priority];
+
+    if (t->rq_prev) t->rq_prev->rq_next = t->rq_next;
+    else            q->head             = t->rq_next;
+    if (t->rq_next) t->rq_next->rq_prev = t->rq_prev;
+    else            q->tail             = t->rq_prev;
+
+    t->rq_next = t->rq_prev = 0;
+    if (!q->head)
+        rq->ready_mask &= ~(1u << t->priority);
+    if (!is_idle(t))
+        rq->nr_ready--;
+}
+
+/* is something of the same or higher priority than current waiting? */
+static inline int rq_has_peer(cpu_rq_t *rq)
+{
+    return rq->current && (rq->ready_mask & ((2u << rq->current->priority) - 1));
+}
+
+static inline int cpu_usable(int cpu)
+{
+    /* CPU 0 takes tasks before scheduler_start(); APs once they run */
+    return cpu == 0 || cpu_rqs[cpu].current != 0;
+}
+
+static inline int cpu_allowed(task_t *t, int cpu)
+{
+    return ((t->affinity >> cpu) & 1) && cpu_usable(cpu);
+}
+
+static uint32_t cpu_load(int cpu)
+{
+    cpu_rq_t *rq = &cpu_rqs[cpu];
+    return rq->nr_ready + (rq->current && rq->current != rq->idle);
+}
+
+/* least loaded CPU t may use, preferring the caller's on a tie */
+static int pick_cpu(task_t *t)
+{
+    int self = smp_cpu_id();
+    int best = cpu_allowed(t, self) ? self : -1;
+
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!cpu_allowed(t, cpu))
+            continue;
+        if (best < 0 || cpu_load(cpu) < cpu_load(best))
+            best = cpu;
+    }
+    return best < 0 ? 0 : best;
+}
+
+static void resched_cpu(int cpu)
+{
+    cpu_rqs[cpu].need_resched = 1;
+    if (cpu != smp_cpu_id())
+        smp_send_resched(cpu);
+}
+
+/* Queue t on a CPU: the one it last ran on if still allowed (warm cache),
+ * otherwise the least loaded. If that CPU is busy with something at least
+ * as important, an idle CPU is poked so it can steal t.
+ */
+static void task_enqueue(task_t *t, int fresh)
+{
+    if (fresh || !cpu_allowed(t, t->cpu))
+        t->cpu = pick_cpu(t);
+    rq_push(t);
+
+    cpu_rq_t *rq = &cpu_rqs[t->cpu];
+    if (!rq->current)
+        return;
+
+    if (t->priority < rq->current->priority) {
+        resched_cpu(t->cpu);
+        return;
+    }
+
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu != t->cpu && cpu_allowed(t, cpu) &&
+            cpu_rqs[cpu].current == cpu_rqs[cpu].idle) {
+            resched_cpu(cpu);
+            return;
+        }
+    }
+}
+
+/* take the first task another CPU has queued that may run on cpu */
+static task_t *rq_steal(int cpu)
+{
+    for (int i = 1; i < SMP_MAX_CPUS; i++) {
+        int victim = (cpu + i) & (SMP_MAX_CPUS - 1);
+        cpu_rq_t *vq = &cpu_rqs[victim];
+        uint32_t mask = vq->ready_mask & ~IDLE_BIT;
+
+        while (mask) {
+            int prio = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            for (task_t *t = vq->queues[prio].head; t; t = t->rq_next) {
+                if (!((t->affinity >> cpu) & 1))
+                    continue;
+
+                rq_remove(t);
+                t->cpu = cpu;
+                cpu_rqs[cpu].steals++;
+                return t;
+            }
+        }
+    }
+    return 0;
+}
+
+/* can rq_steal() find anything for this CPU? */
+static int remote_work(int cpu)
+{
+    for (int other = 0; other < SMP_MAX_CPUS; other++) {
+        if (other != cpu && (cpu_rqs[other].ready_mask & ~IDLE_BIT))
+            return 1;
+    }
+    return 0;
+}
+
+static task_t *rq_pick(int cpu)
+{
+    cpu_rq_t *rq = &cpu_rqs[cpu];
+    uint32_t busy = rq->ready_mask & ~IDLE_BIT;
+    task_t *t;
+
+    /* own work first, then someone else's, then idle */
+    if (busy)
+        t = rq->queues[__builtin_ctz(busy)].head;
+    else if ((t = rq_steal(cpu)) != 0)
+        return t;
+    else if (rq->ready_mask)
+        t = rq->queues[TASK_PRIO_IDLE].head;
+    else
+        return 0;
+
+    rq_remove(t);
+    return t;
+}
+
+/* address space and ring-0 stack (TSS.esp0) follow the running task */
+static void task_activate(task_t *t)
+{
+    paging_switch_space(t->space);
+    tss_set_kernel_stack((uint32_t)t->stack_base + t->stack_size);
+}
+
+/*
+ * Switch this CPU to the next task. Called with sched_lock held and
+ * interrupts off; returns, still holding it, when the caller runs again,
+ * possibly on another CPU.
+ */
+static void schedule(void)
+{
+    int cpu = smp_cpu_id();
+    cpu_rq_t *rq = &cpu_rqs[cpu];
+    task_t *old = rq->current;
+
+    rq->need_resched = 0;
+
+    /* a running task goes to the back of its class; a blocked one
+     * stays off the queues until it is woken */
+    if (old->state == TASK_RUNNING) {
+        if (cpu_allowed(old, cpu))
+            rq_push(old);
+        else
+            task_enqueue(old, 1);
+    }
+
+    task_t *new = rq_pick(cpu);
+    if (!new)
+        new = old;
+
+    new->state      = TASK_RUNNING;
+    new->slice_left = new->slice_ticks;
+    if (new != old) {
+        rq->current = new;
+        rq->switches++;
+        new->switches++;
+        new->cpu = cpu;
+        task_activate(new);
+        fpu_switch(old, new);
+
+        /* the big kernel lock is not held across a switch */
+        int depth = bkl_release_all();
+        if (depth)
+            old->bkl_depth = depth;
+
+        switch_stack(&old->kernel_esp, new->kernel_esp);
+    }
+}
+
+/* Called by task_trampoline before a new task's entry function, still
+ * holding the lock of the schedule() that switched to it.
+ */
+void task_started(void)
+{
+    sched_finish(0);
+}
+
+/* ---------------- blocking ---------------- */
+
+/* exited tasks the reaper has not processed yet, linked via rq_next */
+static task_t       *zombies     = 0;
+static wait_queue_t  reaper_wait = WAIT_QUEUE_INIT;
+
+static void wq_append(wait_queue_t *wq, task_t *t)
+{
+    t->wq      = wq;
+    t->rq_next = 0;
+    t->rq_prev = wq->tail;
+    if (wq->tail)
+        wq->tail->rq_next = t;
+    else
+        wq->head = t;
+    wq->tail = t;
+}
+
+static void wq_remove(task_t *t)
+{
+    wait_queue_t *wq = t->wq;
+
+    if (t->rq_prev) t->rq_prev->rq_next = t->rq_next;
+    else            wq->head            = t->rq_next;
+    if (t->rq_next) t->rq_next->rq_prev = t->rq_prev;
+    else            wq->tail            = t->rq_prev;
+
+    t->rq_next = t->rq_prev = 0;
+    t->wq = 0;
+}
+
+/* blocked -> ready; called with sched_lock held */
+static void task_wake(task_t *t)
+{
+    if (t->state != TASK_BLOCKED)
+        return;
+
+    if (t->wq)
+        wq_remove(t);
+    t->sleep_armed = 0;
+    timer_cancel(&t->sleep_timer);
+
+    task_enqueue(t, 0);
+}
+
+/* The wheel runs this without its lock, so the task may have been woken
+ * (and even be waiting again) by the time sched_lock is ours: only a
+ * timeout still armed and no longer on the wheel is this one.
+ */
+static void sleep_expired(void *arg)
+{
+    task_t *t = arg;
+    uint32_t flags = sched_lock_irqsave();
+
+    if (t->sleep_armed && !timer_pending(&t->sleep_timer)) {
+        t->timed_out = 1;
+        task_wake(t);
+    }
+
+    sched_unlock_irqrestore(flags);
+}
+
+/* block the current task on wq with sched_lock held; held again on return */
+static void wait_locked(wait_queue_t *wq)
+{
+    task_t *t = this_rq()->current;
+
+    if (wq)
+        wq_append(wq, t);
+    t->state = TASK_BLOCKED;
+    schedule();
+}
+
+/* ---------------- exit and reaping ---------------- */
+
+static void task_unlink(task_t *t)
+{
+    task_t *prev = 0;
+
+    for (task_t *p = task_head; p; prev = p, p = p->next) {
+        if (p != t)
+            continue;
+
+        if (prev) prev->next = t->next;
+        else      task_head  = t->next;
+        if (task_tail == t)
+            task_tail = prev;
+        return;
+    }
+}
+
+/* the zombie is off the CPU for good: give back what it held */
+static void task_release(task_t *t)
+{
+    kstack_free(t->stack_base, t->stack_size);
+    t->stack_base = 0;
+
+    fpu_release(t);
+    fs_task_release(t);
+
+    if (t->space != paging_kernel_space()) {
+        paging_destroy_space(t->space);
+        t->space = paging_kernel_space();
+    }
+}
+
+static void reaper_entry(void)
+{
+    for (;;) {
+        uint32_t flags = sched_lock_irqsave();
+
+        while (!zombies)
+            wait_locked(&reaper_wait);
+
+        task_t *t = zombies;
+        zombies = t->rq_next;
+        t->rq_next = 0;
+
+        sched_finish(flags);
+
+        task_release(t);
+
+        flags = sched_lock_irqsave();
+        t->reaped = 1;
+        if (t->detached) {
+            task_unlink(t);
+            sched_unlock_irqrestore(flags);
+            kfree(t);
+            continue;
+        }
+        sched_unlock_irqrestore(flags);
+    }
+}
+
+void task_exit(int code)
+{
+    task_t *t = task_current();
+
+    log_event("[SCHED] task exited.");
+    log_event(t->name);
+
+    (void)sched_lock_irqsave();
+
+    t->exit_code = code;
+    t->state     = TASK_ZOMBIE;
+
+    t->rq_next = zombies;
+    zombies = t;
+    if (reaper_wait.head)
+        task_wake(reaper_wait.head);
+    while (t->joiners.head)
+        task_wake(t->joiners.head);
+
+    /* a zombie is never queued again, so this does not come back */
+    schedule();
+    for (;;)
+        __asm__ volatile("hlt");
+}
+
+int task_join(task_t *t, int *code)
+{
+    if (!t || t == task_current() || t->detached || !task_can_block())
+        return -1;
+
+    uint32_t flags = sched_lock_irqsave();
+
+    while (t->state != TASK_ZOMBIE)
+        wait_locked(&t->joiners);
+
+    if (code)
+        *code = t->exit_code;
+
+    /* collected: whoever gets there last frees the task_t */
+    t->detached = 1;
+    int free_now = t->reaped;
+    if (free_now)
+        task_unlink(t);
+
+    sched_finish(flags);
+
+    if (free_now)
+        kfree(t);
+    return 0;
+}
+
+void task_detach(task_t *t)
+{
+    if (!t)
+        return;
+
+    uint32_t flags = sched_lock_irqsave();
+
+    int free_now = (t->state == TASK_ZOMBIE && t->reaped && !t->detached);
+    t->detached = 1;
+    if (free_now)
+        task_unlink(t);
+
+    sched_unlock_irqrestore(flags);
+
+    if (free_now)
+        kfree(t);
+}
+
+/* Runs with nothing else ready. On the BSP the PIT is switched to
+ * one-shot until the next kernel timer, so an idle system is not woken
+ * by every tick; APs just halt until their next LAPIC tick or IPI.
+ */
+static void idle_entry(void)
+{
+    int bsp = smp_cpu_id() == 0;
+
+    for (;;) {
+        __asm__ volatile("cli");
+        if (bsp)
+            timer_idle_enter();
+        __asm__ volatile("sti; hlt");
+        if (bsp)
+            timer_idle_exit();
+    }
+}
+
 void task_init(void)
 {
-    current   = 0;
     task_head = 0;
+    task_tail = 0;
     next_id   = 1;
+
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        cpu_rqs[cpu] = (cpu_rq_t){0};
+
+    zombies     = 0;
+    reaper_wait = (wait_queue_t)WAIT_QUEUE_INIT;
+
+    kstack_init();
+
     log_event("[SCHED] task subsystem initialized.");
 }
 
-static void task_append(task_t *t)
+static void task_list_add(task_t *t)
 {
-    if (!task_head) {
+    t->next = 0;
+    if (task_tail)
+        task_tail->next = t;
+    else
         task_head = t;
-        t->next   = t;
-        return;
-    }
+    task_tail = t;
+}
+
+/* make a fully set up task visible and runnable */
+static void task_start(task_t *t)
+{
+    uint32_t flags = sched_lock_irqsave();
 
-    task_t *p = task_head;
-    while (p->next != task_head)
-        p = p->next;
+    task_list_add(t);
+    task_enqueue(t, 1);
 
-    p->next = t;
-    t->next = task_head;
+    sched_unlock_irqrestore(flags);
 }
 
-task_t *task_create(void (*entry)(void), const char *name)
+static task_t *task_alloc(void (*entry)(void), const char *name,
+                          uint32_t stack_size)
 {
-    const uint32_t STACK_SIZE = 4096;
 
     task_t *t = kmalloc(sizeof(task_t));
     if (!t) {
@@ -45,38 +593,85 @@ task_t *task_create(void (*entry)(void), const char *name)
         return 0;
     }
 
-    uint8_t *stack = kmalloc(STACK_SIZE);
+    /* guarded stack from the pool, rounded up to whole pages */
+    stack_size = (stack_size + 0xFFF) & ~0xFFFu;
+    uint8_t *stack = kstack_alloc(stack_size);
     if (!stack) {
-        console_write("task_create: kmalloc stack failed\n");
-        log_event("[SCHED] task_create: kmalloc stack FAILED.");
+        console_write("task_create: kstack_alloc failed\n");
+        log_event("[SCHED] task_create: kstack_alloc FAILED.");
+        kfree(t);
         return 0;
     }
 
-    uint32_t top = (uint32_t)stack + STACK_SIZE;
+    uint32_t top = (uint32_t)stack + stack_size;
 
-    // Clear context
-    for (int i = 0; i < (int)(sizeof(cpu_state_t) / 4); i++)
-        ((uint32_t*)&t->regs)[i] = 0;
+    /* initial frame for switch_stack: edi, esi, ebx, ebp, return
+     * address; task_trampoline enables interrupts and calls ebx */
+    uint32_t *sp = (uint32_t*)top;
+    *--sp = (uint32_t)task_trampoline;
+    *--sp = 0;                  /* ebp */
+    *--sp = (uint32_t)entry;    /* ebx */
+    *--sp = 0;                  /* esi */
+    *--sp = 0;                  /* edi */
+    t->kernel_esp = (uint32_t)sp;
 
-    t->regs.eip    = (uint32_t)entry;
-    t->regs.esp    = top;
-    t->regs.ebp    = top;
-    t->regs.eflags = 0x202;
+    t->stack_base = stack;
+    t->stack_size = stack_size;
 
-    t->regs.cs = 0x08;
-    t->regs.ds = 0x10;
-    t->regs.es = 0x10;
-    t->regs.fs = 0x10;
-    t->regs.gs = 0x10;
-    t->regs.ss = 0x10;
+    t->slice_ticks = TASK_DEFAULT_SLICE;
+    t->slice_left  = TASK_DEFAULT_SLICE;
+    t->cpu_ticks   = 0;
+    t->switches    = 0;
 
-    t->stack_base = stack;
-    t->stack_size = STACK_SIZE;
+    t->space    = paging_kernel_space();
+    t->user_eip = 0;
+    t->user_esp = 0;
+
+    t->fpu_state = 0;
+    t->fd_table  = 0;
+
+    t->syscalls   = 0;
+    t->heap_bytes = 0;
+
+    t->exit_code      = 0;
+    t->detached       = 0;
+    t->reaped         = 0;
+    t->joiners.head   = 0;
+    t->joiners.tail   = 0;
+
+    /* kernel threads run under the big kernel lock, on the BSP unless
+     * told otherwise */
+    t->priority  = TASK_PRIO_BATCH;
+    t->state     = TASK_READY;
+    t->cpu       = smp_cpu_id();
+    t->affinity  = 1u;
+    t->bkl_depth = 1;
+    t->rq_next   = 0;
+    t->rq_prev   = 0;
+    t->wq        = 0;
+
+    timer_init(&t->sleep_timer, sleep_expired, t);
+    t->sleep_armed = 0;
+    t->timed_out = 0;
 
     t->name = name;
     t->id   = next_id++;
+    return t;
+}
 
-    task_append(t);
+task_t *task_create(void (*entry)(void), const char *name)
+{
+    return task_create_stack(entry, name, TASK_STACK_SIZE);
+}
+
+task_t *task_create_stack(void (*entry)(void), const char *name,
+                          uint32_t stack_size)
+{
+    task_t *t = task_alloc(entry, name, stack_size);
+    if (!t)
+        return 0;
+
+    task_start(t);
 
     // console_write("Task created: ");
     // console_write(name);
@@ -89,20 +684,339 @@ task_t *task_create(void (*entry)(void), const char *name)
     return t;
 }
 
+/* first code a user task runs, still in ring 0 on its kernel stack */
+static void user_task_start(void)
+{
+    task_t *t = task_current();
+    enter_user_mode(t->user_eip, t->user_esp);
+}
+
+task_t *task_create_user(addr_space_t *space, uint32_t eip, uint32_t esp,
+                         const char *name)
+{
+    task_t *t = task_alloc(user_task_start, name, TASK_STACK_SIZE);
+    if (!t)
+        return 0;
+
+    /* fill in the user context before the task can be picked; ring 3
+     * code may run on any CPU and only locks the kernel on entry */
+    t->space     = space;
+    t->user_eip  = eip;
+    t->user_esp  = esp;
+    t->affinity  = SMP_ALL_CPUS;
+    t->bkl_depth = 0;
+    task_start(t);
+
+    log_event("[SCHED] user task created.");
+    log_event(name);
+    return t;
+}
+
 void task_yield(void)
 {
-    if (!current || current->next == current)
+    uint32_t flags = irq_save();
+    cpu_rq_t *rq = this_rq();
+
+    if (!rq->current) {
+        irq_restore(flags);
         return;
+    }
+
+    /* leaving idle early: catch the tick count up first */
+    if (rq->current == rq->idle && rq == &cpu_rqs[0])
+        timer_idle_exit();
+
+    spin_lock(&sched_lock);
+    schedule();
+    sched_finish(flags);
+}
+
+void task_set_slice(task_t *t, uint32_t ticks)
+{
+    if (t)
+        t->slice_ticks = ticks ? ticks : 1;
+}
+
+void task_set_priority(task_t *t, int priority)
+{
+    if (!t || priority < 0 || priority >= TASK_NUM_PRIOS)
+        return;
+
+    uint32_t flags = sched_lock_irqsave();
+
+    if (t->state == TASK_READY) {
+        rq_remove(t);
+        t->priority = priority;
+        rq_push(t);
+    } else {
+        t->priority = priority;
+    }
+
+    /* someone more important than current may be waiting now */
+    cpu_rq_t *rq = &cpu_rqs[t->cpu];
+    if (rq->current && (rq->ready_mask & ((1u << rq->current->priority) - 1)))
+        resched_cpu(t->cpu);
+
+    sched_unlock_irqrestore(flags);
+}
+
+int task_set_affinity(task_t *t, uint32_t mask)
+{
+    mask &= smp_online_mask();
+    if (!t || !mask)
+        return -1;
+
+    uint32_t flags = sched_lock_irqsave();
+
+    t->affinity = mask;
+    if (!((mask >> t->cpu) & 1)) {
+        /* queued on a CPU it may no longer use: move it now; a running
+         * task moves when it is next switched out */
+        if (t->state == TASK_READY) {
+            rq_remove(t);
+            task_enqueue(t, 1);
+        } else if (t->state == TASK_RUNNING) {
+            resched_cpu(t->cpu);
+        }
+    }
+
+    sched_unlock_irqrestore(flags);
+    return 0;
+}
+
+task_t *task_current(void)
+{
+    /* no migration between reading the CPU id and its current task */
+    uint32_t flags = irq_save();
+    task_t *t = this_rq()->current;
+    irq_restore(flags);
+    return t;
+}
+
+int task_snapshot(task_info_t *out, int max)
+{
+    int n = 0;
+    uint32_t flags = sched_lock_irqsave();
+
+    for (task_t *t = task_head; t && n < max; t = t->next, n++) {
+        out[n].id         = t->id;
+        out[n].name       = t->name;
+        out[n].state      = t->state;
+        out[n].priority   = t->priority;
+        out[n].cpu_ticks  = t->cpu_ticks;
+        out[n].switches   = t->switches;
+        out[n].syscalls   = t->syscalls;
+        out[n].heap_bytes = t->heap_bytes;
+        out[n].stack_size = t->stack_base ? t->stack_size : 0;
+        out[n].cpu        = t->cpu;
+    }
+
+    sched_unlock_irqrestore(flags);
+    return n;
+}
+
+int task_cpu_snapshot(cpu_info_t *out, int max)
+{
+    int n = 0;
+    uint32_t flags = sched_lock_irqsave();
+
+    for (int cpu = 0; cpu < SMP_MAX_CPUS && n < max; cpu++) {
+        cpu_rq_t *rq = &cpu_rqs[cpu];
+        if (!smp_cpu_online(cpu))
+            continue;
+
+        out[n].cpu        = cpu;
+        out[n].current    = rq->current ? rq->current->name : 0;
+        out[n].nr_ready   = rq->nr_ready;
+        out[n].ticks      = rq->ticks;
+        out[n].idle_ticks = rq->idle_ticks;
+        out[n].switches   = rq->switches;
+        out[n].steals     = rq->steals;
+        n++;
+    }
+
+    sched_unlock_irqrestore(flags);
+    return n;
+}
+
+void task_charge_heap(int32_t bytes)
+{
+    /* interrupt handlers would bill whoever they happened to interrupt */
+    task_t *t = task_current();
+    if (t && !irq_in_handler())
+        t->heap_bytes += bytes;
+}
+
+void task_count_syscall(void)
+{
+    task_t *t = task_current();
+    if (t)
+        t->syscalls++;
+}
+
+int task_can_block(void)
+{
+    uint32_t flags = irq_save();
+    cpu_rq_t *rq = this_rq();
+    int ok = rq->current && rq->current != rq->idle && !irq_in_handler();
+    irq_restore(flags);
+    return ok;
+}
+
+int task_wait(wait_queue_t *wq, uint32_t timeout)
+{
+    uint32_t flags = sched_lock_irqsave();
+    task_t *t = this_rq()->current;
+
+    t->timed_out = 0;
+    if (timeout) {
+        t->sleep_armed = 1;
+        timer_add(&t->sleep_timer, timeout, 0);
+    }
+
+    /* a sleeping BSP may have its one-shot set past this timeout */
+    if (timeout && smp_cpu_id() != 0 && cpu_rqs[0].current == cpu_rqs[0].idle)
+        resched_cpu(0);
+
+    wait_locked(wq);
+    sched_finish(flags);
+    return !t->timed_out;
+}
+
+void task_wait_spinlock(wait_queue_t *wq, spinlock_t *lock)
+{
+    spin_lock(&sched_lock);
+    spin_unlock(lock);
+
+    wait_locked(wq);
+
+    sched_finish(0);
+    spin_lock(lock);
+}
+
+void task_wake_one(wait_queue_t *wq)
+{
+    uint32_t flags = sched_lock_irqsave();
+
+    if (wq->head)
+        task_wake(wq->head);
+
+    sched_unlock_irqrestore(flags);
+}
+
+void task_wake_all(wait_queue_t *wq)
+{
+    uint32_t flags = sched_lock_irqsave();
+
+    while (wq->head)
+        task_wake(wq->head);
+
+    sched_unlock_irqrestore(flags);
+}
+
+void task_sleep(uint32_t ticks)
+{
+    if (ticks == 0)
+        task_yield();
+    else
+        task_wait(0, ticks);
+}
+
+void task_tick(void)
+{
+    uint32_t flags = sched_lock_irqsave();
+    int cpu = smp_cpu_id();
+    cpu_rq_t *rq = &cpu_rqs[cpu];
+    task_t *cur = rq->current;
 
-    task_t *old = current;
-    task_t *new = current->next;
-    current = new;
+    if (cur) {
+        rq->ticks++;
+        cur->cpu_ticks++;
 
-    log_event("[SCHED] task_yield() - switching task.");
+        if (cur == rq->idle) {
+            /* an idle CPU also looks for work queued elsewhere */
+            rq->idle_ticks++;
+            if (rq->ready_mask || remote_work(cpu))
+                rq->need_resched = 1;
+        } else {
+            if (cur->slice_left > 0)
+                cur->slice_left--;
 
-    __asm__ volatile("cli");
-    switch_task(&old->regs, &new->regs);
-    __asm__ volatile("sti");
+            /* nobody to share the CPU with: keep running on a fresh slice */
+            if (cur->slice_left == 0) {
+                if (rq_has_peer(rq))
+                    rq->need_resched = 1;
+                else
+                    cur->slice_left = cur->slice_ticks;
+            }
+        }
+    }
+
+    sched_unlock_irqrestore(flags);
+}
+
+void task_preempt(void)
+{
+    if (this_rq()->need_resched)
+        task_yield();
+}
+
+/* switch from a boot stack that is never returned to */
+static void __attribute__((noreturn)) scheduler_enter(int cpu)
+{
+    (void)sched_lock_irqsave();
+
+    cpu_rq_t *rq = &cpu_rqs[cpu];
+    task_t *first = rq_pick(cpu);
+
+    if (!first) {
+        console_write("scheduler_start: nothing to run!\n");
+        log_event("[SCHED] scheduler_start: no runnable task (HALT).");
+        for (;;) __asm__("cli; hlt");
+    }
+
+    first->state      = TASK_RUNNING;
+    first->slice_left = first->slice_ticks;
+    first->switches++;
+    first->cpu  = cpu;
+    rq->current = first;
+    rq->switches++;
+
+    log_event("[SCHED] scheduler_start: starting with first task.");
+    log_event(first->name);
+
+    task_activate(first);
+    fpu_switch(0, first);
+
+    uint32_t boot_esp;
+    switch_stack(&boot_esp, first->kernel_esp);
+
+    console_write("scheduler_start: returned unexpectedly!\n");
+    log_event("[SCHED] scheduler_start returned unexpectedly (BUG).");
+    for (;;) __asm__("hlt");
+}
+
+/* runs only when every other task is blocked, so the run queue is never
+ * empty and the CPU sleeps in hlt instead of spinning */
+static task_t *idle_create(int cpu)
+{
+    task_t *idle = task_alloc(idle_entry, "idle", TASK_IDLE_STACK_SIZE);
+    if (!idle)
+        return 0;
+
+    idle->priority  = TASK_PRIO_IDLE;
+    idle->cpu       = cpu;
+    idle->affinity  = 1u << cpu;
+    idle->bkl_depth = 0;
+
+    /* straight onto its own queue: the CPU may not be scheduling yet */
+    uint32_t flags = sched_lock_irqsave();
+    cpu_rqs[cpu].idle = idle;
+    task_list_add(idle);
+    rq_push(idle);
+    sched_unlock_irqrestore(flags);
+
+    return idle;
 }
 
 void scheduler_start(void)
@@ -113,18 +1027,32 @@ void scheduler_start(void)
         for (;;) __asm__("hlt");
     }
 
-    current = task_head;
+    idle_create(0);
 
-    // console_write("Starting scheduler with task: ");
-    // console_write(current->name);
-    // console_write("\n");
+    /* frees what exited tasks leave behind, as soon as they are off CPU */
+    task_t *reaper = task_create_stack(reaper_entry, "reaper", TASK_IDLE_STACK_SIZE);
+    task_set_priority(reaper, TASK_PRIO_BOTTOM_HALF);
+    task_detach(reaper);
 
-    log_event("[SCHED] scheduler_start: starting with first task.");
-    log_event(current->name);
+    scheduler_enter(0);
+}
 
-    start_task(current->regs.esp, current->regs.eip);
+void scheduler_start_ap(void)
+{
+    int cpu = smp_cpu_id();
 
-    console_write("scheduler_start: returned unexpectedly!\n");
-    log_event("[SCHED] scheduler_start returned unexpectedly (BUG).");
-    for (;;) __asm__("hlt");
+    /* the BSP's scheduler goes first */
+    while (!cpu_rqs[0].current)
+        cpu_relax();
+
+    bkl_lock();
+    task_t *idle = idle_create(cpu);
+    bkl_unlock();
+
+    if (!idle) {
+        console_write("scheduler_start_ap: no idle task, CPU parked\n");
+        for (;;) __asm__ volatile("cli; hlt");
+    }
+
+    scheduler_enter(cpu);
 }
@@ -1,8 +1,11 @@
 #pragma once
 #include <stdint.h>
+#include "arch/i386/mm/paging.h"
+#include "sched/timer_wheel.h"
 
 
-// (GP registers + segment registers + EFLAGS + EIP)
+// Full register file (GP registers + segment registers + EFLAGS + EIP),
+// as saved by the legacy switch_task; tasks themselves only keep an esp.
 
 typedef struct cpu_state {
     uint32_t eax;     
@@ -23,18 +26,173 @@ typedef struct cpu_state {
     uint32_t ss;       
 } cpu_state_t;
 
+/* Priority classes, highest first. The scheduler always runs a task from
+ * the highest non-empty class; tasks in one class share it round-robin.
+ */
+enum {
+    TASK_PRIO_BOTTOM_HALF = 0,   /* deferred interrupt work */
+    TASK_PRIO_INTERACTIVE = 1,   /* shell, anything a user waits on */
+    TASK_PRIO_BATCH       = 2,   /* default: background and user programs */
+    TASK_PRIO_IDLE        = 3,
+    TASK_NUM_PRIOS
+};
+
+enum {
+    TASK_READY,                  /* in a run queue */
+    TASK_RUNNING,
+    TASK_BLOCKED,                /* on a wait queue and/or a sleep timer */
+    TASK_ZOMBIE,                 /* exited, waiting for the reaper/join */
+};
+
+struct task;
+struct spinlock;
+
+/* Tasks blocked on some event, woken in FIFO order */
+typedef struct wait_queue {
+    struct task *head;
+    struct task *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT  { 0, 0 }
+
 typedef struct task {
-    cpu_state_t regs;
+    uint32_t kernel_esp;    /* saved by switch_stack while switched out */
 
     uint8_t *stack_base;
     uint32_t stack_size;
 
-    struct task *next;
+    uint32_t slice_ticks;   /* time slice, in timer ticks */
+    uint32_t slice_left;
+    uint32_t cpu_ticks;     /* ticks this task was running */
+    uint32_t switches;      /* times it was switched in */
+    uint32_t syscalls;      /* int 0x80 calls made */
+    int32_t  heap_bytes;    /* kmalloc'd minus kfree'd, in task context */
+
+    addr_space_t *space;    /* kernel space for kernel threads */
+    uint32_t user_eip;      /* ring-3 entry, 0 for kernel threads */
+    uint32_t user_esp;
+
+    void *fpu_state;        /* FXSAVE/FSAVE area, allocated on first use */
+    void *fd_table;         /* open files (fs.c), allocated on first open */
+
+    int priority;
+    int state;
+    int cpu;                /* CPU it runs or last ran on */
+    uint32_t affinity;      /* CPUs it may run on, bit n = CPU n */
+    int bkl_depth;          /* big kernel lock held when switched out */
+    struct task *rq_next;   /* run queue or wait queue links */
+    struct task *rq_prev;
+    struct wait_queue *wq;  /* queue this task is blocked on */
+
+    ktimer_t sleep_timer;   /* task_wait() timeout */
+    int sleep_armed;        /* ... not yet expired or woken early */
+    int timed_out;
+
+    int exit_code;
+    int detached;           /* nobody will join: reaper frees everything */
+    int reaped;             /* stack and space already released */
+    wait_queue_t joiners;
+
+    struct task *next;      /* all tasks, in creation order */
     const char *name;
     int id;
 } task_t;
 
+#define TASK_DEFAULT_SLICE  5   /* 50ms at 100Hz */
+
+/* Kernel stack sizes; any multiple of 4KB up to KSTACK_MAX_SIZE works
+ * with task_create_stack(). Each stack sits above unmapped guard pages.
+ */
+#define TASK_STACK_SIZE       8192
+#define TASK_IDLE_STACK_SIZE  4096
+
 void task_init(void);
 task_t *task_create(void (*entry)(void), const char *name);
+task_t *task_create_stack(void (*entry)(void), const char *name,
+                          uint32_t stack_size);
+/* Task that enters ring 3 at eip/esp inside its own address space */
+task_t *task_create_user(addr_space_t *space, uint32_t eip, uint32_t esp,
+                         const char *name);
 void task_yield(void);
+
+/* End the current task (also what returning from the entry function does).
+ * A reaper task frees its stack, FPU area and address space. The task_t
+ * stays as a zombie until task_join() collects the exit code, or is freed
+ * right away for detached tasks.
+ */
+void task_exit(int code) __attribute__((noreturn));
+int  task_join(task_t *t, int *code);     /* 0, or -1 if not joinable */
+void task_detach(task_t *t);
+
+void task_set_slice(task_t *t, uint32_t ticks);
+void task_set_priority(task_t *t, int priority);
+task_t *task_current(void);
+
+/* Restrict t to the CPUs in mask (bit n = CPU n). Kernel threads start on
+ * CPU 0 only, user tasks on every CPU. -1 if no online CPU is left.
+ */
+int task_set_affinity(task_t *t, uint32_t mask);
+
+/* Nonzero when the caller may sleep: the scheduler is running and we are
+ * not inside an interrupt handler.
+ */
+int task_can_block(void);
+
+/* Block the current task on wq (may be NULL) for at most timeout ticks
+ * (0 = no timeout). Returns 1 when woken, 0 on timeout. To avoid a lost
+ * wakeup, check the condition and call this with interrupts disabled; they
+ * are disabled again when it returns.
+ */
+int  task_wait(wait_queue_t *wq, uint32_t timeout);
+/* Block on wq until woken, for callers that check their condition under
+ * a spinlock: lock is dropped only once the task is on wq and is taken
+ * again before returning, so a waker that holds lock cannot be missed.
+ * Call with lock held and interrupts off.
+ */
+void task_wait_spinlock(wait_queue_t *wq, struct spinlock *lock);
+void task_wake_one(wait_queue_t *wq);
+void task_wake_all(wait_queue_t *wq);
+void task_sleep(uint32_t ticks);
+
+/* Snapshot of the task table for ps/top */
+typedef struct task_info {
+    int         id;
+    const char *name;
+    int         state;
+    int         priority;
+    uint32_t    cpu_ticks;
+    uint32_t    switches;
+    uint32_t    syscalls;
+    int32_t     heap_bytes;
+    uint32_t    stack_size;
+    int         cpu;
+} task_info_t;
+
+int task_snapshot(task_info_t *out, int max);   /* entries filled */
+
+/* Per-CPU scheduler counters */
+typedef struct cpu_info {
+    int         cpu;
+    const char *current;    /* running task, NULL if not scheduling yet */
+    uint32_t    nr_ready;   /* queued, idle task not counted */
+    uint32_t    ticks;      /* timer ticks seen */
+    uint32_t    idle_ticks; /* ... spent in the idle task */
+    uint32_t    switches;
+    uint32_t    steals;     /* tasks pulled off another CPU's queue */
+} cpu_info_t;
+
+int task_cpu_snapshot(cpu_info_t *out, int max);
+
+/* Per-task accounting hooks (no-ops outside task context) */
+void task_charge_heap(int32_t bytes);
+void task_count_syscall(void);
+
+/* Timer interrupt: account the tick, request a switch when the slice is
+ * used up. task_preempt() performs it at the end of the interrupt. Each
+ * CPU ticks its own current task (PIT on the BSP, LAPIC timer on APs).
+ */
+void task_tick(void);
+void task_preempt(void);
 void scheduler_start(void);
+/* An AP joins the scheduler once the BSP has started it; no return */
+void scheduler_start_ap(void) __attribute__((noreturn));
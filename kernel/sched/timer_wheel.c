@@ -0,0 +1,225 @@
+#include "sched/timer_wheel.h"
+#include "sched/spinlock.h"
+
+/*
+ * Four levels, as in the classic Unix callout wheel: 256 one-tick slots,
+ * then three levels of 64 slots, each slot covering 64 times the span of
+ * the level below (2^26 ticks, about a week at 100Hz, in total).
+ *
+ * A timer is hashed into the level whose span contains its distance from
+ * the wheel's cursor. Only level 0 is ever scanned; whenever its index
+ * wraps, the next slot of level 1 is emptied back into the wheel (and so
+ * on upward), so every timer is moved at most three times before it runs.
+ */
+#define TVR_BITS   8
+#define TVN_BITS   6
+#define TVR_SIZE   (1u << TVR_BITS)
+#define TVN_SIZE   (1u << TVN_BITS)
+#define TVR_MASK   (TVR_SIZE - 1)
+#define TVN_MASK   (TVN_SIZE - 1)
+#define TVN_LEVELS 3
+
+#define MAX_DELAY  ((1u << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1)
+
+static ktimer_t *tv1[TVR_SIZE];
+static ktimer_t *tvn[TVN_LEVELS][TVN_SIZE];
+
+static uint32_t            next_tick = 1;  /* first tick not yet run */
+static timer_wheel_stats_t stats;
+
+/* The wheel, every pending timer's links and the stats. Callers may hold
+ * sched_lock (task_wait/task_wake), so callbacks, which take it too, run
+ * with this dropped.
+ */
+static spinlock_t wheel_lock = SPINLOCK_INIT("timers");
+
+static void slot_push(ktimer_t **slot, ktimer_t *t)
+{
+    t->prev = 0;
+    t->next = *slot;
+    if (*slot)
+        (*slot)->prev = t;
+    *slot = t;
+    t->slot = slot;
+}
+
+static void slot_unlink(ktimer_t *t)
+{
+    if (t->prev) t->prev->next = t->next;
+    else         *t->slot      = t->next;
+    if (t->next) t->next->prev = t->prev;
+
+    t->next = t->prev = 0;
+    t->slot = 0;
+}
+
+static void internal_add(ktimer_t *t)
+{
+    uint32_t delta = t->expires - next_tick;
+    ktimer_t **slot;
+
+    if ((int32_t)delta < 0) {
+        /* already due: run on the next pass */
+        slot = &tv1[next_tick & TVR_MASK];
+    } else if (delta < TVR_SIZE) {
+        slot = &tv1[t->expires & TVR_MASK];
+    } else {
+        if (delta > MAX_DELAY) {
+            t->expires = next_tick + MAX_DELAY;
+            delta = MAX_DELAY;
+        }
+
+        int level = 0;
+        while (level < TVN_LEVELS - 1 &&
+               delta >= (1u << (TVR_BITS + (level + 1) * TVN_BITS)))
+            level++;
+
+        uint32_t idx = (t->expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+        slot = &tvn[level][idx];
+    }
+
+    slot_push(slot, t);
+}
+
+/* re-hash every timer in tvn[level][idx]; returns idx so the caller
+ * knows whether this level wrapped too */
+static uint32_t cascade(int level, uint32_t idx)
+{
+    ktimer_t *t = tvn[level][idx];
+
+    tvn[level][idx] = 0;
+    while (t) {
+        ktimer_t *next = t->next;
+
+        /* slot stays set: the timer is pending throughout */
+        t->next = t->prev = 0;
+        internal_add(t);
+        stats.cascaded++;
+        t = next;
+    }
+    return idx;
+}
+
+void timer_wheel_init(void)
+{
+    for (uint32_t i = 0; i < TVR_SIZE; i++)
+        tv1[i] = 0;
+    for (int l = 0; l < TVN_LEVELS; l++)
+        for (uint32_t i = 0; i < TVN_SIZE; i++)
+            tvn[l][i] = 0;
+
+    next_tick = 1;
+    stats = (timer_wheel_stats_t){0};
+}
+
+void timer_init(ktimer_t *t, ktimer_fn_t fn, void *arg)
+{
+    t->next    = 0;
+    t->prev    = 0;
+    t->slot    = 0;
+    t->expires = 0;
+    t->period  = 0;
+    t->fn      = fn;
+    t->arg     = arg;
+}
+
+void timer_add(ktimer_t *t, uint32_t delay, uint32_t period)
+{
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+
+    if (t->slot)
+        slot_unlink(t);
+    else
+        stats.pending++;
+
+    /* next_tick - 1 is the last tick that has run */
+    t->expires = next_tick - 1 + (delay ? delay : 1);
+    t->period  = period;
+    internal_add(t);
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+int timer_cancel(ktimer_t *t)
+{
+    int was_pending = 0;
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+
+    if (t->slot) {
+        slot_unlink(t);
+        stats.pending--;
+        was_pending = 1;
+    }
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return was_pending;
+}
+
+void timer_wheel_run(uint32_t now)
+{
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+
+    while ((int32_t)(now - next_tick) >= 0) {
+        uint32_t idx = next_tick & TVR_MASK;
+
+        if (idx == 0) {
+            for (int l = 0; l < TVN_LEVELS; l++) {
+                uint32_t i = (next_tick >> (TVR_BITS + l * TVN_BITS)) & TVN_MASK;
+                if (cascade(l, i) != 0)
+                    break;
+            }
+        }
+        next_tick++;
+
+        /* pop one at a time: a callback may cancel or re-add any timer,
+         * and anything it arms for "now" lands in the next slot */
+        ktimer_t *t;
+        while ((t = tv1[idx]) != 0) {
+            slot_unlink(t);
+
+            if (t->period) {
+                t->expires += t->period;
+                internal_add(t);
+            } else {
+                stats.pending--;
+            }
+
+            stats.fired++;
+            ktimer_fn_t fn = t->fn;
+            void *arg = t->arg;
+
+            spin_unlock(&wheel_lock);
+            fn(arg);
+            spin_lock(&wheel_lock);
+        }
+    }
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+uint32_t timer_wheel_next_due(uint32_t limit)
+{
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    uint32_t n;
+
+    /* level 0 slots only hold timers due within this lap; a wrap is where
+     * outer levels cascade in, so stop there as well */
+    for (n = 0; n < limit; n++) {
+        uint32_t idx = (next_tick + n) & TVR_MASK;
+        if (tv1[idx] || idx == 0)
+            break;
+    }
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return n < limit ? n + 1 : limit;
+}
+
+void timer_wheel_get_stats(timer_wheel_stats_t *out)
+{
+    if (!out)
+        return;
+
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
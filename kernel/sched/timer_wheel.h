@@ -0,0 +1,61 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Kernel timers on a hierarchical timing wheel driven by IRQ0.
+ *
+ * Times are in timer ticks. A timer fires from the timer interrupt, so
+ * callbacks must be short and must not block; they may add or cancel
+ * timers (including their own). Insert and cancel are O(1); expiry costs
+ * O(1) amortized per timer, however many are pending.
+ *
+ * Any CPU may arm or cancel timers; the wheel has its own spinlock, which
+ * is not held while a callback runs.
+ */
+
+typedef void (*ktimer_fn_t)(void *arg);
+
+typedef struct ktimer {
+    struct ktimer  *next;
+    struct ktimer  *prev;
+    struct ktimer **slot;       /* list head we are on, 0 if not pending */
+    uint32_t        expires;    /* absolute tick */
+    uint32_t        period;     /* re-arm interval, 0 = one-shot */
+    ktimer_fn_t     fn;
+    void           *arg;
+} ktimer_t;
+
+typedef struct timer_wheel_stats {
+    uint32_t pending;           /* armed timers                          */
+    uint32_t fired;             /* callbacks run                         */
+    uint32_t cascaded;          /* moves from an outer to an inner level */
+} timer_wheel_stats_t;
+
+void timer_wheel_init(void);
+
+void timer_init(ktimer_t *t, ktimer_fn_t fn, void *arg);
+
+/* Arm t to fire delay ticks from now (0 = next tick), then every period
+ * ticks if period != 0. Re-adding a pending timer moves it.
+ */
+void timer_add(ktimer_t *t, uint32_t delay, uint32_t period);
+
+/* Disarm t; returns 1 if it was pending. 0 does not mean the callback
+ * is over: one the wheel has already taken off may still be about to run.
+ */
+int  timer_cancel(ktimer_t *t);
+
+static inline int timer_pending(const ktimer_t *t)
+{
+    return t->slot != 0;
+}
+
+/* Timer interrupt: run everything due up to and including tick now */
+void timer_wheel_run(uint32_t now);
+
+/* Ticks until the wheel may have work, at most limit: 1 means the next
+ * tick. Used by tickless idle to decide how long to sleep.
+ */
+uint32_t timer_wheel_next_due(uint32_t limit);
+
+void timer_wheel_get_stats(timer_wheel_stats_t *out);
@@ -6,13 +6,37 @@
 #include <stdint.h>
 #include "console.h"
 #include "sched/task.h"
+#include "sched/timer_wheel.h"
+#include "sched/lock.h"
 #include "arch/i386/drivers/keyboard.h"
 #include "arch/i386/drivers/timer.h"
 #include "fs/blockdev.h"
 #include "arch/i386/drivers/ata_pio.h"
+#include "arch/i386/mm/kmalloc.h"
+#include "arch/i386/mm/physmem.h"
+#include "arch/i386/mm/paging.h"
+#include "arch/i386/mm/kstack.h"
+#include "arch/i386/cpu/irq.h"
+#include "arch/i386/cpu/fpu.h"
+#include "arch/i386/cpu/smp.h"
+#include "user/user_process.h"
 
 extern block_device_t *ata_pio_init(void);
-extern block_device_t *blockdev_get_root(void);
+
+/* The fs owns the start of the root device (see df); raw access is
+ * limited to the sectors after it
+ */
+static void disk_sector_error(const char *cmd, uint32_t lba)
+{
+    fs_stats_t st;
+    fs_get_stats(&st);
+
+    console_write(cmd);
+    if (lba < st.total_blocks * (st.block_size / 512))
+        console_write(": sector belongs to the filesystem\n");
+    else
+        console_write(": no such sector, or I/O error\n");
+}
 
 static void cmd_diskread(const char *arg)
 {
@@ -23,15 +47,9 @@ static void cmd_diskread(const char *arg)
         arg++;
     }
 
-    block_device_t *dev = blockdev_get_root();
-    if (!dev) {
-        console_write("diskread: no root block device\n");
-        return;
-    }
-
     uint8_t buf[512];
-    if (dev->read(dev, lba, 1, buf) != 0) {
-        console_write("diskread: read error\n");
+    if (fs_sector_read(lba, buf) != 0) {
+        disk_sector_error("diskread", lba);
         return;
     }
 
@@ -55,12 +73,6 @@ static void cmd_diskwrite(const char *arg)
     }
     while (*arg == ' ') arg++;
 
-    block_device_t *dev = blockdev_get_root();
-    if (!dev) {
-        console_write("diskwrite: no root block device\n");
-        return;
-    }
-
     uint8_t buf[512];
     for (int i = 0; i < 512; ++i) buf[i] = 0;
     int i = 0;
@@ -68,15 +80,14 @@ static void cmd_diskwrite(const char *arg)
         buf[i++] = (uint8_t)*arg++;
     }
 
-    if (dev->write(dev, lba, 1, buf) != 0) {
-        console_write("diskwrite: write error\n");
+    if (fs_sector_write(lba, buf) != 0) {
+        disk_sector_error("diskwrite", lba);
         return;
     }
 
     console_write("diskwrite: wrote sector\n");
 }
 
-extern void switch_to_user_mode(void);
 extern volatile uint32_t timer_ticks;
 
 static uint32_t last_bar_second = 0;
@@ -107,6 +118,25 @@ static void ui_itoa(uint32_t v, char* out) {
     out[j] = 0;
 }
 
+static void shell_write_u32(uint32_t v)
+{
+    char num[16];
+    ui_itoa(v, num);
+    console_write(num);
+}
+
+/* right-align a number in a column of `width` characters */
+static void shell_write_u32_pad(uint32_t v, int width)
+{
+    char num[16];
+    int len = 0;
+    ui_itoa(v, num);
+    while (num[len]) len++;
+    for (int i = len; i < width; i++)
+        console_putc(' ');
+    console_write(num);
+}
+
 static int kstrcmp(const char *a, const char *b)
 {
     while (*a && (*a == *b))
@@ -405,6 +435,7 @@ static void cmd_cat(const char *name)
     }
     console_write(data);
     console_write("\n");
+    kfree((void *)data);
 }
 
 static void cmd_clear(void) { console_clear(); }
@@ -466,6 +497,535 @@ static void cmd_uptime(void)
     console_write("Uptime ticks: ");
     console_write(buf);
     console_write("\n");
+
+    uint32_t sec, nsec;
+    ktime_split(ktime_ns(), &sec, &nsec);
+    console_write("Monotonic:    ");
+    shell_write_u32(sec);
+    console_write(".");
+    uint32_t us = nsec / 1000;
+    for (uint32_t d = 100000; d > 1 && us < d; d /= 10)
+        console_putc('0');
+    shell_write_u32(us);
+    console_write(" s");
+    if (timer_tsc_khz()) {
+        console_write(" (TSC ");
+        shell_write_u32(timer_tsc_khz() / 1000);
+        console_write(" MHz)");
+    }
+    console_write("\n");
+
+    timer_stats_t ts;
+    timer_get_stats(&ts);
+    console_write("Timer IRQs:   ");
+    shell_write_u32(ts.irqs);
+    console_write(" (");
+    shell_write_u32(ts.idle_ticks);
+    console_write(" ticks spent in ");
+    shell_write_u32(ts.oneshots);
+    console_write(" tickless idle periods)\n");
+}
+
+static void cmd_kmem(void)
+{
+    kmalloc_stats_t hs;
+    kmalloc_get_stats(&hs);
+
+    console_write("Kernel heap size classes:\n");
+    console_write("    size  pages  in-use    allocs     frees\n");
+    for (int c = 0; c < KMALLOC_NUM_CLASSES; c++) {
+        kmalloc_class_stats_t cs;
+        if (kmalloc_get_class_stats(c, &cs) != 0)
+            continue;
+        shell_write_u32_pad(cs.obj_size, 8);
+        shell_write_u32_pad(cs.slab_pages, 7);
+        shell_write_u32_pad(cs.in_use, 8);
+        shell_write_u32_pad(cs.allocs, 10);
+        shell_write_u32_pad(cs.frees, 10);
+        console_write("\n");
+    }
+
+    console_write("  large: ");
+    shell_write_u32(hs.large_in_use);
+    console_write(" objects in ");
+    shell_write_u32(hs.large_pages);
+    console_write(" pages (");
+    shell_write_u32(hs.large_allocs);
+    console_write(" allocs, ");
+    shell_write_u32(hs.large_frees);
+    console_write(" frees)\n");
+
+    console_write("  heap pages: ");
+    shell_write_u32(hs.heap_pages);
+    console_write(", free: ");
+    shell_write_u32(hs.free_pages);
+    console_write(", failed allocs: ");
+    shell_write_u32(hs.failures);
+    console_write("\n");
+
+    kstack_stats_t ks;
+    kstack_get_stats(&ks);
+    console_write("Kernel stacks: ");
+    shell_write_u32(ks.live);
+    console_write(" live (");
+    shell_write_u32(ks.live_pages);
+    console_write(" pages), ");
+    shell_write_u32(ks.cached);
+    console_write(" cached (");
+    shell_write_u32(ks.cached_pages);
+    console_write(" pages), ");
+    shell_write_u32(ks.reused);
+    console_write(" of ");
+    shell_write_u32(ks.allocs);
+    console_write(" allocs reused, slots ");
+    shell_write_u32(ks.slots_used);
+    console_write("/");
+    shell_write_u32(KSTACK_SLOTS);
+    console_write("\n");
+
+    console_write("Physical frames: ");
+    shell_write_u32(phys_free_frames());
+    console_write(" free of ");
+    shell_write_u32(phys_total_frames());
+    console_write("\n");
+}
+
+static void cmd_vmstat(void)
+{
+    paging_stats_t ps;
+    paging_get_stats(&ps);
+
+    console_write("Address spaces: ");
+    shell_write_u32(ps.spaces);
+    console_write(", COW shared pages: ");
+    shell_write_u32(ps.cow_shared);
+    console_write(", COW faults: ");
+    shell_write_u32(ps.cow_faults);
+    console_write(" (");
+    shell_write_u32(ps.cow_copies);
+    console_write(" copied)\n");
+
+    console_write("Page faults: ");
+    shell_write_u32(ps.faults_minor);
+    console_write(" minor, ");
+    shell_write_u32(ps.faults_major);
+    console_write(" major, ");
+    shell_write_u32(ps.faults_bad);
+    console_write(" bad; ");
+    shell_write_u32(ps.demand_zero);
+    console_write(" zero-filled pages\n");
+
+    console_write("TLB: ");
+    shell_write_u32(ps.tlb_invlpg);
+    console_write(" invlpg, ");
+    shell_write_u32(ps.tlb_full_flushes);
+    console_write(" full flushes, ");
+    shell_write_u32(ps.tlb_shootdowns);
+    console_write(" shootdowns, ");
+    shell_write_u32(ps.tlb_skipped);
+    console_write(" skipped (new mappings), ");
+    shell_write_u32(ps.range_ops);
+    console_write(" range ops\n");
+}
+
+/* free blocks per order, plus how much free memory is unusable for an
+ * allocation of that order because it sits in smaller blocks
+ */
+static void cmd_buddyinfo(void)
+{
+    phys_frag_stats_t st;
+    phys_get_frag_stats(&st);
+
+    uint32_t free_total = 0;
+    for (int o = 0; o <= PHYS_MAX_ORDER; o++)
+        free_total += st.free_blocks[o] << o;
+
+    console_write("order  free-blocks  unusable%   allocs    frees  failed\n");
+
+    uint32_t usable = free_total;
+    for (int o = 0; o <= PHYS_MAX_ORDER; o++) {
+        uint32_t unusable = free_total ? ((free_total - usable) * 100u) / free_total : 0;
+
+        shell_write_u32_pad(o, 5);
+        shell_write_u32_pad(st.free_blocks[o], 13);
+        shell_write_u32_pad(unusable, 11);
+        shell_write_u32_pad(st.allocs[o], 9);
+        shell_write_u32_pad(st.frees[o], 9);
+        shell_write_u32_pad(st.failures[o], 8);
+        console_write("\n");
+
+        usable -= st.free_blocks[o] << o;
+    }
+}
+
+static inline uint64_t shell_rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* cycles per operation, saturated to what shell_write_u32 can print */
+static uint32_t cycles_per(uint64_t cycles, uint32_t n)
+{
+    uint64_t q = div_u64_rem(cycles, n, 0);
+    return q > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)q;
+}
+
+#define PHYSBENCH_FRAMES 500000u
+
+/* Allocate up to 500k frames, then free them all, and report the average
+ * cost of each call in TSC cycles. Frame addresses are kept in a heap
+ * array so the benchmark never touches the frames themselves.
+ */
+static void cmd_physbench(void)
+{
+    uint32_t target = PHYSBENCH_FRAMES;
+    uint32_t avail  = phys_free_frames();
+
+    /* leave headroom for the address array and the rest of the kernel */
+    avail = (avail > 4096) ? avail - 4096 : 0;
+    if (target > avail)
+        target = avail;
+    if (target == 0) {
+        console_write("physbench: not enough free frames\n");
+        return;
+    }
+
+    uint32_t *frames = kmalloc(target * sizeof(uint32_t));
+    if (!frames) {
+        console_write("physbench: cannot allocate address array\n");
+        return;
+    }
+
+    uint32_t n = 0;
+    uint64_t t0 = shell_rdtsc();
+    while (n < target) {
+        uint32_t f = phys_alloc_frame();
+        if (!f)
+            break;
+        frames[n++] = f;
+    }
+    uint64_t t1 = shell_rdtsc();
+    for (uint32_t i = 0; i < n; i++)
+        phys_free_frame(frames[i]);
+    uint64_t t2 = shell_rdtsc();
+
+    kfree(frames);
+
+    if (n == 0) {
+        console_write("physbench: no frames allocated\n");
+        return;
+    }
+
+    console_write("physbench: ");
+    shell_write_u32(n);
+    console_write(" frames\n  alloc: ");
+    shell_write_u32(cycles_per(t1 - t0, n));
+    console_write(" cycles/frame\n  free:  ");
+    shell_write_u32(cycles_per(t2 - t1, n));
+    console_write(" cycles/frame\n");
+}
+
+/* ---------------- ctxbench ---------------- */
+
+extern void switch_task(cpu_state_t *old, cpu_state_t *new);
+extern void switch_stack(uint32_t *old_esp, uint32_t new_esp);
+
+#define CTXBENCH_ROUNDS 10000u
+#define CTXBENCH_STACK  1024
+
+static cpu_state_t bench_home_regs, bench_peer_regs;
+static uint32_t    bench_home_esp,  bench_peer_esp;
+static uint32_t    bench_stack[CTXBENCH_STACK];
+
+static void bench_peer_full(void)
+{
+    for (;;)
+        switch_task(&bench_peer_regs, &bench_home_regs);
+}
+
+static void bench_peer_stack(void)
+{
+    for (;;)
+        switch_stack(&bench_peer_esp, bench_home_esp);
+}
+
+/* cycles per switch, ping-ponging with a peer on its own stack */
+static uint32_t ctxbench_full(void)
+{
+    uint32_t *top = &bench_stack[CTXBENCH_STACK];
+
+    for (int i = 0; i < (int)(sizeof(cpu_state_t) / 4); i++)
+        ((uint32_t*)&bench_peer_regs)[i] = 0;
+    bench_peer_regs.eip    = (uint32_t)bench_peer_full;
+    bench_peer_regs.esp    = (uint32_t)(top - 1);
+    bench_peer_regs.eflags = 0x002;     /* interrupts stay off */
+    bench_peer_regs.cs     = 0x08;
+    bench_peer_regs.ds = bench_peer_regs.es = bench_peer_regs.fs = 0x10;
+    bench_peer_regs.gs = bench_peer_regs.ss = 0x10;
+
+    uint64_t t0 = shell_rdtsc();
+    for (uint32_t i = 0; i < CTXBENCH_ROUNDS; i++)
+        switch_task(&bench_home_regs, &bench_peer_regs);
+    uint64_t t1 = shell_rdtsc();
+
+    return cycles_per(t1 - t0, 2 * CTXBENCH_ROUNDS);
+}
+
+static uint32_t ctxbench_stack(void)
+{
+    /* same initial frame task_alloc builds: edi, esi, ebx, ebp, ret */
+    uint32_t *sp = &bench_stack[CTXBENCH_STACK];
+    *--sp = 0;
+    *--sp = (uint32_t)bench_peer_stack;
+    for (int i = 0; i < 4; i++)
+        *--sp = 0;
+    bench_peer_esp = (uint32_t)sp;
+
+    uint64_t t0 = shell_rdtsc();
+    for (uint32_t i = 0; i < CTXBENCH_ROUNDS; i++)
+        switch_stack(&bench_home_esp, bench_peer_esp);
+    uint64_t t1 = shell_rdtsc();
+
+    return cycles_per(t1 - t0, 2 * CTXBENCH_ROUNDS);
+}
+
+static void cmd_ctxbench(void)
+{
+    uint32_t flags = irq_save();
+    uint32_t full  = ctxbench_full();
+    uint32_t slim  = ctxbench_stack();
+    irq_restore(flags);
+
+    console_write("ctxbench: ");
+    shell_write_u32(CTXBENCH_ROUNDS * 2);
+    console_write(" switches each\n  full register file (switch_task): ");
+    shell_write_u32(full);
+    console_write(" cycles/switch\n  callee-saved only (switch_stack): ");
+    shell_write_u32(slim);
+    console_write(" cycles/switch\n");
+
+    fpu_stats_t fs;
+    fpu_get_stats(&fs);
+    console_write("lazy FPU: ");
+    shell_write_u32(fs.traps);
+    console_write(" #NM traps, ");
+    shell_write_u32(fs.saves);
+    console_write(" saves, ");
+    shell_write_u32(fs.restores);
+    console_write(" restores, ");
+    shell_write_u32(fs.inits);
+    console_write(" first uses\n");
+}
+
+/* ---------------- ps / top ---------------- */
+
+#define PS_MAX_TASKS 64
+
+static const char *task_state_name(int state)
+{
+    switch (state) {
+    case TASK_RUNNING: return "run";
+    case TASK_READY:   return "ready";
+    case TASK_BLOCKED: return "sleep";
+    case TASK_ZOMBIE:  return "zombie";
+    default:           return "?";
+    }
+}
+
+static const char *task_prio_name(int prio)
+{
+    static const char *names[TASK_NUM_PRIOS] = { "bh", "inter", "batch", "idle" };
+    return (prio >= 0 && prio < TASK_NUM_PRIOS) ? names[prio] : "?";
+}
+
+static void shell_write_str_pad(const char *str, int width)
+{
+    int len = 0;
+    while (str[len]) len++;
+    console_write(str);
+    for (int i = len; i < width; i++)
+        console_putc(' ');
+}
+
+/* one row; heap is shown in KB and may be negative (freed others' memory) */
+static void ps_row(const task_info_t *ti, uint32_t ticks)
+{
+    int32_t heap_kb = ti->heap_bytes / 1024;
+
+    shell_write_u32_pad((uint32_t)ti->id, 4);
+    console_write(" ");
+    shell_write_str_pad(ti->name, 10);
+    shell_write_str_pad(task_state_name(ti->state), 7);
+    shell_write_str_pad(task_prio_name(ti->priority), 6);
+    shell_write_u32_pad(ticks, 8);
+    shell_write_u32_pad(ti->switches, 8);
+    shell_write_u32_pad(ti->syscalls, 8);
+    if (heap_kb < 0) {
+        shell_write_u32_pad((uint32_t)-heap_kb, 6);
+        console_write("-");
+    } else {
+        shell_write_u32_pad((uint32_t)heap_kb, 6);
+        console_write(" ");
+    }
+    shell_write_u32_pad(ti->stack_size / 1024, 6);
+    shell_write_u32_pad((uint32_t)ti->cpu, 4);
+}
+
+static const char *ps_header =
+    "  ID NAME      STATE  PRIO     TICKS  SWITCH SYSCALL HEAPKB STKKB CPU";
+
+static void cmd_ps(void)
+{
+    static task_info_t tasks[PS_MAX_TASKS];
+    int n = task_snapshot(tasks, PS_MAX_TASKS);
+
+    console_write(ps_header);
+    console_write("\n");
+    for (int i = 0; i < n; i++) {
+        ps_row(&tasks[i], tasks[i].cpu_ticks);
+        console_write("\n");
+    }
+}
+
+static void cmd_cpus(void)
+{
+    static cpu_info_t cpus[SMP_MAX_CPUS];
+    int n = task_cpu_snapshot(cpus, SMP_MAX_CPUS);
+
+    console_write("CPU APIC    TICKS     IDLE  SWITCH  STEALS READY CURRENT\n");
+    for (int i = 0; i < n; i++) {
+        shell_write_u32_pad((uint32_t)cpus[i].cpu, 3);
+        shell_write_u32_pad(smp_cpu_apic_id(cpus[i].cpu), 5);
+        shell_write_u32_pad(cpus[i].ticks, 9);
+        shell_write_u32_pad(cpus[i].idle_ticks, 9);
+        shell_write_u32_pad(cpus[i].switches, 8);
+        shell_write_u32_pad(cpus[i].steals, 8);
+        shell_write_u32_pad(cpus[i].nr_ready, 6);
+        console_write(" ");
+        console_write(cpus[i].current ? cpus[i].current : "-");
+        console_write("\n");
+    }
+}
+
+#define LOCKS_MAX 32
+
+static void cmd_locks(void)
+{
+    static lock_info_t locks[LOCKS_MAX];
+    int n = lock_snapshot(locks, LOCKS_MAX);
+
+    console_write("NAME      KIND    ACQUIRES CONTENDED   WAITUS   HOLDUS  MAXHOLD\n");
+    for (int i = 0; i < n; i++) {
+        shell_write_str_pad(locks[i].name, 10);
+        shell_write_str_pad(lock_kind_name(locks[i].kind), 6);
+        shell_write_u32_pad(locks[i].acquires, 10);
+        shell_write_u32_pad(locks[i].contended, 10);
+        shell_write_u32_pad(locks[i].wait_us, 9);
+        shell_write_u32_pad(locks[i].hold_us, 9);
+        shell_write_u32_pad(locks[i].max_hold_us, 9);
+        console_write("\n");
+    }
+}
+
+static void cmd_df(void)
+{
+    fs_stats_t st;
+    fs_get_stats(&st);
+
+    uint32_t kb_per_block = st.block_size / 1024;
+
+    console_write("Device:  ");
+    console_write(st.dev_name ? st.dev_name : "?");
+    console_write(" (mounted ");
+    shell_write_u32(st.mounts);
+    console_write(" times)\n");
+    console_write("Blocks:  ");
+    shell_write_u32((st.total_blocks - st.free_blocks) * kb_per_block);
+    console_write(" KB used, ");
+    shell_write_u32(st.free_blocks * kb_per_block);
+    console_write(" KB free of ");
+    shell_write_u32(st.total_blocks * kb_per_block);
+    console_write(" KB\n");
+    console_write("Inodes:  ");
+    shell_write_u32(st.total_inodes - st.free_inodes);
+    console_write(" used, ");
+    shell_write_u32(st.free_inodes);
+    console_write(" free\n");
+    console_write("I/O:     ");
+    shell_write_u32(st.block_reads);
+    console_write(" block reads, ");
+    shell_write_u32(st.block_writes);
+    console_write(" block writes\n");
+    console_write("Cached:  ");
+    shell_write_u32(st.nodes_cached);
+    console_write(" nodes, ");
+    shell_write_u32(st.dirs_loaded);
+    console_write(" directories loaded\n");
+    console_write("Lookups: ");
+    shell_write_u32(st.lookup_hits);
+    console_write(" hits, ");
+    shell_write_u32(st.lookup_neg_hits);
+    console_write(" negative hits, ");
+    shell_write_u32(st.lookup_misses);
+    console_write(" misses\n");
+    console_write("Open:    ");
+    shell_write_u32(st.open_files);
+    console_write(" files\n");
+}
+
+/* like ps, but ticks (and CPU%) since the previous top, busiest first */
+static void cmd_top(void)
+{
+    static task_info_t tasks[PS_MAX_TASKS];
+    static int         prev_id[PS_MAX_TASKS];
+    static uint32_t    prev_ticks[PS_MAX_TASKS];
+    static int         prev_n = 0;
+    static uint32_t    prev_now = 0;
+
+    uint32_t delta[PS_MAX_TASKS];
+    int      order[PS_MAX_TASKS];
+    int      n = task_snapshot(tasks, PS_MAX_TASKS);
+    uint32_t now = timer_get_ticks();
+    uint32_t window = now - prev_now;
+
+    for (int i = 0; i < n; i++) {
+        delta[i] = tasks[i].cpu_ticks;
+        for (int j = 0; j < prev_n; j++) {
+            if (prev_id[j] == tasks[i].id) {
+                delta[i] -= prev_ticks[j];
+                break;
+            }
+        }
+
+        /* insertion sort by delta, descending */
+        int k = i;
+        while (k > 0 && delta[order[k - 1]] < delta[i]) {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+    }
+
+    console_write("top: last ");
+    shell_write_u32(window);
+    console_write(" ticks\n");
+    console_write(ps_header);
+    console_write("  CPU%\n");
+    for (int i = 0; i < n; i++) {
+        int t = order[i];
+        ps_row(&tasks[t], delta[t]);
+        shell_write_u32_pad(window ? (delta[t] * 100u) / window : 0, 6);
+        console_write("\n");
+    }
+
+    for (int i = 0; i < n; i++) {
+        prev_id[i]    = tasks[i].id;
+        prev_ticks[i] = tasks[i].cpu_ticks;
+    }
+    prev_n   = n;
+    prev_now = now;
 }
 
 static void cmd_echo(const char *msg)
@@ -510,7 +1070,7 @@ static void shell_execute(const char *cmd)
         console_write("Available commands:\n");
         console_write("  help          - show this message\n");
         console_write("  clear         - clear the screen\n");
-        console_write("  uptime        - show ticks since boot\n");
+        console_write("  uptime        - show ticks, clock and timer IRQs\n");
         console_write("  echo X        - print X\n");
         console_write("  panic         - cause an exception\n");
         console_write("  ls            - list directory\n");
@@ -519,6 +1079,7 @@ static void shell_execute(const char *cmd)
         console_write("  mkdir <name>  - make directory\n");
         console_write("  touch <name>  - create/update file\n");
         console_write("  write f txt   - write text to file\n");
+        console_write("  append f txt  - add a line of text to a file\n");
         console_write("  cat <name>    - show file contents\n");
         console_write("  rm <file>     - remove a file\n");
         console_write("  rmdir <dir>   - remove an empty directory\n");
@@ -531,6 +1092,16 @@ static void shell_execute(const char *cmd)
         console_write("  login <user>  - switch user\n");
         console_write("  log           - show audit log\n");
         console_write("  sysinfo       - show information about the system\n");
+        console_write("  kmem          - kernel heap usage per size class\n");
+        console_write("  physbench     - time allocating/freeing 500k frames\n");
+        console_write("  ctxbench      - cycles per context switch\n");
+        console_write("  ps            - list tasks with their counters\n");
+        console_write("  top           - tasks by CPU use since the last top\n");
+        console_write("  cpus          - per-CPU scheduler counters\n");
+        console_write("  locks [reset] - lock acquire/contention/hold counters\n");
+        console_write("  buddyinfo     - contiguous free blocks per order\n");
+        console_write("  df            - filesystem space, inodes and block I/O\n");
+        console_write("  vmstat        - address spaces, page faults, TLB flushes\n");
         console_write("  exit          - shutdown the system\n");
 
     }
@@ -538,12 +1109,58 @@ static void shell_execute(const char *cmd)
         cmd_clear();
     else if (!kstrcmp(cmd, "sysinfo")) {
         console_write("Hypnos system info:\n");
-        console_write("  Logical RAM:  2 GB\n");
-        console_write("  Logical disk: 16 GB\n");
-        console_write("  Actual ramdisk size: 16 MB\n");
+        console_write("  Usable RAM:   ");
+        shell_write_u32(phys_total_frames() / 256);
+        console_write(" MB (");
+        shell_write_u32(phys_free_frames() / 256);
+        console_write(" MB free)\n");
+        block_device_t *disk = blockdev_get_root();
+        if (disk) {
+            fs_stats_t fst;
+            fs_get_stats(&fst);
+            console_write("  Root disk:    ");
+            console_write(disk->name);
+            console_write(", ");
+            shell_write_u32((uint32_t)(disk->num_sectors >> 11));
+            console_write(" MB (filesystem in the first ");
+            shell_write_u32(fst.total_blocks / (1024 * 1024 / fst.block_size));
+            console_write(" MB)\n");
+        }
+
+        keyboard_stats_t ks;
+        keyboard_get_stats(&ks);
+        console_write("  Keyboard: ");
+        shell_write_u32(ks.scancodes);
+        console_write(" scancodes, ");
+        shell_write_u32(ks.dropped);
+        console_write(" dropped, ring peak ");
+        shell_write_u32(ks.max_queued);
+        console_write("\n");
     }
     else if (!kstrcmp(cmd, "uptime"))
         cmd_uptime();
+    else if (!kstrcmp(cmd, "kmem"))
+        cmd_kmem();
+    else if (!kstrcmp(cmd, "vmstat"))
+        cmd_vmstat();
+    else if (!kstrcmp(cmd, "physbench"))
+        cmd_physbench();
+    else if (!kstrcmp(cmd, "ctxbench"))
+        cmd_ctxbench();
+    else if (!kstrcmp(cmd, "ps"))
+        cmd_ps();
+    else if (!kstrcmp(cmd, "top"))
+        cmd_top();
+    else if (!kstrcmp(cmd, "cpus"))
+        cmd_cpus();
+    else if (!kstrcmp(cmd, "locks"))
+        cmd_locks();
+    else if (!kstrcmp(cmd, "locks reset"))
+        lock_stats_reset();
+    else if (!kstrcmp(cmd, "buddyinfo"))
+        cmd_buddyinfo();
+    else if (!kstrcmp(cmd, "df"))
+        cmd_df();
     else if (!kstrncmp(cmd, "echo ", 5))
         cmd_echo(cmd + 5);
     else if (!kstrncmp(cmd, "diskread ", 9))
@@ -598,9 +1215,10 @@ static void shell_execute(const char *cmd)
     else if (!kstrncmp(cmd, "touch ", 6))
         cmd_touch(cmd + 6);
     else if (!kstrcmp(cmd, "runuser")) {
-        console_write("Launching first user program in Ring 3...\n");
+        console_write("Launching user program in Ring 3...\n");
         log_event("[SHELL] runuser invoked.");
-        switch_to_user_mode();
+        if (!user_process_spawn("user"))
+            console_write("runuser: could not start process.\n");
     }
     else if (!kstrncmp(cmd, "cat ", 4))
     {
@@ -611,14 +1229,27 @@ static void shell_execute(const char *cmd)
         if (sec_require_perm(PERM_READ, "read file") != 0)
             return;
 
-        const char *data = fs_read(name);
-        if (!data)
+        /* a chunk at a time, so large files need no big buffer */
+        static char chunk[257];
+        uint32_t total = 0;
+        int fd = fs_open(name, FS_O_READ);
+        int n;
+
+        while (fd >= 0 && (n = fs_fread(fd, chunk, sizeof(chunk) - 1)) > 0)
+        {
+            chunk[n] = '\0';
+            console_write(chunk);
+            total += (uint32_t)n;
+        }
+        if (fd >= 0)
+            fs_close(fd);
+
+        if (total == 0)
         {
             console_write("cat: no such file or empty.\n");
             log_event("fs: read fail");
             return;
         }
-        console_write(data);
         console_write("\n");
         log_event("fs: read");
     }
@@ -716,6 +1347,53 @@ static void shell_execute(const char *cmd)
             log_event("fs: write error");
         }
     }
+    else if (!kstrncmp(cmd, "append ", 7))
+    {
+        const char *p = cmd + 7;
+
+        while (*p == ' ')
+            p++;
+
+        char name[32];
+        int i = 0;
+
+        while (*p && *p != ' ' && i < (int)sizeof(name) - 1)
+            name[i++] = *p++;
+        name[i] = '\0';
+
+        while (*p == ' ')
+            p++;
+
+        if (!name[0] || !*p)
+        {
+            console_write("Usage: append <name> <text>\n");
+            return;
+        }
+
+        if (sec_require_perm(PERM_WRITE, "write file") != 0)
+            return;
+
+        /* the text as one line */
+        char line[SHELL_INPUT_MAX + 1];
+        uint32_t len = 0;
+        while (p[len])
+        {
+            line[len] = p[len];
+            len++;
+        }
+        line[len++] = '\n';
+
+        if (fs_append(name, line, len) == 0)
+        {
+            console_write("Line appended.\n");
+            log_event("fs: append");
+        }
+        else
+        {
+            console_write("append: error.\n");
+            log_event("fs: append error");
+        }
+    }
     else if (!kstrncmp(cmd, "rm ", 3))
     {
         const char *p = cmd + 3;
@@ -865,18 +1543,19 @@ void shell_keypress(char c) {
 
 
 
-void shell_tick(void) {
-    static int counter = 0;
+/* redraw the status bar once a second */
+static ktimer_t status_timer;
 
-    counter++;
-    if (counter >= 100) {
-        counter = 0;
-        shell_draw_status_bar();
-    }
+static void shell_status_tick(void *arg)
+{
+    (void)arg;
+    shell_draw_status_bar();
 }
 
 void shell_init(void) {
     input_len = 0;
+    timer_init(&status_timer, shell_status_tick, 0);
+    timer_add(&status_timer, 100, 100);
     log_event("[SHELL] shell_init");
 }
 
@@ -885,10 +1564,7 @@ void shell_run(void)
     log_event("[SHELL] shell_run loop starting.");
     shell_print_prompt();
 
-    for (;;) {
-        /* sleep until any interrupt (timer / keyboard) */
-        __asm__ volatile("hlt");
-        /* give other tasks a chance to run */
-        task_yield();
-    }
+    /* IRQ1 only queues scancodes; commands run here, in task context */
+    for (;;)
+        shell_keypress(keyboard_getc());
 }
@@ -2,4 +2,3 @@
 
 void shell_init(void);
 void shell_run(void);
-void shell_tick(void);
@@ -2,6 +2,9 @@
 #include "console.h"
 #include "arch/i386/cpu/idt.h"
 #include "arch/i386/drivers/timer.h"
+#include "arch/i386/mm/paging.h"
+#include "sched/task.h"
+#include "arch/i386/cpu/smp.h"
 
 static void kprint_u32(uint32_t v)
 {
@@ -44,21 +47,34 @@ void syscall_init(void)
 }
 
 
-__attribute__((cdecl))
-__attribute__((noinline))
-uint32_t syscall_handler(uint32_t num,
-                         uint32_t a1,
-                         uint32_t a2,
-                         uint32_t a3)
+/* longest string SYS_PUTS prints, NUL included */
+#define SYS_PUTS_MAX 1024
+
+static uint32_t syscall_dispatch(uint32_t num, uint32_t a1)
 {
     switch (num) {
-    case SYS_PUTS:
-        console_write((const char*)a1);
+    case SYS_PUTS: {
+        /* dispatch runs under the BKL, so one buffer is enough */
+        static char buf[SYS_PUTS_MAX];
+
+        /* copied in first: the string must lie entirely in user space */
+        int len = paging_copy_user_string(buf, a1, SYS_PUTS_MAX);
+        if (len < 0 || len == SYS_PUTS_MAX - 1)
+            return (uint32_t)-1;
+        console_write(buf);
         return 0;
+    }
 
     case SYS_GET_TICKS:
         return timer_get_ticks();
 
+    case SYS_YIELD:
+        task_yield();
+        return 0;
+
+    case SYS_EXIT:
+        task_exit((int)a1);
+
     default:
         console_write("[KERNEL] Unknown syscall: ");
         kprint_u32(num);
@@ -66,3 +82,23 @@ uint32_t syscall_handler(uint32_t num,
         return (uint32_t)-1;
     }
 }
+
+__attribute__((cdecl))
+__attribute__((noinline))
+uint32_t syscall_handler(uint32_t num,
+                         uint32_t a1,
+                         uint32_t a2,
+                         uint32_t a3)
+{
+    (void)a2;
+    (void)a3;
+
+    task_count_syscall();
+
+    /* user code runs on any CPU; the kernel side is serialized */
+    bkl_lock();
+    uint32_t ret = syscall_dispatch(num, a1);
+    bkl_unlock();
+
+    return ret;
+}
@@ -4,6 +4,8 @@
 enum {
     SYS_PUTS      = 1,
     SYS_GET_TICKS = 2,
+    SYS_YIELD     = 3,
+    SYS_EXIT      = 4,
     // add more later
 };
 
@@ -4,6 +4,8 @@
 enum {
     SYS_PUTS      = 1,
     SYS_GET_TICKS = 2,
+    SYS_YIELD     = 3,
+    SYS_EXIT      = 4,
 };
 
 static inline uint32_t sys_call3(uint32_t num,
@@ -28,3 +30,13 @@ static inline uint32_t sys_get_ticks(void)
 {
     return sys_call3(SYS_GET_TICKS, 0, 0, 0);
 }
+
+static inline void sys_yield(void)
+{
+    (void)sys_call3(SYS_YIELD, 0, 0, 0);
+}
+
+static inline void sys_exit(int code)
+{
+    (void)sys_call3(SYS_EXIT, (uint32_t)code, 0, 0);
+}
@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include "user/user_process.h"
+#include "user/user_program.h"
+#include "arch/i386/mm/paging.h"
+#include "console.h"
+#include "log.h"
+
+/* from linker.ld: the .user section is linked at USER_BASE and loaded
+ * at user_image_load (physical, inside the identity map)
+ */
+extern uint8_t user_image_start[];
+extern uint8_t user_image_end[];
+extern uint8_t user_image_load[];
+
+/*
+ * The template space describes the program once: the image (filled from
+ * the loaded copy), a heap and a stack, all as demand-paged regions, so
+ * a process only gets frames for pages it actually touches. Every process
+ * is a copy-on-write clone of the template.
+ */
+static addr_space_t* template_space = 0;
+
+static addr_space_t* build_template(void)
+{
+    addr_space_t* as = paging_create_space();
+    if (!as)
+        return 0;
+
+    uint32_t start = (uint32_t)user_image_start;
+    uint32_t end   = (uint32_t)user_image_end;
+
+    if (paging_reserve_user(as, start, end, PAGE_RW,
+                            (uint32_t)user_image_load, end - start) != 0 ||
+        paging_reserve_user(as, USER_HEAP_BASE, USER_HEAP_BASE + USER_HEAP_SIZE,
+                            PAGE_RW, 0, 0) != 0 ||
+        paging_reserve_user(as, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP,
+                            PAGE_RW, 0, 0) != 0) {
+        paging_destroy_space(as);
+        return 0;
+    }
+
+    return as;
+}
+
+task_t* user_process_spawn(const char* name)
+{
+    if (!template_space) {
+        template_space = build_template();
+        if (!template_space) {
+            console_write("user: cannot build program image.\n");
+            return 0;
+        }
+    }
+
+    addr_space_t* as = paging_clone_space(template_space);
+    if (!as) {
+        console_write("user: out of memory for address space.\n");
+        return 0;
+    }
+
+    task_t* t = task_create_user(as, (uint32_t)user_program_main,
+                                 USER_STACK_TOP, name);
+    if (!t) {
+        paging_destroy_space(as);
+        return 0;
+    }
+
+    /* nobody joins it; the reaper frees everything when it exits */
+    task_detach(t);
+
+    log_event("[USER] process spawned.");
+    return t;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "sched/task.h"
+
+/* Reserved at spawn, backed by zero-filled frames only once touched */
+#define USER_STACK_TOP    USER_END
+#define USER_STACK_SIZE   0x00100000u   /* 1MB */
+#define USER_HEAP_BASE    0x90000000u
+#define USER_HEAP_SIZE    0x10000000u   /* 256MB */
+
+/* Start another copy of the ring-3 program in its own address space */
+task_t* user_process_spawn(const char* name);
@@ -5,10 +5,13 @@ void user_program_main(void)
 {
     sys_puts("[USER] Hello...\n");
 
-    for (;;) {
+    for (int n = 0; n < 50; n++) {
         sys_puts(".");
         for (volatile int i = 0; i < 5000000; i++) { }
     }
+
+    sys_puts("\n[USER] done.\n");
+    sys_exit(0);
     // sys_puts("[USER] Hello from Ring 3 via syscall!!!\n");
     // uint32_t last = 0;
 